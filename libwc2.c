@@ -0,0 +1,1157 @@
+/*
+    The state-machine engine behind 'wc2'. See 'libwc2.h' for how to
+    use it. Everything here is reentrant: the state-machine is built
+    into a 'wc2_machine' object rather than global tables, and the
+    locale is looked up with 'newlocale()' rather than changing the
+    global locale with 'setlocale()'.
+*/
+#define _CRT_SECURE_NO_WARNINGS
+#include "libwc2.h"
+#include <ctype.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#ifdef __APPLE__
+#include <xlocale.h>
+#endif
+
+/* Windows calls the thread-safe locale functions something else */
+#ifdef _WIN32
+typedef _locale_t wc2_locale_t;
+#define newlocale_ctype(name) _create_locale(LC_CTYPE, name)
+#define freelocale _free_locale
+#define isspace_l _isspace_l
+#define iswspace_l _iswspace_l
+#else
+typedef locale_t wc2_locale_t;
+#define newlocale_ctype(name) newlocale(LC_CTYPE_MASK, name, (locale_t)0)
+#endif
+
+/*
+| bytes | bits |  first  |   last   |   byte1  |   byte2  |   byte3  |   byte4  |
+|:-----:|:----:|:-------:|:--------:|:--------:|:--------:|:--------:|:--------:|
+|   1   |    7 |  U+0000 |   U+007F | 0xxxxxxx |          |          |          |
+|   2   |   11 |  U+0080 |   U+07FF | 110xxxxx | 10xxxxxx |          |          |
+|   3   |   16 |  U+0800 |   U+FFFF | 1110xxxx | 10xxxxxx | 10xxxxxx |          |
+|   4   |   21 | U+10000 | U+10FFFF | 11110xxx | 10xxxxxx | 10xxxxxx | 10xxxxxx |
+ */
+enum {
+    DUO2_xx,
+    DUO2_C2,
+    TRI2_E0,
+    TRI2_E1,
+    TRI2_E2,
+    TRI2_E3,
+    TRI2_ED,
+    TRI2_EE,
+    TRI2_xx,
+    TRI3_E0_xx,
+    TRI3_E1_xx,
+    TRI3_E1_9a,
+    TRI3_E2_80,
+    TRI3_E2_81,
+    TRI3_E2_xx,
+    TRI3_E3_80,
+    TRI3_E3_81,
+    TRI3_E3_xx,
+    TRI3_Ed_xx,
+    TRI3_Ee_xx,
+    TRI3_xx_xx,
+    QUAD2_xx,
+    QUAD2_F0,
+    QUAD2_F4,
+    QUAD3_xx_xx,
+    QUAD3_F0_xx,
+    QUAD3_F4_xx,
+    QUAD4_xx_xx_xx,
+    QUAD4_F0_xx_xx,
+    QUAD4_F4_xx_xx,
+    ILLEGAL
+};
+
+enum {
+    WASSPACE = 0,
+    NEWLINE,
+    NEWWORD,
+    WASWORD,
+    USPACE,
+    UWORD=USPACE+ILLEGAL+1,
+    STATE_MAX=UWORD+ILLEGAL+1
+};
+
+/* The public header has to know how many states there are */
+typedef char assert_state_max[((int)STATE_MAX == (int)WC2_STATE_MAX) ? 1 : -1];
+
+/**
+ * The compiled state-machine. The second table is a translation of the
+ * first, using pointers instead of integer offsets, to remove one
+ * calculation in the inner-loop of 'wc2_parse_pp()'. The rest is for
+ * the engines that don't use the state-machine: a table of which bytes
+ * are spaces, and the locale itself for 'mbrtowc()'.
+ */
+struct wc2_machine {
+    unsigned char table[STATE_MAX][256];
+    void *table_p[STATE_MAX][256];
+    unsigned char is_space[256];
+    int is_multibyte;
+    wc2_locale_t loc;
+};
+
+/**
+ * Translate from a numeric pointer to somehwere in 'table_p' to
+ * the integer row number for 'table'.
+ */
+#define PSTATE(table_p, p) (((char*)(p) - (char*)(table_p))/(256 * sizeof(void*)))
+
+/**
+ * Build an ASCII row. This configures low-order 7-bits, which should
+ * be roughly the same for all states
+ */
+static void
+build_basic(unsigned char *row, unsigned char default_state, unsigned char ubase, wc2_locale_t loc)
+{
+    unsigned c;
+    for (c=0; c<256; c++) {
+        if ((c & 0x80)) {
+            if ((c & 0xE0) == 0xC0) {
+                /* 110x xxxx - unicode 2 byte sequence */
+                if (c < 0xC2)
+                    row[c] = ubase + ILLEGAL;
+                else if (c == 0xC2)
+                    row[c] = ubase + DUO2_C2;
+                else
+                    row[c] = ubase + DUO2_xx;
+            } else if ((c & 0xF0) == 0xE0) {
+                /* 1110 xxxx - unicode 3 byte sequence */
+                switch (c) {
+                    case 0xE0:
+                        row[c] = ubase + TRI2_E0;
+                        break;
+                    case 0xE1:
+                        row[c] = ubase + TRI2_E1;
+                        break;
+                    case 0xE2:
+                        row[c] = ubase + TRI2_E2;
+                        break;
+                    case 0xE3:
+                        row[c] = ubase + TRI2_E3;
+                        break;
+                    case 0xEd:
+                        row[c] = ubase + TRI2_ED;
+                        break;
+                    case 0xEe:
+                        row[c] = ubase + TRI2_EE;
+                        break;
+                    default:
+                        row[c] = ubase + TRI2_xx;
+                        break;
+                }
+            } else if ((c & 0xF8) == 0xF0) {
+                if (c >= 0xF5)
+                    row[c] = ubase + ILLEGAL;
+                else if (c == 0xF0)
+                    row[c] = ubase + QUAD2_F0;
+                else if (c == 0xF4)
+                    row[c] = ubase + QUAD2_F4;
+                else
+                    row[c] = ubase + QUAD2_xx;
+            } else
+                row[c] = ubase + ILLEGAL;
+        } else if (c == '\n')
+            row[c] = NEWLINE;
+        else if (isspace_l(c, loc))
+            row[c] = WASSPACE;
+        else
+            row[c] = default_state;
+    }
+}
+
+static void
+build_WASSPACE(unsigned char *row, wc2_locale_t loc)
+{
+    build_basic(row, NEWWORD, USPACE, loc);
+}
+
+static void
+build_WASWORD(unsigned char *row, wc2_locale_t loc)
+{
+    build_basic(row, WASWORD, UWORD, loc);
+}
+
+
+static void
+build_urow(unsigned char (*table)[256], unsigned ubase, unsigned id, unsigned next)
+{
+    size_t i;
+    unsigned default_state;
+
+    default_state = table[ubase + ILLEGAL][0];
+
+    if (next == 0)
+        next = default_state;
+    else
+        next = ubase + next;
+
+    /* Anything but a continuation byte ends the sequence, which is
+     * illegal, and starts over with that byte, like 'mbrtowc()' does */
+    memcpy(table[ubase + id], table[ubase + ILLEGAL], 256);
+
+    for (i=0x80; i<0xC0; i++) {
+        table[ubase + id][i] = next;
+    }
+
+}
+static void
+build_unicode(unsigned char (*table)[256], unsigned char default_state, unsigned ubase, wc2_locale_t loc)
+{
+    size_t i;
+
+    build_basic(table[ubase + ILLEGAL], default_state, ubase, loc);
+
+    /*
+     * Two byte
+     */
+    build_urow(table, ubase, DUO2_xx, 0);
+    build_urow(table, ubase, DUO2_C2, 0);
+
+    /*
+     * Three byte
+     */
+    build_urow(table, ubase, TRI2_E0, TRI3_E0_xx);
+    build_urow(table, ubase, TRI2_E1, TRI3_E1_xx);
+    build_urow(table, ubase, TRI2_E2, TRI3_E2_xx);
+    build_urow(table, ubase, TRI2_E3, TRI3_E3_xx);
+    build_urow(table, ubase, TRI2_ED, TRI3_Ed_xx);
+    build_urow(table, ubase, TRI2_EE, TRI3_Ee_xx);
+    build_urow(table, ubase, TRI2_xx, TRI3_xx_xx);
+
+    build_urow(table, ubase, TRI3_E0_xx, 0);
+    build_urow(table, ubase, TRI3_E1_xx, 0);
+    build_urow(table, ubase, TRI3_E1_9a, 0);
+    build_urow(table, ubase, TRI3_E2_80, 0);
+    build_urow(table, ubase, TRI3_E2_81, 0);
+    build_urow(table, ubase, TRI3_E2_xx, 0);
+    build_urow(table, ubase, TRI3_E3_80, 0);
+    build_urow(table, ubase, TRI3_E3_81, 0);
+    build_urow(table, ubase, TRI3_E3_xx, 0);
+    build_urow(table, ubase, TRI3_Ed_xx, 0);
+    build_urow(table, ubase, TRI3_Ee_xx, 0);
+    build_urow(table, ubase, TRI3_xx_xx, 0);
+
+    table[ubase + TRI2_E1][0x9a] = ubase + TRI3_E1_9a;
+    table[ubase + TRI2_E2][0x80] = ubase + TRI3_E2_80;
+    table[ubase + TRI2_E2][0x81] = ubase + TRI3_E2_81;
+    table[ubase + TRI2_E3][0x80] = ubase + TRI3_E3_80;
+    table[ubase + TRI2_E3][0x81] = ubase + TRI3_E3_81;
+
+
+    /*
+     * Four byte
+     */
+    build_urow(table, ubase, QUAD2_xx, QUAD3_xx_xx);
+    build_urow(table, ubase, QUAD2_F0, QUAD3_F0_xx);
+    build_urow(table, ubase, QUAD2_F4, QUAD3_F4_xx);
+
+    build_urow(table, ubase, QUAD3_xx_xx, QUAD4_xx_xx_xx);
+    build_urow(table, ubase, QUAD3_F0_xx, QUAD4_F0_xx_xx);
+    build_urow(table, ubase, QUAD3_F4_xx, QUAD4_F4_xx_xx);
+
+    build_urow(table, ubase, QUAD4_xx_xx_xx, 0);
+    build_urow(table, ubase, QUAD4_F0_xx_xx, 0);
+    build_urow(table, ubase, QUAD4_F4_xx_xx, 0);
+
+    /*
+     * Mark Unicode spaces
+     */
+    if (iswspace_l(0x0085, loc))
+        table[ubase + DUO2_C2][0x85] = WASSPACE;
+    if (iswspace_l(0x00A0, loc))
+        table[ubase + DUO2_C2][0xA0] = WASSPACE;
+    if (iswspace_l(0x1680, loc)) /* 0x1680 = 0xe1 0x9a 0x80 = OGHAM SPACE MARK*/
+        table[ubase + TRI3_E1_9a][0x80] = WASSPACE;
+    for (i=0x2000; i<0x200b+1; i++) {
+        if (iswspace_l(i, loc))
+            table[ubase + TRI3_E2_80][0x80 + (i&0x6F)] = WASSPACE;
+    }
+    if (iswspace_l(0x2028, loc))
+        table[ubase + TRI3_E2_80][0xA8] = WASSPACE;
+    if (iswspace_l(0x2029, loc))
+        table[ubase + TRI3_E2_80][0xA9] = WASSPACE;
+    if (iswspace_l(0x202F, loc))
+        table[ubase + TRI3_E2_80][0xAF] = WASSPACE;
+    if (iswspace_l(0x205F, loc))
+        table[ubase + TRI3_E2_81][0x9F] = WASSPACE;
+    if (iswspace_l(0x3000, loc))
+        table[ubase + TRI3_E3_80][0x80] = WASSPACE;
+
+
+    /*
+     * Mark illegal sequences
+     *
+     * The following need to be marked as illegal because they can
+     * be represented with a shorter string. In other words,
+     * 0xC0 0x81 is the same as 0x01, so needs to be marked as an
+     * illegal sequence.
+     */
+    for (i=0x80; i<0xA0; i++) {
+        table[ubase + TRI2_E0][i] = ubase + ILLEGAL;
+    }
+    for (i=0x80; i<0x90; i++) {
+        table[ubase + QUAD2_F0][i] = ubase + ILLEGAL;
+    }
+    /* Exceeds max possible size of unicode character */
+    for (i=0x90; i<0xC0; i++) {
+        table[ubase + QUAD2_F4][i] = ubase + ILLEGAL;
+    }
+    /* Surrogate space */
+    for (i=0xA0; i<0xC0; i++) {
+        table[ubase + TRI2_ED][i] = ubase + ILLEGAL;
+    }
+
+}
+
+
+/**
+ * For pointer-arithmetic version of the inner loop, converts
+ * the integer indexes to precomputed pointers.
+ */
+static void
+compile_pointers(struct wc2_machine *machine)
+{
+    size_t i;
+    size_t j;
+
+    for (i=0; i<STATE_MAX; i++) {
+        for (j=0; j<256; j++) {
+            machine->table_p[i][j] = (char*)machine->table_p + machine->table[i][j]*256*sizeof(void*);
+            assert(PSTATE(machine->table_p, machine->table_p[i][j]) == machine->table[i][j]);
+        }
+    }
+}
+
+/**
+ * This function compiles a DFA-style state-machine for parsing UTF-8
+ * variable-length byte sequences.
+ */
+static void
+compile_utf8_statemachine(unsigned char (*table)[256], int is_multibyte, wc2_locale_t loc)
+{
+    if (is_multibyte) {
+        build_WASSPACE(table[WASSPACE], loc);
+        build_WASSPACE(table[NEWLINE], loc);
+        build_WASWORD(table[WASWORD], loc);
+        build_WASWORD(table[NEWWORD], loc);
+        build_unicode(table, NEWWORD, USPACE, loc);
+        build_unicode(table, WASWORD, UWORD, loc);
+    } else {
+        int c;
+        for (c=0; c<256; c++) {
+            if (c == '\n') {
+                table[WASSPACE][c] = NEWLINE;
+                table[NEWLINE][c] = NEWLINE;
+                table[NEWWORD][c] = NEWLINE;
+                table[WASWORD][c] = NEWLINE;
+            } else if (isspace_l(c, loc)) {
+                table[WASSPACE][c] = WASSPACE;
+                table[NEWLINE][c] = WASSPACE;
+                table[NEWWORD][c] = WASSPACE;
+                table[WASWORD][c] = WASSPACE;
+            } else {
+                table[WASSPACE][c] = NEWWORD;
+                table[NEWLINE][c] = NEWWORD;
+                table[NEWWORD][c] = WASWORD;
+                table[WASWORD][c] = WASWORD;
+            }
+        }
+    }
+}
+
+struct wc2_machine *
+wc2_machine_create(int is_multibyte, const char *locale)
+{
+    struct wc2_machine *machine;
+    wc2_locale_t loc;
+
+    loc = newlocale_ctype(locale ? locale : "");
+    if (loc == (wc2_locale_t)0)
+        return NULL;
+
+    machine = calloc(1, sizeof(*machine));
+    if (machine == NULL) {
+        freelocale(loc);
+        return NULL;
+    }
+
+    compile_utf8_statemachine(machine->table, is_multibyte, loc);
+    compile_pointers(machine);
+
+    {
+        int c;
+        for (c=0; c<256; c++)
+            machine->is_space[c] = isspace_l(c, loc) ? 1 : 0;
+    }
+    machine->is_multibyte = is_multibyte;
+    machine->loc = loc;
+    return machine;
+}
+
+void
+wc2_machine_free(struct wc2_machine *machine)
+{
+    if (machine == NULL)
+        return;
+    freelocale(machine->loc);
+    free(machine);
+}
+
+uint64_t
+wc2_machine_hash(const struct wc2_machine *machine)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+    size_t j;
+
+    for (i=0; i<STATE_MAX; i++) {
+        for (j=0; j<256; j++) {
+            hash ^= machine->table[i][j];
+            hash *= 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+/**
+ * A version using the table of pointers, so that the next state is
+ * found without calculating an index. This is '-PP' on the command-line.
+ */
+struct wc2_results
+wc2_parse_pp(const struct wc2_machine *machine, const unsigned char *buf, size_t length, unsigned *inout_state)
+{
+    void * const *table_p = &machine->table_p[0][0];
+    void **state;
+    const unsigned char *end = buf + length;
+    unsigned long counts[STATE_MAX];
+
+    state = (void**)((char*)table_p + (*inout_state) * 256 * sizeof(void*));
+
+    /* We only care about the first four states, so these will be initialized to zero.
+     * Since we don't use the other ~100 counts for the other states, we won't initialize them */
+    counts[NEWLINE] = 0;
+    counts[NEWWORD] = 0;
+    counts[WASSPACE] = 0;
+    counts[WASWORD] = 0;
+
+    /* This is the inner-loop where 99.9% of the execution time of this program will
+     * be spent. */
+    while (buf < end) {
+        unsigned char c = *buf++;
+        state = state[c];
+        counts[PSTATE(table_p, state)]++;
+    }
+
+    /* Save the ending state for the next chunk */
+    *inout_state = PSTATE(table_p, state);
+
+    /* Return the results */
+    {
+        struct wc2_results results;
+        results.line_count = counts[NEWLINE];
+        results.word_count = counts[NEWWORD];
+        results.char_count = counts[NEWLINE] + counts[WASSPACE] + counts[WASWORD] + counts[NEWWORD];
+        results.byte_count = length;
+
+        return results;
+    }
+}
+
+/**
+ * Same as 'wc2_parse()', but with pointer arithmetic instead of
+ * an index. This is '-P' on the command-line.
+ */
+struct wc2_results
+wc2_parse_p(const struct wc2_machine *machine, const unsigned char *buf, size_t length, unsigned *inout_state)
+{
+    const unsigned char (*table)[256] = machine->table;
+    size_t state = *inout_state;
+    const unsigned char *end;
+    unsigned long counts[STATE_MAX];
+    unsigned char c;
+
+    /* We only care about the first four states, so these will be initialized to zero.
+     * Since we don't use the other ~100 counts for the other states, we won't initialize them */
+    counts[NEWLINE] = 0;
+    counts[NEWWORD] = 0;
+    counts[WASSPACE] = 0;
+    counts[WASWORD] = 0;
+
+    /* This is the inner-loop where 99.9% of the execution time of this program will
+     * be spent. */
+    end = buf + length;
+    while (buf < end) {
+        c = *buf++;
+        state = table[state][c];
+        counts[state]++;
+    }
+
+    /* Save the ending state for the next chunk */
+    *inout_state = state;
+
+    /* Return the results */
+    {
+        struct wc2_results results;
+        results.line_count = counts[NEWLINE];
+        results.word_count = counts[NEWWORD];
+        results.char_count = counts[NEWLINE] + counts[WASSPACE] + counts[WASWORD] + counts[NEWWORD];
+        results.byte_count = length;
+
+        return results;
+    }
+}
+
+
+/**
+ * Parse a chunk of any length. Since a word can cross a chunk
+ * boundary, we have to remember the 'state' from a previous
+ * chunk. The counts are as wide as the results, so that a chunk
+ * of 4 gigabytes or more doesn't wrap them.
+ */
+struct wc2_results
+wc2_parse(const struct wc2_machine *machine, const unsigned char *buf, size_t length, unsigned *inout_state)
+{
+    const unsigned char (*table)[256] = machine->table;
+    size_t state = *inout_state;
+    size_t i;
+    unsigned long counts[STATE_MAX];
+    unsigned char c;
+
+    /* We only care about the first four states, so these will be initialized to zero.
+     * Since we don't use the other ~100 counts for the other states, we won't initialize them */
+    counts[NEWLINE] = 0;
+    counts[NEWWORD] = 0;
+    counts[WASSPACE] = 0;
+    counts[WASWORD] = 0;
+
+    /* This is the inner-loop where 99.9% of the execution time of this program will
+     * be spent. */
+    for (i=0; i<length; i++) {
+        c = buf[i];
+        state = table[state][c];
+        counts[state]++;
+    }
+
+    /* Save the ending state for the next chunk */
+    *inout_state = state;
+
+    /* Return the results */
+    {
+        struct wc2_results results;
+        results.line_count = counts[NEWLINE];
+        results.word_count = counts[NEWWORD];
+        results.char_count = counts[NEWLINE] + counts[WASSPACE] + counts[WASWORD] + counts[NEWWORD];
+        results.byte_count = length;
+
+        return results;
+    }
+}
+
+/**
+ * Find the position of the lowest set bit
+ */
+static unsigned
+lowest_bit(unsigned mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+/**
+ * Extract the offset of every newline in the chunk. Newlines don't
+ * depend on the state, so rather than testing every byte in the
+ * inner-loop, we compare 16 bytes at a time with SIMD and then walk
+ * the bits of the resulting mask. Returns the number of offsets.
+ */
+size_t
+wc2_newline_offsets(const unsigned char *buf, size_t length, uint64_t base, uint64_t *offsets)
+{
+    size_t count = 0;
+    size_t i = 0;
+
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i newlines = _mm_set1_epi8('\n');
+
+    for (i=0; i + 16 <= length; i += 16) {
+        __m128i chars = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chars, newlines));
+
+        while (mask) {
+            offsets[count++] = base + i + lowest_bit(mask);
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    /* Whatever is left over, or all of it without SIMD */
+    for (;;) {
+        const unsigned char *p = memchr(buf + i, '\n', length - i);
+        if (p == NULL)
+            break;
+        i = p - buf;
+        offsets[count++] = base + i;
+        i++;
+    }
+
+    return count;
+}
+
+/**
+ * The same as 'wc2_parse()', but also records the
+ * offset of every byte that results in the NEWWORD state. To avoid adding
+ * a branch to the inner-loop, we always store the offset, but only
+ * advance past it when it's a new word.
+ */
+struct wc2_results
+wc2_parse_words(const struct wc2_machine *machine, const unsigned char *buf, size_t length, unsigned *inout_state,
+                uint64_t base, uint64_t *offsets, size_t *offset_count)
+{
+    const unsigned char (*table)[256] = machine->table;
+    size_t state = *inout_state;
+    size_t i;
+    size_t n = 0;
+    unsigned long counts[STATE_MAX];
+    unsigned char c;
+
+    counts[NEWLINE] = 0;
+    counts[NEWWORD] = 0;
+    counts[WASSPACE] = 0;
+    counts[WASWORD] = 0;
+
+    for (i=0; i<length; i++) {
+        c = buf[i];
+        state = table[state][c];
+        counts[state]++;
+        offsets[n] = base + i;
+        n += (state == NEWWORD);
+    }
+
+    *inout_state = state;
+    *offset_count = n;
+
+    {
+        struct wc2_results results;
+        results.line_count = counts[NEWLINE];
+        results.word_count = counts[NEWWORD];
+        results.char_count = counts[NEWLINE] + counts[WASSPACE] + counts[WASWORD] + counts[NEWWORD];
+        results.byte_count = length;
+
+        return results;
+    }
+}
+
+
+/**
+ * The names of the states, where those in a space are in (parentheses),
+ * and those in a word are -dashed-, the same as 'name()' in 'wc2p.c'.
+ */
+static const char *state_names[] = {
+    "(WASSPACE)", "(NEWLINE)", "-NEWWORD-", "-WASWORD-",
+
+    "(DUO2_xx)", "(DUO2_C2)",
+    "(TRI2_E0)", "(TRI2_E1)", "(TRI2_E2)", "(TRI2_E3)", "(TRI2_ED)", "(TRI2_EE)", "(TRI2_xx)",
+    "(TRI3_E0_xx)", "(TRI3_E1_xx)", "(TRI3_E1_9a)", "(TRI3_E2_80)", "(TRI3_E2_81)", "(TRI3_E2_xx)",
+    "(TRI3_E3_80)", "(TRI3_E3_81)", "(TRI3_E3_xx)", "(TRI3_Ed_xx)", "(TRI3_Ee_xx)", "(TRI3_xx_xx)",
+    "(QUAD2_xx)", "(QUAD2_F0)", "(QUAD2_F4)",
+    "(QUAD3_xx_xx)", "(QUAD3_F0_xx)", "(QUAD3_F4_xx)",
+    "(QUAD4_xx_xx_xx)", "(QUAD4_F0_xx_xx)", "(QUAD4_F4_xx_xx)",
+    "(ILLEGAL)",
+
+    "-DUO2_xx-", "-DUO2_C2-",
+    "-TRI2_E0-", "-TRI2_E1-", "-TRI2_E2-", "-TRI2_E3-", "-TRI2_ED-", "-TRI2_EE-", "-TRI2_xx-",
+    "-TRI3_E0_xx-", "-TRI3_E1_xx-", "-TRI3_E1_9a-", "-TRI3_E2_80-", "-TRI3_E2_81-", "-TRI3_E2_xx-",
+    "-TRI3_E3_80-", "-TRI3_E3_81-", "-TRI3_E3_xx-", "-TRI3_Ed_xx-", "-TRI3_Ee_xx-", "-TRI3_xx_xx-",
+    "-QUAD2_xx-", "-QUAD2_F0-", "-QUAD2_F4-",
+    "-QUAD3_xx_xx-", "-QUAD3_F0_xx-", "-QUAD3_F4_xx-",
+    "-QUAD4_xx_xx_xx-", "-QUAD4_F0_xx_xx-", "-QUAD4_F4_xx_xx-",
+    "-ILLEGAL-",
+};
+typedef char assert_state_names[(sizeof(state_names)/sizeof(state_names[0]) == STATE_MAX) ? 1 : -1];
+
+const char *
+wc2_state_name(unsigned state)
+{
+    if (state >= STATE_MAX)
+        return "(unknown)";
+    return state_names[state];
+}
+
+/**
+ * The same as 'wc2_parse()', but also counts the visits to every state,
+ * and every transition between states, adding them to the profile. The
+ * extra memory writes make this several times slower, so it's only for
+ * '--state-profile'.
+ */
+struct wc2_results
+wc2_parse_profile(const struct wc2_machine *machine, const unsigned char *buf, size_t length, unsigned *inout_state,
+                  struct wc2_profile *profile)
+{
+    const unsigned char (*table)[256] = machine->table;
+    size_t state = *inout_state;
+    size_t i;
+    uint64_t counts[STATE_MAX];
+
+    memset(counts, 0, sizeof(counts));
+
+    for (i=0; i<length; i++) {
+        size_t next = table[state][buf[i]];
+        counts[next]++;
+        profile->transitions[state][next]++;
+        state = next;
+    }
+
+    *inout_state = (unsigned)state;
+    for (i=0; i<STATE_MAX; i++)
+        profile->visits[i] += counts[i];
+
+    {
+        struct wc2_results results;
+        results.line_count = counts[NEWLINE];
+        results.word_count = counts[NEWWORD];
+        results.char_count = counts[NEWLINE] + counts[WASSPACE] + counts[WASWORD] + counts[NEWWORD];
+        results.byte_count = length;
+
+        return results;
+    }
+}
+
+
+/**
+ * The branchless loop from 'wc2a.c' and 'wc2b.c', looking up whether
+ * each byte is a space in a table. The state is simply whether the
+ * last byte was part of a word. This only works on single bytes.
+ */
+static struct wc2_results
+parse_isspace(const struct wc2_machine *machine, const unsigned char *buf, size_t length, unsigned *inout_state)
+{
+    const unsigned char *is_space_table = machine->is_space;
+    unsigned was_space = !*inout_state;
+    unsigned long line_count = 0;
+    unsigned long word_count = 0;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        unsigned char c = buf[i];
+        unsigned is_space = is_space_table[c];
+
+        line_count += (c == '\n');
+        word_count += (was_space & !is_space);
+
+        was_space = is_space;
+    }
+
+    *inout_state = !was_space;
+
+    {
+        struct wc2_results results;
+        results.line_count = line_count;
+        results.word_count = word_count;
+        results.char_count = length;
+        results.byte_count = length;
+
+        return results;
+    }
+}
+
+/**
+ * The 'getword()' loop from 'wc2z.c' (the GNU example), which skips
+ * the spaces up to the next word, then the word itself. The state is
+ * whether the chunk ended in the middle of a word.
+ */
+static struct wc2_results
+parse_getword(const struct wc2_machine *machine, const unsigned char *buf, size_t length, unsigned *inout_state)
+{
+    const unsigned char *is_space = machine->is_space;
+    unsigned long line_count = 0;
+    unsigned long word_count = 0;
+    size_t i = 0;
+
+    /* Finish the word left over from the last chunk */
+    if (*inout_state) {
+        while (i < length && !is_space[buf[i]])
+            i++;
+    }
+
+    while (i < length) {
+        /* Skip spaces, counting lines */
+        while (i < length && is_space[buf[i]]) {
+            line_count += (buf[i] == '\n');
+            i++;
+        }
+        if (i == length) {
+            *inout_state = 0;
+            break;
+        }
+
+        /* Skip the word */
+        word_count++;
+        while (i < length && !is_space[buf[i]])
+            i++;
+        *inout_state = 1;
+    }
+
+    {
+        struct wc2_results results;
+        results.line_count = line_count;
+        results.word_count = word_count;
+        results.char_count = length;
+        results.byte_count = length;
+
+        return results;
+    }
+}
+
+/**
+ * The 'mbrtowc()' loop from 'wc2m.c', decoding characters with the C
+ * library and testing them with 'iswspace()'. A character that straddles
+ * two chunks is remembered in the state, which holds whether we were in
+ * a word (bit 0), how many bytes are pending (bits 1-2), and the pending
+ * bytes themselves (bits 8-31). Rather than keep an 'mbstate_t', the
+ * pending bytes are decoded again together with the next chunk, so that
+ * when they turn out to be illegal, the bytes after the first are tried
+ * again, the same as if the chunks had been one.
+ */
+static size_t
+decode_wc(wchar_t *wc, const unsigned char *buf, size_t length)
+{
+    mbstate_t mbstate;
+    size_t len;
+
+    /* Lead bytes past U+10FFFF, which glibc still decodes as the old
+     * 5 and 6 byte sequences, would need more pending bytes than fit */
+    if (buf[0] >= 0xF5)
+        return (size_t)-1;
+
+    memset(&mbstate, 0, sizeof(mbstate));
+    len = mbrtowc(wc, (const char *)buf, length, &mbstate);
+    if (len == 0)
+        len = 1; /* a NUL character */
+    else if (len < (size_t)-2 && (unsigned long)*wc > 0x10FFFF)
+        len = (size_t)-1;
+    return len;
+}
+
+static struct wc2_results
+parse_mbrtowc(const struct wc2_machine *machine, const unsigned char *buf, size_t length, unsigned *inout_state)
+{
+    unsigned was_space = !(*inout_state & 1);
+    size_t pending_count = (*inout_state >> 1) & 3;
+    unsigned char pending[8];
+    unsigned long line_count = 0;
+    unsigned long word_count = 0;
+    unsigned long char_count = 0;
+    size_t i = 0;
+    size_t j;
+#ifndef _WIN32
+    locale_t old_locale = uselocale(machine->loc);
+#else
+    (void)machine; /* no thread locale, so this uses the global one */
+#endif
+
+    for (j=0; j<pending_count; j++)
+        pending[j] = (unsigned char)(*inout_state >> (8 + 8*j));
+
+    for (;;) {
+        const unsigned char *p;
+        size_t n;
+        size_t len;
+        wchar_t wc;
+        unsigned is_space;
+
+        if (pending_count) {
+            /* Join the pending bytes with the start of this chunk */
+            n = pending_count;
+            for (j=i; j<length && n<4; j++)
+                pending[n++] = buf[j];
+            p = pending;
+        } else if (i < length) {
+            p = buf + i;
+            n = length - i;
+        } else
+            break;
+
+        len = decode_wc(&wc, p, n);
+        if (len == (size_t)-2) {
+            /* Incomplete at the end of the chunk, so save it for next time */
+            memmove(pending, p, n);
+            pending_count = n;
+            break;
+        }
+        if (len == (size_t)-1) {
+            /* Illegal, so skip one byte, which counts as nothing */
+            len = 1;
+            is_space = was_space;
+        } else {
+            char_count++;
+            is_space = iswspace(wc) != 0;
+            line_count += (wc == L'\n');
+            word_count += (was_space && !is_space);
+        }
+        was_space = is_space;
+
+        /* Move past the character, which may start with pending bytes */
+        if (len < pending_count) {
+            memmove(pending, pending + len, pending_count - len);
+            pending_count -= len;
+        } else {
+            i += len - pending_count;
+            pending_count = 0;
+        }
+    }
+
+#ifndef _WIN32
+    uselocale(old_locale);
+#endif
+
+    *inout_state = (was_space ? 0 : 1) | (unsigned)(pending_count << 1);
+    for (j=0; j<pending_count; j++)
+        *inout_state |= (unsigned)pending[j] << (8 + 8*j);
+
+    {
+        struct wc2_results results;
+        results.line_count = line_count;
+        results.word_count = word_count;
+        results.char_count = char_count;
+        results.byte_count = length;
+
+        return results;
+    }
+}
+
+/**
+ * All the engines, in the order they are listed by '--engine=list'
+ */
+static const struct wc2_engine engines[] = {
+    {"index", WC2_ENGINE_BYTES | WC2_ENGINE_CHARS | WC2_ENGINE_TABLE, wc2_parse,
+        "the state-machine, indexing the table (the default)"},
+    {"pointer", WC2_ENGINE_BYTES | WC2_ENGINE_CHARS | WC2_ENGINE_TABLE, wc2_parse_p,
+        "the state-machine, with pointer arithmetic over the input (-P)"},
+    {"pointer-pointer", WC2_ENGINE_BYTES | WC2_ENGINE_CHARS | WC2_ENGINE_TABLE, wc2_parse_pp,
+        "the state-machine, with a table of pointers (-PP)"},
+    {"isspace", WC2_ENGINE_BYTES, parse_isspace,
+        "branchless isspace() table lookup, from wc2a.c"},
+    {"getword", WC2_ENGINE_BYTES, parse_getword,
+        "skipping spaces then words, from wc2z.c"},
+    {"mbrtowc", WC2_ENGINE_CHARS, parse_mbrtowc,
+        "mbrtowc() and iswspace() from the C library, from wc2m.c"},
+};
+
+const struct wc2_engine *
+wc2_engine_at(size_t index)
+{
+    if (index >= sizeof(engines)/sizeof(engines[0]))
+        return NULL;
+    return &engines[index];
+}
+
+const struct wc2_engine *
+wc2_engine_find(const char *name)
+{
+    size_t i;
+
+    for (i=0; i<sizeof(engines)/sizeof(engines[0]); i++) {
+        if (strcmp(engines[i].name, name) == 0)
+            return &engines[i];
+    }
+    return NULL;
+}
+
+int
+wc2_engine_is_usable(const struct wc2_engine *engine, const struct wc2_machine *machine)
+{
+    if (machine->is_multibyte)
+        return (engine->flags & WC2_ENGINE_CHARS) != 0;
+    else
+        return (engine->flags & WC2_ENGINE_BYTES) != 0;
+}
+
+void
+wc2_init(struct wc2_stream *ctx, const struct wc2_machine *machine)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->machine = machine;
+}
+
+void
+wc2_feed(struct wc2_stream *ctx, const void *buf, size_t length)
+{
+    struct wc2_results x;
+
+    x = wc2_parse(ctx->machine, buf, length, &ctx->state);
+    ctx->results.line_count += x.line_count;
+    ctx->results.word_count += x.word_count;
+    ctx->results.char_count += x.char_count;
+    ctx->results.byte_count += x.byte_count;
+}
+
+struct wc2_results
+wc2_finish(struct wc2_stream *ctx)
+{
+    struct wc2_results results = ctx->results;
+
+    /* Ready to be used again for another stream */
+    wc2_init(ctx, ctx->machine);
+    return results;
+}
+
+/**
+ * A state that merged with another during 'wc2_summarize()' holds only
+ * the difference from that state, so add in the other state's counts.
+ */
+static void
+summary_resolve(struct wc2_summary *summary, const unsigned char *alias, unsigned char *is_resolved, unsigned s)
+{
+    if (is_resolved[s])
+        return;
+    if (alias[s] != s) {
+        struct wc2_results *r = &summary->results[s];
+        struct wc2_results *o = &summary->results[alias[s]];
+
+        summary_resolve(summary, alias, is_resolved, alias[s]);
+        r->line_count += o->line_count;
+        r->word_count += o->word_count;
+        r->char_count += o->char_count;
+    }
+    is_resolved[s] = 1;
+}
+
+/**
+ * Parse a chunk from every possible starting state at once. Rather than
+ * making STATE_MAX passes over the data, we step all the states forward
+ * together only until they collapse into the same state, which usually
+ * happens within the first few bytes (at the first space). From then on,
+ * entry states that merged will behave identically, so we just remember
+ * how far apart their counts were, and finish with the normal fast
+ * inner-loop for each state that's left.
+ */
+void
+wc2_summarize(const struct wc2_machine *machine, const unsigned char *buf, size_t length, struct wc2_summary *summary)
+{
+    const unsigned char (*table)[256] = machine->table;
+    enum {LOCKSTEP_MAX=64};
+    unsigned char current[STATE_MAX];
+    unsigned char alias[STATE_MAX];
+    unsigned char live[STATE_MAX];
+    size_t live_count = STATE_MAX;
+    size_t i;
+    size_t j;
+    unsigned s;
+
+    for (s=0; s<STATE_MAX; s++) {
+        current[s] = s;
+        alias[s] = s;
+        live[s] = s;
+        memset(&summary->results[s], 0, sizeof(summary->results[s]));
+    }
+
+    /* Step all the states forward together, one byte at a time */
+    for (i=0; i<length && i<LOCKSTEP_MAX && live_count > 1; i++) {
+        unsigned char owner[STATE_MAX];
+        unsigned char c = buf[i];
+        size_t k = 0;
+
+        memset(owner, 0xFF, sizeof(owner));
+        for (j=0; j<live_count; j++) {
+            unsigned entry = live[j];
+            unsigned next = table[current[entry]][c];
+            struct wc2_results *r = &summary->results[entry];
+
+            current[entry] = next;
+            r->line_count += (next == NEWLINE);
+            r->word_count += (next == NEWWORD);
+            r->char_count += (next <= WASWORD);
+
+            if (owner[next] == 0xFF) {
+                owner[next] = entry;
+                live[k++] = entry;
+            } else {
+                /* Merged with another state, so from now on it tracks
+                 * that one, plus whatever difference there is now. */
+                struct wc2_results *o = &summary->results[owner[next]];
+                alias[entry] = owner[next];
+                r->line_count -= o->line_count;
+                r->word_count -= o->word_count;
+                r->char_count -= o->char_count;
+            }
+        }
+        live_count = k;
+    }
+
+    /* Finish the remainder of the chunk with the fast inner-loop for
+     * each distinct state still left */
+    for (j=0; j<live_count; j++) {
+        unsigned entry = live[j];
+        unsigned state = current[entry];
+        struct wc2_results *r = &summary->results[entry];
+        struct wc2_results x;
+
+        x = wc2_parse(machine, buf + i, length - i, &state);
+        current[entry] = state;
+        r->line_count += x.line_count;
+        r->word_count += x.word_count;
+        r->char_count += x.char_count;
+    }
+
+    /* Resolve the merged states, by following each one back to the
+     * state it merged with */
+    {
+        unsigned char is_resolved[STATE_MAX];
+        memset(is_resolved, 0, sizeof(is_resolved));
+        for (s=0; s<STATE_MAX; s++)
+            summary_resolve(summary, alias, is_resolved, s);
+    }
+    for (s=0; s<STATE_MAX; s++) {
+        unsigned root = s;
+        while (alias[root] != root)
+            root = alias[root];
+        summary->exit_state[s] = current[root];
+        summary->results[s].byte_count = length;
+    }
+}
+
+void
+wc2_summary_init(struct wc2_summary *summary)
+{
+    unsigned s;
+
+    memset(summary, 0, sizeof(*summary));
+    for (s=0; s<STATE_MAX; s++)
+        summary->exit_state[s] = s;
+}
+
+void
+wc2_summary_compose(struct wc2_summary *first, const struct wc2_summary *second)
+{
+    unsigned s;
+
+    for (s=0; s<STATE_MAX; s++) {
+        unsigned middle = first->exit_state[s];
+        struct wc2_results *r = &first->results[s];
+        const struct wc2_results *x = &second->results[middle];
+
+        r->line_count += x->line_count;
+        r->word_count += x->word_count;
+        r->char_count += x->char_count;
+        r->byte_count += x->byte_count;
+        first->exit_state[s] = second->exit_state[middle];
+    }
+}
@@ -0,0 +1,233 @@
+/*
+    The word-count engine from 'wc2', as a reentrant library that can
+    be embedded in other programs.
+
+    The state-machine is compiled once into a 'wc2_machine', which is
+    never changed afterwards, so it can be shared between any number
+    of threads. Each input stream then needs only a small 'wc2_stream'
+    context, holding the current state and the counts so far, which
+    the caller allocates wherever it likes. Feeding data to a stream
+    never allocates memory.
+
+        struct wc2_machine *machine = wc2_machine_create(1, "");
+        struct wc2_stream ctx;
+
+        wc2_init(&ctx, machine);
+        while ((length = recv(fd, buf, sizeof(buf), 0)) > 0)
+            wc2_feed(&ctx, buf, length);
+        results = wc2_finish(&ctx);
+*/
+#ifndef LIBWC2_H
+#define LIBWC2_H
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The states of the state-machine that are visible to callers, which
+ * are the ones that get counted. All the others are partway through
+ * a multibyte character.
+ */
+enum {
+    WC2_WASSPACE = 0,
+    WC2_NEWLINE,
+    WC2_NEWWORD,
+    WC2_WASWORD,
+    WC2_STATE_MAX = 66
+};
+
+/**
+ * Holds the counts from reading a chunk, a file, or totals.
+ */
+struct wc2_results {
+    unsigned long line_count;
+    unsigned long word_count;
+    unsigned long char_count;
+    unsigned long byte_count;
+};
+
+/**
+ * The compiled state-machine. This is opaque, and immutable once it's
+ * been created.
+ */
+struct wc2_machine;
+
+/**
+ * The context for a single stream of input.
+ */
+struct wc2_stream {
+    const struct wc2_machine *machine;
+    unsigned state;
+    struct wc2_results results;
+};
+
+/**
+ * The result of parsing a chunk of input starting from every possible
+ * state. Since this describes how the chunk behaves no matter what came
+ * before it, chunks can be parsed independently and combined afterwards.
+ */
+struct wc2_summary {
+    unsigned char exit_state[WC2_STATE_MAX];
+    struct wc2_results results[WC2_STATE_MAX];
+};
+
+/**
+ * Compile the state-machine. If 'is_multibyte' is set, it parses UTF-8
+ * characters (as for 'wc -m'), otherwise single bytes. The spaces are
+ * those of the named locale, where "" means the one configured in the
+ * environment. Unlike 'setlocale()', this doesn't change the locale for
+ * the rest of the program. Returns NULL if the locale doesn't exist.
+ */
+struct wc2_machine *
+wc2_machine_create(int is_multibyte, const char *locale);
+
+void
+wc2_machine_free(struct wc2_machine *machine);
+
+/**
+ * A hash of the state-machine, which changes with the locale and
+ * character-set, so that saved results can be checked to be compatible.
+ */
+uint64_t
+wc2_machine_hash(const struct wc2_machine *machine);
+
+/**
+ * The streaming interface
+ */
+void
+wc2_init(struct wc2_stream *ctx, const struct wc2_machine *machine);
+
+void
+wc2_feed(struct wc2_stream *ctx, const void *buf, size_t length);
+
+struct wc2_results
+wc2_finish(struct wc2_stream *ctx);
+
+/**
+ * The inner-loops. These parse a chunk of input starting from the
+ * given state, and update it to the state at the end of the chunk.
+ * They all give the same results, but differ in how they are written:
+ * with array indexes, with pointer arithmetic over the buffer, and
+ * also with a table of pointers instead of indexes.
+ */
+struct wc2_results
+wc2_parse(const struct wc2_machine *machine, const unsigned char *buf, size_t length, unsigned *inout_state);
+
+struct wc2_results
+wc2_parse_p(const struct wc2_machine *machine, const unsigned char *buf, size_t length, unsigned *inout_state);
+
+struct wc2_results
+wc2_parse_pp(const struct wc2_machine *machine, const unsigned char *buf, size_t length, unsigned *inout_state);
+
+/**
+ * The engines, which are all the different inner-loops that have been
+ * written for 'wc', behind the same interface for parsing a chunk.
+ * The 'state' they carry from one chunk to the next starts at zero, but
+ * otherwise means different things to different engines: only those
+ * marked WC2_ENGINE_TABLE use the states of the state-machine. Some
+ * engines can only count single bytes, and some only multibyte
+ * characters, depending on how the machine was created.
+ */
+typedef struct wc2_results (*wc2_parse_fn)(const struct wc2_machine *machine, const unsigned char *buf, size_t length,
+                                           unsigned *inout_state);
+
+enum {
+    WC2_ENGINE_BYTES = 1,   /* works when the machine isn't multibyte */
+    WC2_ENGINE_CHARS = 2,   /* works when the machine is multibyte */
+    WC2_ENGINE_TABLE = 4    /* the state is that of the state-machine */
+};
+
+struct wc2_engine {
+    const char *name;
+    unsigned flags;
+    wc2_parse_fn parse;
+    const char *description;
+};
+
+/**
+ * Look up an engine by name, returning NULL if there's none.
+ */
+const struct wc2_engine *
+wc2_engine_find(const char *name);
+
+/**
+ * Enumerate the engines, returning NULL past the last one.
+ */
+const struct wc2_engine *
+wc2_engine_at(size_t index);
+
+/**
+ * Whether the engine can count with this machine.
+ */
+int
+wc2_engine_is_usable(const struct wc2_engine *engine, const struct wc2_machine *machine);
+
+/**
+ * Same as 'wc2_parse()', but also stores the offset of every byte that
+ * starts a new word, where 'base' is the offset of 'buf'. The array must
+ * have room for 'length' entries.
+ */
+struct wc2_results
+wc2_parse_words(const struct wc2_machine *machine, const unsigned char *buf, size_t length, unsigned *inout_state,
+                uint64_t base, uint64_t *offsets, size_t *offset_count);
+
+/**
+ * How often each state was visited, and each transition between states
+ * was taken, from 'wc2_parse_profile()'. The caller zeroes it first.
+ */
+struct wc2_profile {
+    uint64_t visits[WC2_STATE_MAX];
+    uint64_t transitions[WC2_STATE_MAX][WC2_STATE_MAX]; /* [from][to] */
+};
+
+/**
+ * Same as 'wc2_parse()', but also adds to the profile of which states
+ * the input went through. This is much slower.
+ */
+struct wc2_results
+wc2_parse_profile(const struct wc2_machine *machine, const unsigned char *buf, size_t length, unsigned *inout_state,
+                  struct wc2_profile *profile);
+
+/**
+ * The name of a state, for printing the profile
+ */
+const char *
+wc2_state_name(unsigned state);
+
+/**
+ * Stores the offset of every newline, where 'base' is the offset of
+ * 'buf'. The array must have room for 'length' entries. Returns the
+ * number of newlines.
+ */
+size_t
+wc2_newline_offsets(const unsigned char *buf, size_t length, uint64_t base, uint64_t *offsets);
+
+/**
+ * Parse a chunk from every possible starting state.
+ */
+void
+wc2_summarize(const struct wc2_machine *machine, const unsigned char *buf, size_t length, struct wc2_summary *summary);
+
+/**
+ * Set the summary to that of empty input, where every state exits as
+ * itself with nothing counted.
+ */
+void
+wc2_summary_init(struct wc2_summary *summary);
+
+/**
+ * Combine the summaries of two consecutive pieces of input, so 'first'
+ * becomes the summary of 'first' followed by 'second'. This is
+ * associative, so pieces can be combined in any grouping, as long as
+ * they stay in order.
+ */
+void
+wc2_summary_compose(struct wc2_summary *first, const struct wc2_summary *second);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
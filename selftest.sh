@@ -1,13 +1,19 @@
 #!/bin/bash
 
+# The columns are padded differently from 'wc' for <stdin>, so only
+# the numbers are compared
+counts() {
+  echo $("$@")
+}
+
 # a simple test
-if [ "$(echo hello | ./wc2a)" != "$(echo hello | wc)" ]; then
+if [ "$(echo hello | counts ./wc2)" != "$(echo hello | counts wc)" ]; then
   echo "fail"
   exit 1
 fi
 
 # a more complex test
-if [ "$(./wc2a wc2a.c)" != "$(wc wc2a.c)" ]; then
+if [ "$(counts ./wc2 wc2.c)" != "$(counts wc wc2.c)" ]; then
   echo "fail"
   exit 1
 fi
@@ -3,10 +3,13 @@
     This is a demonstration of using 'asynchronous state machines' as the
     core logic.
     Includes UTF-8 parsing.
+    The state-machine itself is in 'libwc2.c', this is the command-line
+    program built on top of it.
 */
 #define _CRT_SECURE_NO_WARNINGS
 #define WIN32_LEAN_AND_MEAN
 #define _FILE_OFFSET_BITS   64
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <ctype.h>
 #include <wctype.h>
@@ -16,35 +19,52 @@
 #include <wchar.h>
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include "libwc2.h"
+#include "wcgen.h"
+#include "wc2probes.h"
 
 #ifdef _WIN32
 #include <Windows.h>
+#include <psapi.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+#endif
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
 #endif
 
 /* Windows thing */
 #if !defined(S_ISREG) && defined(S_IFMT) && defined(S_IFREG)
 #define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
 #endif
+#ifdef _WIN32
+#define fseeko _fseeki64
+#define fileno _fileno
+#endif
 
 /**
- * The global "state-machine" table that we create on startup.
- */
-unsigned char table[256][256];
-
-/**
- * This is a translation of the above table, using pointers
- * instead of integer offsets, to remove one calculation in
- * the inner-loop. This is activated when the '-P' option
- * is set on the command-line.
- */
-void *table_p[256][256];
-
-/**
- * Translate from a numeric pointer to somehwere in 'table_p' to
- * the integer row number for 'table'.
+ * Options for '--range', '--line-range', and '--reindex', which have
+ * the form START:LENGTH
  */
-#define PSTATE(p) (((char*)p - (char*)table_p)/(256 * sizeof(void*)))
+struct range {
+    unsigned long long start;
+    unsigned long long length;
+};
 
 /**
  * Hold the configuration parsed from the command-line
@@ -59,335 +79,603 @@ struct config {
     int is_printing_totals;
     unsigned column_width;
     int is_pointer_arithmetic;
+    const struct wc2_engine *engine;
+    const struct wc2_engine *verify_engine;
+    size_t bufsize;
+    size_t mapsize; /* how much of a mapped file is parsed at a time */
+    int is_autotuning;
+    unsigned thread_count;
+    unsigned block_count;
+    int is_following;
+    unsigned follow_interval; /* milliseconds between updates with -f */
+    int is_indexing;
+    int is_reindexing;
+    struct range reindex;
+    int is_range;
+    int is_line_range;
+    struct range range;
+    const char *newline_offsets_name;
+    const char *word_offsets_name;
+    FILE *newline_offsets;
+    FILE *word_offsets;
+    int is_quiet;
+    unsigned long long split_count;
+    int is_summarizing;
+    int is_merging;
+    int format;
+    int is_stats;
+    int is_profiling;
+    struct io_stats *stats;
+    struct wc2_profile *profile;
+    const struct wc2_machine *machine;
+    unsigned char *is_value; /* arguments that are the value of an option */
 };
 
 /**
- * Holds the counts from reading a chunk, a file, or totals.
+ * Whether argument 'i' names a file, rather than being an option, or
+ * the value of one, like the '8' in '-j 8'
  */
-struct results {
-    unsigned long line_count;
-    unsigned long word_count;
-    unsigned long char_count;
-    unsigned long byte_count;
-};
-
+static int
+is_filename_arg(const struct config *cfg, char *argv[], int i)
+{
+    return argv[i][0] != '-' && !(cfg->is_value && cfg->is_value[i]);
+}
 
-/*
-| bytes | bits |  first  |   last   |   byte1  |   byte2  |   byte3  |   byte4  |
-|:-----:|:----:|:-------:|:--------:|:--------:|:--------:|:--------:|:--------:|
-|   1   |    7 |  U+0000 |   U+007F | 0xxxxxxx |          |          |          |
-|   2   |   11 |  U+0080 |   U+07FF | 110xxxxx | 10xxxxxx |          |          |
-|   3   |   16 |  U+0800 |   U+FFFF | 1110xxxx | 10xxxxxx | 10xxxxxx |          |
-|   4   |   21 | U+10000 | U+10FFFF | 11110xxx | 10xxxxxx | 10xxxxxx | 10xxxxxx |
+/**
+ * The machine-readable alternatives to the normal columns, chosen
+ * with '--format'. Each input gets one record, with the same fields
+ * in the same order, whichever counts were asked for.
  */
 enum {
-    DUO2_xx,
-    DUO2_C2,
-    TRI2_E0,
-    TRI2_E1,
-    TRI2_E2,
-    TRI2_E3,
-    TRI2_ED,
-    TRI2_EE,
-    TRI2_xx,
-    TRI3_E0_xx,
-    TRI3_E1_xx,
-    TRI3_E1_9a,
-    TRI3_E2_80,
-    TRI3_E2_81,
-    TRI3_E2_xx,
-    TRI3_E3_80,
-    TRI3_E3_81,
-    TRI3_E3_xx,
-    TRI3_Ed_xx,
-    TRI3_Ee_xx,
-    TRI3_xx_xx,
-    QUAD2_xx,
-    QUAD2_F0,
-    QUAD2_F4,
-    QUAD3_xx_xx,
-    QUAD3_F0_xx,
-    QUAD3_F4_xx,
-    QUAD4_xx_xx_xx,
-    QUAD4_F0_xx_xx,
-    QUAD4_F4_xx_xx,
-    ILLEGAL
+    FORMAT_HUMAN,
+    FORMAT_JSON,
+    FORMAT_CSV,
+    FORMAT_TSV,
+    FORMAT_BINARY
 };
 
 enum {
-    WASSPACE = 0,
-    NEWLINE,
-    NEWWORD,
-    WASWORD,
-    USPACE,
-    UWORD=USPACE+ILLEGAL+1,
-    STATE_MAX=UWORD+ILLEGAL+1
+    RECORD_FILE,
+    RECORD_STDIN,
+    RECORD_TOTAL
+};
+
+static const char *record_types[] = {"file", "stdin", "total"};
+
+/**
+ * What else we know about an input, beyond the counts, for the
+ * machine-readable formats.
+ */
+struct file_info {
+    int type;
+    long long size;                 /* -1 unless a regular file */
+    unsigned long long elapsed_ns;  /* from opening to the last count */
+    int error;                      /* errno if it couldn't be read */
 };
 
 /**
- * Build an ASCII row. This configures low-order 7-bits, which should
- * be roughly the same for all states
+ * Return the current time in nanoseconds, for timing each file.
+ */
+static unsigned long long
+now_nsecs(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (unsigned long long)(count.QuadPart / (double)frequency.QuadPart * 1000000000.0);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/**
+ * The size of the input if it's a regular file, or -1 for pipes,
+ * terminals, and devices, where there's no such thing.
+ */
+static long long
+file_size(FILE *fp)
+{
+    struct stat st;
+
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode))
+        return -1;
+    return (long long)st.st_size;
+}
+
+/**
+ * The records are collected here and written with a single 'write()'
+ * when it fills, so that with many small files we don't make a system
+ * call per line. Only whole records go into the buffer, so the output
+ * as a whole always ends at the end of a record, unless a write fails
+ * or we are killed in the middle of one. A pipe only keeps writes of
+ * up to PIPE_BUF bytes together, though, so a reader may still get a
+ * record in two reads, and has to read up to the end of each line.
+ */
+static struct {
+    size_t length;
+    int is_header_done;
+    char buf[65536];
+} out;
+
+/**
+ * Write out the buffered records. This is also called when exiting,
+ * including with 'exit()' on errors, so the records we got to are
+ * kept.
  */
 static void
-build_basic(unsigned char *row, unsigned char default_state, unsigned char ubase)
-{
-    unsigned c;
-    for (c=0; c<256; c++) {
-        if ((c & 0x80)) {
-            if ((c & 0xE0) == 0xC0) {
-                /* 110x xxxx - unicode 2 byte sequence */
-                if (c < 0xC2)
-                    row[c] = ubase + ILLEGAL;
-                else if (c == 0xC2)
-                    row[c] = ubase + DUO2_C2;
-                else
-                    row[c] = ubase + DUO2_xx;
-            } else if ((c & 0xF0) == 0xE0) {
-                /* 1110 xxxx - unicode 3 byte sequence */
-                switch (c) {
-                    case 0xE0:
-                        row[c] = ubase + TRI2_E0;
-                        break;
-                    case 0xE1:
-                        row[c] = ubase + TRI2_E1;
-                        break;
-                    case 0xE2:
-                        row[c] = ubase + TRI2_E2;
-                        break;
-                    case 0xE3:
-                        row[c] = ubase + TRI2_E3;
-                        break;
-                    case 0xEd:
-                        row[c] = ubase + TRI2_ED;
-                        break;
-                    case 0xEe:
-                        row[c] = ubase + TRI2_EE;
-                        break;
-                    default:
-                        row[c] = ubase + TRI2_xx;
-                        break;
-                }
-            } else if ((c & 0xF8) == 0xF0) {
-                if (c >= 0xF5)
-                    row[c] = ubase + ILLEGAL;
-                else if (c == 0xF0)
-                    row[c] = ubase + QUAD2_F0;
-                else if (c == 0xF4)
-                    row[c] = ubase + QUAD2_F4;
-                else
-                    row[c] = ubase + QUAD2_xx;
-            } else
-                row[c] = ubase + ILLEGAL;
-        } else if (c == '\n')
-            row[c] = NEWLINE;
-        else if (isspace(c))
-            row[c] = WASSPACE;
-        else
-            row[c] = default_state;
+out_flush(void)
+{
+    size_t offset = 0;
+
+    /* Anything already printed with 'printf()' goes first */
+    fflush(stdout);
+
+    while (offset < out.length) {
+#ifdef _WIN32
+        int count = _write(1, out.buf + offset, (unsigned)(out.length - offset));
+#else
+        ssize_t count = write(1, out.buf + offset, out.length - offset);
+        if (count < 0 && errno == EINTR)
+            continue;
+#endif
+        if (count <= 0) {
+            perror("stdout");
+            break;
+        }
+        offset += count;
     }
+    out.length = 0;
 }
 
-void build_WASSPACE(unsigned char *row)
+/**
+ * A record being built, in a buffer of its own, until it's known to
+ * be complete and can be appended to the output.
+ */
+struct record {
+    size_t length;
+    char buf[32768];
+};
+
+static void
+rec_append(struct record *rec, const void *data, size_t length)
 {
-    build_basic(row, NEWWORD, USPACE);
+    if (length > sizeof(rec->buf) - rec->length) {
+        fprintf(stderr, "wc2: record longer than %u bytes\n", (unsigned)sizeof(rec->buf));
+        exit(1);
+    }
+    memcpy(rec->buf + rec->length, data, length);
+    rec->length += length;
 }
 
-void build_WASWORD(unsigned char *row)
+static void
+rec_str(struct record *rec, const char *str)
 {
-    build_basic(row, WASWORD, UWORD);
+    rec_append(rec, str, strlen(str));
 }
 
+/**
+ * Formats the number in decimal. This is the only thing most records
+ * contain, and 'printf()' spends most of its time parsing the format
+ * string rather than converting the number.
+ */
+static void
+rec_u64(struct record *rec, unsigned long long n)
+{
+    char tmp[20];
+    size_t i = sizeof(tmp);
+
+    do {
+        tmp[--i] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n);
+    rec_append(rec, tmp + i, sizeof(tmp) - i);
+}
 
-void build_urow(unsigned ubase, unsigned id, unsigned next)
+static void
+rec_le(struct record *rec, unsigned long long n, size_t width)
 {
+    unsigned char tmp[8];
     size_t i;
-    unsigned default_state;
-
-    default_state = table[ubase + ILLEGAL][0];
-
-    if (next == 0)
-        next = default_state;
-    else
-        next = ubase + next;
 
-    memcpy(table[ubase + id], table[ubase + ILLEGAL], 256);
+    for (i=0; i<width; i++)
+        tmp[i] = (unsigned char)(n >> (8 * i));
+    rec_append(rec, tmp, width);
+}
 
-    for (i=0x80; i<0xC0; i++) {
-        table[ubase + id][i] = next;
-    }
-    for (i=0xC0; i<0x100; i++) {
-        table[ubase + id][i] = ubase + ILLEGAL;
+/**
+ * The length of the well-formed UTF-8 character at 'p', or zero if
+ * it isn't one, such as a stray continuation byte, a truncated or
+ * overlong sequence, a surrogate, or something past U+10FFFF.
+ */
+static size_t
+utf8_valid_length(const unsigned char *p)
+{
+    size_t length;
+    size_t i;
+    unsigned long c;
+
+    if (p[0] < 0x80)
+        return 1;
+    else if (p[0] >= 0xC2 && p[0] <= 0xDF) {
+        length = 2;
+        c = p[0] & 0x1F;
+    } else if (p[0] >= 0xE0 && p[0] <= 0xEF) {
+        length = 3;
+        c = p[0] & 0x0F;
+    } else if (p[0] >= 0xF0 && p[0] <= 0xF4) {
+        length = 4;
+        c = p[0] & 0x07;
+    } else
+        return 0;
+
+    /* The NUL at the end isn't a continuation byte, so this stops there */
+    for (i=1; i<length; i++) {
+        if ((p[i] & 0xC0) != 0x80)
+            return 0;
+        c = c << 6 | (p[i] & 0x3F);
     }
 
+    if ((length == 3 && c < 0x800) || (length == 4 && c < 0x10000)
+        || (c >= 0xD800 && c <= 0xDFFF) || c > 0x10FFFF)
+        return 0;
+    return length;
 }
-void build_unicode(unsigned char default_state, unsigned ubase)
+
+/**
+ * Quote a filename for the format, since filenames can contain
+ * anything but NUL, including the separators and newlines. JSON
+ * strings have to be Unicode, so for bytes that aren't part of a
+ * valid UTF-8 character, we use the same trick as Python's
+ * "surrogateescape", writing byte 0xXX as the lone surrogate
+ * '\udcXX'. No real character is written that way, so the bytes
+ * of the name can always be recovered.
+ */
+static void
+rec_name(struct record *rec, const char *name, int format)
 {
-    size_t i;
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p;
+
+    switch (format) {
+    case FORMAT_JSON:
+        rec_str(rec, "\"");
+        for (p = (const unsigned char *)name; *p; p++) {
+            if (*p == '"' || *p == '\\') {
+                rec_str(rec, "\\");
+                rec_append(rec, p, 1);
+            } else if (*p < 0x20 || *p == 0x7f) {
+                char esc[6] = {'\\', 'u', '0', '0', hex[*p >> 4], hex[*p & 0xf]};
+                rec_append(rec, esc, sizeof(esc));
+            } else {
+                size_t length = utf8_valid_length(p);
+                if (length == 0) {
+                    char esc[6] = {'\\', 'u', 'd', 'c', hex[*p >> 4], hex[*p & 0xf]};
+                    rec_append(rec, esc, sizeof(esc));
+                } else {
+                    rec_append(rec, p, length);
+                    p += length - 1;
+                }
+            }
+        }
+        rec_str(rec, "\"");
+        break;
+    case FORMAT_CSV:
+        /* RFC 4180: always quoted, with quotes doubled */
+        rec_str(rec, "\"");
+        for (p = (const unsigned char *)name; *p; p++) {
+            if (*p == '"')
+                rec_str(rec, "\"");
+            rec_append(rec, p, 1);
+        }
+        rec_str(rec, "\"");
+        break;
+    case FORMAT_TSV:
+        /* The escapes understood by PostgreSQL 'COPY' and friends */
+        for (p = (const unsigned char *)name; *p; p++) {
+            if (*p == '\t')
+                rec_str(rec, "\\t");
+            else if (*p == '\n')
+                rec_str(rec, "\\n");
+            else if (*p == '\r')
+                rec_str(rec, "\\r");
+            else if (*p == '\\')
+                rec_str(rec, "\\\\");
+            else
+                rec_append(rec, p, 1);
+        }
+        break;
+    }
+}
+
+/**
+ * The magic number starting every binary record, followed by the
+ * version of the layout, so that readers can check they are in sync.
+ */
+#define RECORD_MAGIC "WC2R"
+#define RECORD_VERSION 1
+
+enum {
+    RECORD_HAS_LINES = 0x01,
+    RECORD_HAS_WORDS = 0x02,
+    RECORD_HAS_CHARS = 0x04,
+    RECORD_HAS_BYTES = 0x08,
+    RECORD_HAS_SIZE = 0x10
+};
 
-    build_basic(table[ubase + ILLEGAL], default_state, ubase);
-
-    /*
-     * Two byte
-     */
-    build_urow(ubase, DUO2_xx, 0);
-    build_urow(ubase, DUO2_C2, 0);
-
-    /*
-     * Three byte
-     */
-    build_urow(ubase, TRI2_E0, TRI3_E0_xx);
-    build_urow(ubase, TRI2_E1, TRI3_E1_xx);
-    build_urow(ubase, TRI2_E2, TRI3_E2_xx);
-    build_urow(ubase, TRI2_E3, TRI3_E3_xx);
-    build_urow(ubase, TRI2_ED, TRI3_Ed_xx);
-    build_urow(ubase, TRI2_EE, TRI3_Ee_xx);
-    build_urow(ubase, TRI2_xx, TRI3_xx_xx);
-
-    build_urow(ubase, TRI3_E0_xx, 0);
-    build_urow(ubase, TRI3_E1_xx, 0);
-    build_urow(ubase, TRI3_E1_9a, 0);
-    build_urow(ubase, TRI3_E2_80, 0);
-    build_urow(ubase, TRI3_E2_81, 0);
-    build_urow(ubase, TRI3_E2_xx, 0);
-    build_urow(ubase, TRI3_E3_80, 0);
-    build_urow(ubase, TRI3_E3_81, 0);
-    build_urow(ubase, TRI3_E3_xx, 0);
-    build_urow(ubase, TRI3_Ed_xx, 0);
-    build_urow(ubase, TRI3_Ee_xx, 0);
-    build_urow(ubase, TRI3_xx_xx, 0);
-
-    table[ubase + TRI2_E1][0x9a] = ubase + TRI3_E1_9a;
-    table[ubase + TRI2_E2][0x80] = ubase + TRI3_E2_80;
-    table[ubase + TRI2_E2][0x81] = ubase + TRI3_E2_81;
-    table[ubase + TRI2_E3][0x80] = ubase + TRI3_E3_80;
-    table[ubase + TRI2_E3][0x81] = ubase + TRI3_E3_81;
-
-
-    /*
-     * Four byte
-     */
-    build_urow(ubase, QUAD2_xx, QUAD3_xx_xx);
-    build_urow(ubase, QUAD2_F0, QUAD3_F0_xx);
-    build_urow(ubase, QUAD2_F4, QUAD3_F4_xx);
-
-    build_urow(ubase, QUAD3_xx_xx, QUAD4_xx_xx_xx);
-    build_urow(ubase, QUAD3_F0_xx, QUAD4_F0_xx_xx);
-    build_urow(ubase, QUAD3_F4_xx, QUAD4_F4_xx_xx);
-
-    build_urow(ubase, QUAD4_xx_xx_xx, 0);
-    build_urow(ubase, QUAD4_F0_xx_xx, 0);
-    build_urow(ubase, QUAD4_F4_xx_xx, 0);
-
-    /*
-     * Mark Unicode spaces
-     */
-    if (iswspace(0x0085))
-        table[ubase + DUO2_C2][0x85] = WASSPACE;
-    if (iswspace(0x00A0))
-        table[ubase + DUO2_C2][0xA0] = WASSPACE;
-    if (iswspace(0x1680)) /* 0x1680 = 0xe1 0x9a 0x80 = OGHAM SPACE MARK*/
-        table[ubase + TRI3_E1_9a][0x80] = WASSPACE;
-    for (i=0x2000; i<0x200b+1; i++) {
-        if (iswspace(i))
-            table[ubase + TRI3_E2_80][0x80 + (i&0x6F)] = WASSPACE;
-    }
-    if (iswspace(0x2028))
-        table[ubase + TRI3_E2_80][0xA8] = WASSPACE;
-    if (iswspace(0x2029))
-        table[ubase + TRI3_E2_80][0xA9] = WASSPACE;
-    if (iswspace(0x202F))
-        table[ubase + TRI3_E2_80][0xAF] = WASSPACE;
-    if (iswspace(0x205F))
-        table[ubase + TRI3_E2_81][0x9F] = WASSPACE;
-    if (iswspace(0x3000))
-        table[ubase + TRI3_E3_80][0x80] = WASSPACE;
-
-
-    /*
-     * Mark illegal sequences
-     *
-     * The following need to be marked as illegal because they can
-     * be represented with a shorter string. In other words,
-     * 0xC0 0x81 is the same as 0x01, so needs to be marked as an
-     * illegal sequence.
-     */
-    for (i=0x80; i<0xA0; i++) {
-        table[ubase + TRI2_E0][i] = ubase + ILLEGAL;
-    }
-    for (i=0x80; i<0x90; i++) {
-        table[ubase + QUAD2_F0][i] = ubase + ILLEGAL;
-    }
-    /* Exceeds max possible size of unicode character */
-    for (i=0x90; i<0xC0; i++) {
-        table[ubase + QUAD2_F4][i] = ubase + ILLEGAL;
-    }
-    /* Surrogate space */
-    for (i=0xA0; i<0xC0; i++) {
-        table[ubase + TRI2_ED][i] = ubase + ILLEGAL;
-    }
-
-}
-
-
-
-/**
- * For pointer-arithmetic version of the inner loop, converts
- * the integer indexes to precomputed pointers. This table
- * will be used when '-P' option is set on the command-line.
+/**
+ * Print one record in one of the machine-readable formats. The text
+ * formats have the fields:
+ *  type, name, lines, words, chars, bytes, size, elapsed_ns, error
+ * where counts that weren't asked for, the size of something that
+ * isn't a regular file, and the error when there wasn't one, are
+ * empty (or 'null' for JSON). The binary format is, little-endian:
+ *  magic[4] version[1] type[1] flags[2] errno[4] name_length[4]
+ *  lines[8] words[8] chars[8] bytes[8] size[8] elapsed_ns[8] name[]
+ * so that every record has a fixed 64-byte header.
  */
 static void
-compile_pointers(void)
+print_record(const char *filename, const struct wc2_results *results, const struct file_info *info,
+             const struct config *cfg)
 {
+    struct record rec;
+    unsigned long long values[4];
+    int has_value[4];
+    const char *sep = (cfg->format == FORMAT_TSV) ? "\t" : ",";
     size_t i;
-    size_t j;
 
-    for (i=0; i<STATE_MAX; i++) {
-        for (j=0; j<256; j++) {
-            table_p[i][j] = (char*)table_p + table[i][j]*256*sizeof(void*);
-            assert(PSTATE(table_p[i][j]) == table[i][j]);
+    /* Only files have names, the "total" is just for people */
+    if (info->type != RECORD_FILE)
+        filename = NULL;
+
+    values[0] = results->line_count;
+    values[1] = results->word_count;
+    values[2] = results->char_count;
+    values[3] = results->byte_count;
+    has_value[0] = !info->error && cfg->is_counting_lines;
+    has_value[1] = !info->error && cfg->is_counting_words;
+    has_value[2] = !info->error && cfg->is_counting_chars;
+    has_value[3] = !info->error && cfg->is_counting_bytes;
+
+    rec.length = 0;
+
+    switch (cfg->format) {
+    case FORMAT_JSON:
+    {
+        static const char *keys[] = {"lines", "words", "chars", "bytes"};
+
+        rec_str(&rec, "{\"type\":\"");
+        rec_str(&rec, record_types[info->type]);
+        rec_str(&rec, "\",\"name\":");
+        if (filename)
+            rec_name(&rec, filename, cfg->format);
+        else
+            rec_str(&rec, "null");
+        for (i=0; i<4; i++) {
+            rec_str(&rec, ",\"");
+            rec_str(&rec, keys[i]);
+            rec_str(&rec, "\":");
+            if (has_value[i])
+                rec_u64(&rec, values[i]);
+            else
+                rec_str(&rec, "null");
+        }
+        rec_str(&rec, ",\"size\":");
+        if (info->size >= 0)
+            rec_u64(&rec, info->size);
+        else
+            rec_str(&rec, "null");
+        rec_str(&rec, ",\"elapsed_ns\":");
+        rec_u64(&rec, info->elapsed_ns);
+        rec_str(&rec, ",\"error\":");
+        if (info->error)
+            rec_name(&rec, strerror(info->error), cfg->format);
+        else
+            rec_str(&rec, "null");
+        rec_str(&rec, "}\n");
+        break;
+    }
+    case FORMAT_CSV:
+    case FORMAT_TSV:
+        rec_str(&rec, record_types[info->type]);
+        rec_str(&rec, sep);
+        if (filename)
+            rec_name(&rec, filename, cfg->format);
+        for (i=0; i<4; i++) {
+            rec_str(&rec, sep);
+            if (has_value[i])
+                rec_u64(&rec, values[i]);
+        }
+        rec_str(&rec, sep);
+        if (info->size >= 0)
+            rec_u64(&rec, info->size);
+        rec_str(&rec, sep);
+        rec_u64(&rec, info->elapsed_ns);
+        rec_str(&rec, sep);
+        if (info->error)
+            rec_name(&rec, strerror(info->error), cfg->format);
+        rec_str(&rec, "\n");
+        break;
+    case FORMAT_BINARY:
+    {
+        size_t name_length = filename ? strlen(filename) : 0;
+        unsigned flags = 0;
+
+        for (i=0; i<4; i++) {
+            if (has_value[i])
+                flags |= 1 << i;
+            else
+                values[i] = 0;
+        }
+        if (info->size >= 0)
+            flags |= RECORD_HAS_SIZE;
+
+        rec_append(&rec, RECORD_MAGIC, 4);
+        rec_le(&rec, RECORD_VERSION, 1);
+        rec_le(&rec, info->type, 1);
+        rec_le(&rec, flags, 2);
+        rec_le(&rec, info->error, 4);
+        rec_le(&rec, name_length, 4);
+        for (i=0; i<4; i++)
+            rec_le(&rec, values[i], 8);
+        rec_le(&rec, info->size >= 0 ? info->size : 0, 8);
+        rec_le(&rec, info->elapsed_ns, 8);
+        rec_append(&rec, filename ? filename : "", name_length);
+        break;
+    }
+    }
+
+    /* The header line goes before the first record */
+    if (!out.is_header_done && (cfg->format == FORMAT_CSV || cfg->format == FORMAT_TSV)) {
+        static const char *fields[] = {"type", "name", "lines", "words", "chars", "bytes", "size",
+                                       "elapsed_ns", "error", NULL};
+
+        for (i=0; fields[i]; i++) {
+            size_t length = strlen(fields[i]);
+            if (i)
+                out.buf[out.length++] = *sep;
+            memcpy(out.buf + out.length, fields[i], length);
+            out.length += length;
         }
+        out.buf[out.length++] = '\n';
     }
+    out.is_header_done = 1;
+
+    /* Only whole records go into the output */
+    if (rec.length > sizeof(out.buf) - out.length)
+        out_flush();
+    memcpy(out.buf + out.length, rec.buf, rec.length);
+    out.length += rec.length;
 }
 
 /**
- * This function compiles a DFA-style state-machine for parsing UTF-8
- * variable-length byte sequences.
+ * With '--stats', where the time went while counting each file. When
+ * it's off, 'cfg->stats' is NULL, and all this costs is checking that
+ * once per chunk.
+ */
+enum {STATS_BUCKETS = 32};
+
+struct io_stats {
+    unsigned long long compile_ns;  /* compiling the state-machine */
+    unsigned long long read_ns;
+    unsigned long long parse_ns;
+    unsigned long long read_count;
+    unsigned long long read_bytes;
+    unsigned long long mapped_bytes;
+    unsigned long long read_sizes[STATS_BUCKETS]; /* by power of two */
+};
+
+/**
+ * Record a call to 'fread()', or the equivalent
  */
 static void
-compile_utf8_statemachine(int is_multibyte)
-{
-    if (is_multibyte) {
-        setlocale(LC_ALL, "");
-        build_WASSPACE(table[WASSPACE]);
-        build_WASSPACE(table[NEWLINE]);
-        build_WASWORD(table[WASWORD]);
-        build_WASWORD(table[NEWWORD]);
-        build_unicode(NEWWORD, USPACE);
-        build_unicode(WASWORD, UWORD);
-    } else {
-        int c;
-        setlocale(LC_ALL, "");
-        for (c=0; c<256; c++) {
-            if (c == '\n') {
-                table[WASSPACE][c] = NEWLINE;
-                table[NEWLINE][c] = NEWLINE;
-                table[NEWWORD][c] = NEWLINE;
-                table[WASWORD][c] = NEWLINE;
-            } else if (isspace(c)) {
-                table[WASSPACE][c] = WASSPACE;
-                table[NEWLINE][c] = WASSPACE;
-                table[NEWWORD][c] = WASSPACE;
-                table[WASWORD][c] = WASSPACE;
-            } else {
-                table[WASSPACE][c] = NEWWORD;
-                table[NEWLINE][c] = NEWWORD;
-                table[NEWWORD][c] = WASWORD;
-                table[WASWORD][c] = WASWORD;
-            }
+stats_read(struct io_stats *stats, size_t count, unsigned long long elapsed)
+{
+    unsigned bucket = 0;
+
+    stats->read_ns += elapsed;
+    stats->read_count++;
+    stats->read_bytes += count;
+
+    /* The first bucket is for reads that got nothing, at the end */
+    while (bucket < STATS_BUCKETS - 1 && (count >> bucket) != 0)
+        bucket++;
+    stats->read_sizes[bucket]++;
+}
+
+static void
+stats_add(struct io_stats *total, const struct io_stats *stats)
+{
+    size_t i;
+
+    total->compile_ns += stats->compile_ns;
+    total->read_ns += stats->read_ns;
+    total->parse_ns += stats->parse_ns;
+    total->read_count += stats->read_count;
+    total->read_bytes += stats->read_bytes;
+    total->mapped_bytes += stats->mapped_bytes;
+    for (i=0; i<STATS_BUCKETS; i++)
+        total->read_sizes[i] += stats->read_sizes[i];
+}
+
+/**
+ * Print the stats to <stderr>, so they don't get mixed up with the
+ * counts. The sizes of reads are shown as a histogram, where "4K=10"
+ * means 10 reads of at least 4K, but less than 8K. For the totals, we
+ * also show how long compiling took, and what the whole process used.
+ */
+static void
+print_stats(const char *name, const struct io_stats *stats, unsigned long long bytes,
+            unsigned long long elapsed_ns, int is_total)
+{
+    double elapsed = elapsed_ns / 1000000000.0;
+    size_t i;
+
+    if (name == NULL)
+        name = "stdin";
+    fprintf(stderr, "wc2: stats: %s: %llu bytes in %.6f s (%.1f MB/s), parse %.6f s",
+            name, bytes, elapsed, elapsed > 0 ? bytes / elapsed / 1000000.0 : 0.0,
+            stats->parse_ns / 1000000000.0);
+    if (stats->read_count)
+        fprintf(stderr, ", read %.6f s (%llu reads)", stats->read_ns / 1000000000.0, stats->read_count);
+    if (stats->mapped_bytes)
+        fprintf(stderr, ", mapped %llu bytes", stats->mapped_bytes);
+    if (is_total)
+        fprintf(stderr, ", compile %.6f s", stats->compile_ns / 1000000000.0);
+    fprintf(stderr, "\n");
+
+    if (stats->read_count) {
+        fprintf(stderr, "wc2: stats: %s: read sizes:", name);
+        for (i=0; i<STATS_BUCKETS; i++) {
+            if (stats->read_sizes[i] == 0)
+                continue;
+            if (i == 0)
+                fprintf(stderr, " 0=%llu", stats->read_sizes[i]);
+            else if (i > 20)
+                fprintf(stderr, " %luM=%llu", 1UL << (i - 21), stats->read_sizes[i]);
+            else if (i > 10)
+                fprintf(stderr, " %luK=%llu", 1UL << (i - 11), stats->read_sizes[i]);
+            else
+                fprintf(stderr, " %lu=%llu", 1UL << (i - 1), stats->read_sizes[i]);
         }
+        fprintf(stderr, "\n");
     }
-}
 
+    if (is_total) {
+#ifdef _WIN32
+        FILETIME begin;
+        FILETIME end;
+        FILETIME kernel;
+        FILETIME user;
+        PROCESS_MEMORY_COUNTERS memory;
+
+        if (GetProcessTimes(GetCurrentProcess(), &begin, &end, &kernel, &user)
+            && GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory))) {
+            unsigned long long user_time = (unsigned long long)user.dwLowDateTime | (unsigned long long)user.dwHighDateTime<<32ULL;
+            unsigned long long kernel_time = (unsigned long long)kernel.dwLowDateTime | (unsigned long long)kernel.dwHighDateTime<<32ULL;
+            fprintf(stderr, "wc2: stats: peak RSS %llu KB, user %.3f s, system %.3f s\n",
+                    (unsigned long long)memory.PeakWorkingSetSize / 1024,
+                    user_time / 10000000.0, kernel_time / 10000000.0);
+        }
+#else
+        struct rusage usage;
+
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+            /* Linux counts in kilobytes, macOS in bytes */
+#ifdef __APPLE__
+            usage.ru_maxrss /= 1024;
+#endif
+            fprintf(stderr, "wc2: stats: peak RSS %ld KB, user %.3f s, system %.3f s\n",
+                    (long)usage.ru_maxrss,
+                    usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0,
+                    usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0);
+        }
+#endif
+    }
+}
 
 /**
  * Print the results structure. We need to make sure there is a space
@@ -398,249 +686,2298 @@ compile_utf8_statemachine(int is_multibyte)
  * column-width for all the columns.
  */
 static void
-print_results(const char *filename, struct results *results, struct config *cfg)
+print_results(const char *filename, struct wc2_results *results, const struct file_info *info, struct config *cfg)
+{
+    int needs_space = 0; /* space needed between output */
+    unsigned width = cfg->column_width;
+
+    /* <stdout> is being used for something else */
+    if (cfg->is_quiet)
+        return;
+
+    if (cfg->format != FORMAT_HUMAN) {
+        print_record(filename, results, info, cfg);
+        return;
+    }
+
+    /* -l */
+    if (cfg->is_counting_lines)
+        printf("%s%*lu", needs_space++?" ":"", width, results->line_count);
+
+    /* -w */
+    if (cfg->is_counting_words)
+        printf("%s%*lu", needs_space++?" ":"", width, results->word_count);
+
+    /* -c */
+    if (cfg->is_counting_bytes)
+        printf("%s%*lu", needs_space++?" ":"", width, results->byte_count);
+
+    /* -m */
+    if (cfg->is_counting_chars)
+        printf("%s%*lu", needs_space++?" ":"", width, results->char_count);
+
+    /* NULL if <stdin>, "total" for the last line showing totals, otherwise,
+     * the name of the file that was processed */
+    if (filename)
+        printf("%s%s", needs_space++?" ":"", filename);
+    printf("\n");
+}
+
+
+/**
+ * Run whichever engine was selected on the command-line
+ * over the next chunk of input.
+ */
+static struct wc2_results
+parse_chunk_cfg(const unsigned char *buf, size_t length, unsigned *inout_state, const struct config *cfg)
+{
+    return cfg->engine->parse(cfg->machine, buf, length, inout_state);
+}
+
+/**
+ * The same, but for when the state is that of the state-machine, such
+ * as one saved in the index, which only some engines understand.
+ */
+static struct wc2_results
+parse_chunk_table(const unsigned char *buf, size_t length, unsigned *inout_state, const struct config *cfg)
+{
+    if (cfg->engine->flags & WC2_ENGINE_TABLE)
+        return cfg->engine->parse(cfg->machine, buf, length, inout_state);
+    else
+        return wc2_parse(cfg->machine, buf, length, inout_state);
+}
+
+/**
+ * For '--verify', run both engines over the chunk. If they disagree,
+ * go back over the chunk a byte at a time to find the first byte where
+ * they differ, then stop the program.
+ */
+static struct wc2_results
+parse_chunk_verify(const unsigned char *buf, size_t length, unsigned long long offset,
+                   unsigned *inout_state, unsigned *inout_verify_state, const struct config *cfg)
+{
+    const struct wc2_engine *e1 = cfg->engine;
+    const struct wc2_engine *e2 = cfg->verify_engine;
+    unsigned state1 = *inout_state;
+    unsigned state2 = *inout_verify_state;
+    struct wc2_results x;
+    struct wc2_results y;
+    struct wc2_results sum1 = {0, 0, 0, 0};
+    struct wc2_results sum2 = {0, 0, 0, 0};
+    size_t i;
+
+    x = e1->parse(cfg->machine, buf, length, inout_state);
+    y = e2->parse(cfg->machine, buf, length, inout_verify_state);
+    if (memcmp(&x, &y, sizeof(x)) == 0)
+        return x;
+
+    for (i=0; i<length; i++) {
+        x = e1->parse(cfg->machine, buf + i, 1, &state1);
+        y = e2->parse(cfg->machine, buf + i, 1, &state2);
+        sum1.line_count += x.line_count;
+        sum1.word_count += x.word_count;
+        sum1.char_count += x.char_count;
+        sum2.line_count += y.line_count;
+        sum2.word_count += y.word_count;
+        sum2.char_count += y.char_count;
+        if (memcmp(&sum1, &sum2, sizeof(sum1)) != 0)
+            break;
+    }
+    fprintf(stderr, "wc2: engines '%s' and '%s' differ at offset %llu (byte 0x%02x)\n",
+            e1->name, e2->name, offset + i, i < length ? buf[i] : 0);
+    fprintf(stderr, "wc2: %s: lines=%lu words=%lu chars=%lu\n",
+            e1->name, sum1.line_count, sum1.word_count, sum1.char_count);
+    fprintf(stderr, "wc2: %s: lines=%lu words=%lu chars=%lu\n",
+            e2->name, sum2.line_count, sum2.word_count, sum2.char_count);
+    exit(2);
+}
+
+/**
+ * Regular files are mapped into memory, so that we parse them where
+ * they are in the page cache instead of copying them into our buffer.
+ * This is also the case for <stdin> when it's redirected from a file,
+ * where we start from wherever the file offset is. Returns NULL when the
+ * file can't be mapped, and it has to be read instead.
+ */
+static const unsigned char *
+map_input(FILE *fp, size_t *length, void **base, size_t *base_length)
+{
+#ifndef _WIN32
+    struct stat st;
+    off_t start = ftello(fp);
+
+    if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && start >= 0 && st.st_size > start
+        && (unsigned long long)(st.st_size - start) <= (size_t)-1 - 65536) {
+        long pagesize = sysconf(_SC_PAGESIZE);
+        off_t aligned = start - start % pagesize;
+        void *p;
+
+        p = mmap(NULL, st.st_size - aligned, PROT_READ, MAP_PRIVATE, fileno(fp), aligned);
+        if (p != MAP_FAILED) {
+            madvise(p, st.st_size - aligned, MADV_SEQUENTIAL);
+            fseeko(fp, st.st_size, SEEK_SET);
+            *base = p;
+            *base_length = st.st_size - aligned;
+            *length = st.st_size - start;
+            return (const unsigned char *)p + (start - aligned);
+        }
+    }
+#else
+    (void)fp;
+#endif
+    *base = NULL;
+    *base_length = 0;
+    *length = 0;
+    return NULL;
+}
+
+static void
+unmap_input(void *base, size_t base_length)
+{
+#ifndef _WIN32
+    if (base)
+        munmap(base, base_length);
+#else
+    (void)base;
+    (void)base_length;
+#endif
+}
+
+/**
+ * Print one of the offsets from '--split-points'
+ */
+static void
+print_split_point(unsigned long long offset, const char *filename)
+{
+    if (filename)
+        printf("%llu %s\n", offset, filename);
+    else
+        printf("%llu\n", offset);
+}
+
+#ifndef _WIN32
+/**
+ * For '-j', the input is cut into big blocks, each of which is counted
+ * by a worker thread from every possible starting state, using
+ * 'wc2_summarize()'. Only once the blocks are put back in order do we
+ * know which state each one really started in, so the reducer then
+ * picks out the counts for that state. At most 'block_count' blocks are
+ * in flight at once, which bounds the memory used, and stops the reader
+ * getting too far ahead of the workers.
+ */
+#define PARALLEL_BLOCKSIZE (1024 * 1024)
+
+struct parallel_block {
+    unsigned char *buf;
+    const unsigned char *data;
+    size_t length;
+    unsigned long long seq;
+    int is_done;
+    struct wc2_summary summary;
+};
+
+struct parallel {
+    const struct config *cfg;
+    FILE *fp;
+    const unsigned char *map;
+    size_t map_length;
+    pthread_mutex_t lock;
+    pthread_cond_t is_free;     /* signalled when a block is given back */
+    pthread_cond_t is_work;     /* signalled when a block has been read */
+    pthread_cond_t is_done;     /* signalled when a block has been counted */
+    struct parallel_block *blocks;
+    size_t block_count;
+    struct parallel_block **free_list;
+    size_t free_count;
+    struct parallel_block **work;   /* ring of blocks waiting for a worker */
+    size_t work_head;
+    size_t work_count;
+    struct parallel_block **in_order; /* blocks in flight, by seq % block_count */
+    unsigned long long read_count;
+    int is_eof;
+};
+
+/**
+ * The reader thread, which fills free blocks from the input, or for
+ * a mapped file, just points them at the next part of it.
+ */
+static void *
+parallel_reader(void *arg)
+{
+    struct parallel *par = arg;
+    size_t map_offset = 0;
+
+    for (;;) {
+        struct parallel_block *block;
+
+        pthread_mutex_lock(&par->lock);
+        while (par->free_count == 0)
+            pthread_cond_wait(&par->is_free, &par->lock);
+        block = par->free_list[--par->free_count];
+        pthread_mutex_unlock(&par->lock);
+
+        if (par->map) {
+            block->data = par->map + map_offset;
+            block->length = par->map_length - map_offset;
+            if (block->length > PARALLEL_BLOCKSIZE)
+                block->length = PARALLEL_BLOCKSIZE;
+            map_offset += block->length;
+        } else {
+            unsigned long long start = par->cfg->stats ? now_nsecs() : 0;
+            WC2_PROBE1(read__start, PARALLEL_BLOCKSIZE);
+            block->length = fread(block->buf, 1, PARALLEL_BLOCKSIZE, par->fp);
+            WC2_PROBE1(read__done, block->length);
+            if (par->cfg->stats)
+                stats_read(par->cfg->stats, block->length, now_nsecs() - start);
+            block->data = block->buf;
+            if (block->length == 0 && ferror(par->fp))
+                perror("read");
+        }
+
+        pthread_mutex_lock(&par->lock);
+        if (block->length == 0) {
+            par->free_list[par->free_count++] = block;
+            par->is_eof = 1;
+            pthread_cond_broadcast(&par->is_work);
+            pthread_cond_broadcast(&par->is_done);
+            pthread_mutex_unlock(&par->lock);
+            return NULL;
+        }
+        block->seq = par->read_count++;
+        block->is_done = 0;
+        par->in_order[block->seq % par->block_count] = block;
+        par->work[(par->work_head + par->work_count++) % par->block_count] = block;
+        pthread_cond_signal(&par->is_work);
+        pthread_mutex_unlock(&par->lock);
+    }
+}
+
+/**
+ * A worker thread, which summarizes blocks as they are read
+ */
+static void *
+parallel_worker(void *arg)
+{
+    struct parallel *par = arg;
+
+    for (;;) {
+        struct parallel_block *block;
+        unsigned long long start;
+
+        pthread_mutex_lock(&par->lock);
+        while (par->work_count == 0 && !par->is_eof)
+            pthread_cond_wait(&par->is_work, &par->lock);
+        if (par->work_count == 0) {
+            pthread_mutex_unlock(&par->lock);
+            return NULL;
+        }
+        block = par->work[par->work_head];
+        par->work_head = (par->work_head + 1) % par->block_count;
+        par->work_count--;
+        pthread_mutex_unlock(&par->lock);
+
+        /* The workers parse from every state at once, which the probes
+         * show as WC2_STATE_MAX */
+        start = par->cfg->stats ? now_nsecs() : 0;
+        WC2_PROBE2(parse__start, block->length, WC2_STATE_MAX);
+        wc2_summarize(par->cfg->machine, block->data, block->length, &block->summary);
+        WC2_PROBE2(parse__done, block->length, WC2_STATE_MAX);
+
+        /* With '--stats', the parse time is that of all the workers
+         * together, which is more than the time that passed */
+        pthread_mutex_lock(&par->lock);
+        if (par->cfg->stats)
+            par->cfg->stats->parse_ns += now_nsecs() - start;
+        block->is_done = 1;
+        pthread_cond_broadcast(&par->is_done);
+        pthread_mutex_unlock(&par->lock);
+    }
+}
+
+/**
+ * Count the input with '-j' threads. This thread is the reducer, which
+ * takes the blocks in the order they were read, and follows the state
+ * from one block's summary to the next.
+ */
+static struct wc2_results
+parse_parallel(FILE *fp, const struct config *cfg)
+{
+    struct wc2_results results = {0, 0, 0, 0};
+    struct parallel par;
+    pthread_t reader;
+    pthread_t *workers;
+    void *map_base;
+    size_t map_base_length;
+    unsigned long long next;
+    unsigned state = 0;
+    size_t i;
+
+    memset(&par, 0, sizeof(par));
+    par.cfg = cfg;
+    par.fp = fp;
+    par.map = map_input(fp, &par.map_length, &map_base, &map_base_length);
+    if (par.map && cfg->stats)
+        cfg->stats->mapped_bytes += par.map_length;
+    par.block_count = cfg->block_count ? cfg->block_count : 2 * cfg->thread_count;
+    pthread_mutex_init(&par.lock, NULL);
+    pthread_cond_init(&par.is_free, NULL);
+    pthread_cond_init(&par.is_work, NULL);
+    pthread_cond_init(&par.is_done, NULL);
+
+    par.blocks = calloc(par.block_count, sizeof(par.blocks[0]));
+    par.free_list = calloc(par.block_count, sizeof(par.free_list[0]));
+    par.work = calloc(par.block_count, sizeof(par.work[0]));
+    par.in_order = calloc(par.block_count, sizeof(par.in_order[0]));
+    workers = calloc(cfg->thread_count, sizeof(workers[0]));
+    if (par.blocks == NULL || par.free_list == NULL || par.work == NULL || par.in_order == NULL || workers == NULL)
+        abort();
+    for (i=0; i<par.block_count; i++) {
+        if (par.map == NULL) {
+            par.blocks[i].buf = malloc(PARALLEL_BLOCKSIZE);
+            if (par.blocks[i].buf == NULL)
+                abort();
+        }
+        par.free_list[par.free_count++] = &par.blocks[i];
+    }
+
+    pthread_create(&reader, NULL, parallel_reader, &par);
+    for (i=0; i<cfg->thread_count; i++)
+        pthread_create(&workers[i], NULL, parallel_worker, &par);
+
+    for (next=0; ; next++) {
+        struct parallel_block *block;
+        const struct wc2_results *x;
+
+        pthread_mutex_lock(&par.lock);
+        for (;;) {
+            block = par.in_order[next % par.block_count];
+            if (block && block->seq == next && block->is_done)
+                break;
+            if (par.is_eof && next >= par.read_count)
+                break;
+            pthread_cond_wait(&par.is_done, &par.lock);
+        }
+        if (par.is_eof && next >= par.read_count) {
+            pthread_mutex_unlock(&par.lock);
+            break;
+        }
+        par.in_order[next % par.block_count] = NULL;
+        pthread_mutex_unlock(&par.lock);
+
+        x = &block->summary.results[state];
+        results.line_count += x->line_count;
+        results.word_count += x->word_count;
+        results.char_count += x->char_count;
+        results.byte_count += x->byte_count;
+        state = block->summary.exit_state[state];
+
+        pthread_mutex_lock(&par.lock);
+        par.free_list[par.free_count++] = block;
+        pthread_cond_signal(&par.is_free);
+        pthread_mutex_unlock(&par.lock);
+    }
+
+    pthread_join(reader, NULL);
+    for (i=0; i<cfg->thread_count; i++)
+        pthread_join(workers[i], NULL);
+
+    for (i=0; i<par.block_count; i++)
+        free(par.blocks[i].buf);
+    free(par.blocks);
+    free(par.free_list);
+    free(par.work);
+    free(par.in_order);
+    free(workers);
+    pthread_mutex_destroy(&par.lock);
+    pthread_cond_destroy(&par.is_free);
+    pthread_cond_destroy(&par.is_work);
+    pthread_cond_destroy(&par.is_done);
+    unmap_input(map_base, map_base_length);
+    return results;
+}
+
+/**
+ * For '--split-points' with '-j', the newlines in each block of a
+ * mapped file, counted by several threads at once.
+ */
+struct split_blocks {
+    const unsigned char *map;
+    size_t map_length;
+    unsigned long long *counts;
+    size_t block_count;
+    size_t next;
+    pthread_mutex_t lock;
+};
+
+static void *
+split_worker(void *arg)
+{
+    struct split_blocks *sb = arg;
+
+    for (;;) {
+        const unsigned char *p;
+        const unsigned char *end;
+        unsigned long long count = 0;
+        size_t i;
+
+        pthread_mutex_lock(&sb->lock);
+        i = sb->next++;
+        pthread_mutex_unlock(&sb->lock);
+        if (i >= sb->block_count)
+            break;
+
+        p = sb->map + i * PARALLEL_BLOCKSIZE;
+        end = sb->map + sb->map_length;
+        if (end - p > PARALLEL_BLOCKSIZE)
+            end = p + PARALLEL_BLOCKSIZE;
+        while ((p = memchr(p, '\n', end - p)) != NULL) {
+            p++;
+            count++;
+        }
+        sb->counts[i] = count;
+    }
+    return NULL;
+}
+
+/**
+ * The first pass of '--split-points' with '-j', for a file that can be
+ * mapped: the threads count the newlines in each block, then each
+ * boundary is found by searching the one block it falls in. The
+ * offsets are from the start of the file, even for <stdin> starting
+ * partway into one. Returns nonzero if the file can't be mapped, and
+ * has to be read instead.
+ */
+static int
+split_parallel(FILE *fp, const char *filename, const struct config *cfg, struct wc2_results *results)
+{
+    struct split_blocks sb;
+    void *map_base;
+    size_t map_base_length;
+    pthread_t *workers;
+    unsigned long long k = cfg->split_count;
+    unsigned long long total = 0;
+    unsigned long long i;
+    size_t block = 0;
+    unsigned long long before = 0; /* newlines before 'block' */
+    unsigned long long start = ftello(fp);
+    size_t n;
+
+    memset(&sb, 0, sizeof(sb));
+    sb.map = map_input(fp, &sb.map_length, &map_base, &map_base_length);
+    if (sb.map == NULL)
+        return 1;
+    sb.block_count = (sb.map_length + PARALLEL_BLOCKSIZE - 1) / PARALLEL_BLOCKSIZE;
+    sb.counts = calloc(sb.block_count, sizeof(sb.counts[0]));
+    workers = calloc(cfg->thread_count, sizeof(workers[0]));
+    if (sb.counts == NULL || workers == NULL)
+        abort();
+    pthread_mutex_init(&sb.lock, NULL);
+
+    for (n=0; n<cfg->thread_count; n++)
+        pthread_create(&workers[n], NULL, split_worker, &sb);
+    for (n=0; n<cfg->thread_count; n++)
+        pthread_join(workers[n], NULL);
+    pthread_mutex_destroy(&sb.lock);
+
+    for (n=0; n<sb.block_count; n++)
+        total += sb.counts[n];
+
+    /* The boundaries only move forward, so so does the block */
+    for (i=1; i<k; i++) {
+        unsigned long long line = total * i / k;
+        const unsigned char *p;
+        const unsigned char *end;
+
+        if (line == 0) {
+            print_split_point(start, filename);
+            continue;
+        }
+        while (before + sb.counts[block] < line)
+            before += sb.counts[block++];
+
+        p = sb.map + block * PARALLEL_BLOCKSIZE;
+        end = sb.map + sb.map_length;
+        for (line -= before; line; line--)
+            p = (const unsigned char *)memchr(p, '\n', end - p) + 1;
+        print_split_point(start + (p - sb.map), filename);
+    }
+
+    results->line_count = total;
+    results->byte_count = sb.map_length;
+    free(sb.counts);
+    free(workers);
+    unmap_input(map_base, map_base_length);
+    return 0;
+}
+#else
+static struct wc2_results
+parse_file(FILE *fp, const struct config *cfg);
+
+/* No threads on Windows, so we count the normal way */
+static struct wc2_results
+parse_parallel(FILE *fp, const struct config *cfg)
+{
+    struct config cfg1 = *cfg;
+    cfg1.thread_count = 1;
+    return parse_file(fp, &cfg1);
+}
+#endif
+
+/**
+ * Append offsets to the output of '--newline-offsets' or '--word-offsets'.
+ * If the disk is full, it's better to stop than to leave a file that
+ * looks complete but isn't.
+ */
+static void
+write_offsets(FILE *fp, const char *filename, const uint64_t *offsets, size_t n)
+{
+    if (fwrite(offsets, sizeof(*offsets), n, fp) != n) {
+        perror(strcmp(filename, "-") == 0 ? "<stdout>" : filename);
+        exit(1);
+    }
+}
+
+/**
+ * Close the output of '--newline-offsets' or '--word-offsets', which
+ * is when buffered writes fail. Returns nonzero on an error.
+ */
+static int
+close_offsets(FILE *fp, const char *filename)
+{
+    int err;
+
+    if (fp == NULL)
+        return 0;
+    if (fp == stdout)
+        err = fflush(fp) != 0 || ferror(fp);
+    else
+        err = fclose(fp) != 0;
+    if (err)
+        perror(strcmp(filename, "-") == 0 ? "<stdout>" : filename);
+    return err;
+}
+
+/**
+ * Parse an individual file, or <stdin>, and print the results
+ */
+static struct wc2_results
+parse_file(FILE *fp, const struct config *cfg)
+{
+    size_t bufsize = cfg->bufsize;
+    size_t chunksize = bufsize;
+    struct wc2_results results = {0, 0, 0, 0};
+    unsigned state = 0; /* state held between chunks */
+    unsigned verify_state = 0; /* same, for the engine checking it */
+    unsigned char *buf;
+    uint64_t *offsets = NULL;
+
+    void *map_base = NULL;
+    size_t map_base_length = 0;
+    const unsigned char *map;
+    size_t map_length = 0;
+    size_t map_offset = 0;
+
+    /* With '-j', other threads do the counting */
+    if (cfg->thread_count > 1 && !cfg->newline_offsets && !cfg->word_offsets && !cfg->verify_engine
+        && !cfg->profile)
+        return parse_parallel(fp, cfg);
+
+    buf = malloc(bufsize);
+    if (buf == NULL)
+        abort();
+
+    map = map_input(fp, &map_length, &map_base, &map_base_length);
+    if (map && cfg->stats)
+        cfg->stats->mapped_bytes += map_length;
+    if (map)
+        chunksize = cfg->mapsize;
+
+    if (cfg->newline_offsets || cfg->word_offsets) {
+        offsets = malloc(chunksize * sizeof(*offsets));
+        if (offsets == NULL)
+            abort();
+    }
+
+    /* Process a chunk at a time */
+    for (;;) {
+        size_t count;
+        struct wc2_results x;
+        const unsigned char *chunk;
+        unsigned long long start = 0;
+
+        /* Get the next chunk of data from the file */
+        if (map) {
+            if (map_offset >= map_length)
+                break;
+            count = map_length - map_offset;
+            if (count > chunksize)
+                count = chunksize;
+            chunk = map + map_offset;
+            map_offset += count;
+        } else {
+            if (cfg->stats)
+                start = now_nsecs();
+            WC2_PROBE1(read__start, bufsize);
+            count = fread(buf, 1, bufsize, fp);
+            WC2_PROBE1(read__done, count);
+            if (cfg->stats)
+                stats_read(cfg->stats, count, now_nsecs() - start);
+            if (count <= 0)
+                break;
+            chunk = buf;
+        }
+        if (cfg->stats)
+            start = now_nsecs();
+        WC2_PROBE2(parse__start, count, state);
+
+        /* Write the offsets, if asked for, in the same pass */
+        if (cfg->newline_offsets) {
+            size_t n = wc2_newline_offsets(chunk, count, results.byte_count, offsets);
+            write_offsets(cfg->newline_offsets, cfg->newline_offsets_name, offsets, n);
+        }
+
+        /* Do the word-count algorithm */
+        if (cfg->word_offsets) {
+            size_t n;
+            x = wc2_parse_words(cfg->machine, chunk, count, &state, results.byte_count, offsets, &n);
+            write_offsets(cfg->word_offsets, cfg->word_offsets_name, offsets, n);
+        } else if (cfg->verify_engine)
+            x = parse_chunk_verify(chunk, count, results.byte_count, &state, &verify_state, cfg);
+        else if (cfg->profile)
+            x = wc2_parse_profile(cfg->machine, chunk, count, &state, cfg->profile);
+        else
+            x = parse_chunk_cfg(chunk, count, &state, cfg);
+        if (cfg->stats)
+            cfg->stats->parse_ns += now_nsecs() - start;
+        WC2_PROBE2(parse__done, count, state);
+
+        /* Sum the results */
+        results.line_count += x.line_count;
+        results.word_count += x.word_count;
+        results.byte_count += x.byte_count;
+        results.char_count += x.char_count;
+    }
+
+    unmap_input(map_base, map_base_length);
+    free(offsets);
+    free(buf);
+    return results;
+}
+
+/**
+ * One transition in the '--state-profile', for sorting them
+ */
+struct transition {
+    unsigned from;
+    unsigned to;
+    uint64_t count;
+};
+
+static int
+compare_transitions(const void *lhs, const void *rhs)
+{
+    const struct transition *a = lhs;
+    const struct transition *b = rhs;
+    if (a->count != b->count)
+        return (a->count < b->count) - (a->count > b->count);
+    if (a->from != b->from)
+        return (a->from > b->from) - (a->from < b->from);
+    return (a->to > b->to) - (a->to < b->to);
+}
+
+/**
+ * Print the '--state-profile': how often every state was visited, then
+ * the transitions that were taken at all, most frequent first, which is
+ * the transition matrix without its zeroes.
+ */
+static void
+print_profile(const struct wc2_profile *profile)
+{
+    struct transition *list;
+    uint64_t total = 0;
+    size_t count = 0;
+    unsigned i, j;
+
+    for (i=0; i<WC2_STATE_MAX; i++)
+        total += profile->visits[i];
+
+    printf("# state visits\n");
+    for (i=0; i<WC2_STATE_MAX; i++) {
+        printf("%-18s %14llu %8.4f%%\n", wc2_state_name(i), (unsigned long long)profile->visits[i],
+               total ? 100.0 * profile->visits[i] / total : 0.0);
+    }
+
+    list = malloc(sizeof(list[0]) * WC2_STATE_MAX * WC2_STATE_MAX);
+    if (list == NULL)
+        abort();
+    for (i=0; i<WC2_STATE_MAX; i++) {
+        for (j=0; j<WC2_STATE_MAX; j++) {
+            if (profile->transitions[i][j] == 0)
+                continue;
+            list[count].from = i;
+            list[count].to = j;
+            list[count].count = profile->transitions[i][j];
+            count++;
+        }
+    }
+    qsort(list, count, sizeof(list[0]), compare_transitions);
+
+    printf("# transitions\n");
+    for (i=0; i<count; i++) {
+        printf("%-18s %-18s %14llu %8.4f%%\n", wc2_state_name(list[i].from), wc2_state_name(list[i].to),
+               (unsigned long long)list[i].count, total ? 100.0 * list[i].count / total : 0.0);
+    }
+    free(list);
+}
+
+/**
+ * Whether only '-c' was asked for, in which case we don't need to look
+ * at the contents at all.
+ */
+static int
+is_bytes_only(const struct config *cfg)
+{
+    return cfg->is_counting_bytes
+        && !cfg->is_counting_lines
+        && !cfg->is_counting_words
+        && !cfg->is_counting_chars
+        && !cfg->newline_offsets
+        && !cfg->word_offsets
+        && !cfg->verify_engine
+        && !cfg->profile;
+}
+
+/**
+ * Count the bytes without reading them, when we can. For a regular file,
+ * that's its size past the current offset. For a pipe on Linux, we
+ * 'splice()' it into /dev/null, which drains it without copying the data
+ * to us. Returns 0 if neither works, and the caller has to read it.
+ */
+static int
+count_bytes(FILE *fp, struct wc2_results *results)
+{
+#ifndef _WIN32
+    struct stat st;
+    int fd = fileno(fp);
+
+    if (fstat(fd, &st) != 0)
+        return 0;
+
+    /* Files in /proc and the like say they are empty, so those we read */
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        off_t start = ftello(fp);
+        if (start < 0)
+            return 0;
+        memset(results, 0, sizeof(*results));
+        if (st.st_size > start)
+            results->byte_count = st.st_size - start;
+        fseeko(fp, st.st_size, SEEK_SET);
+        return 1;
+    }
+
+#ifdef __linux__
+    if (S_ISFIFO(st.st_mode)) {
+        unsigned long long total = 0;
+        int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+        if (devnull < 0)
+            return 0;
+        for (;;) {
+            ssize_t count = splice(fd, NULL, devnull, NULL, 1024 * 1024, SPLICE_F_MOVE);
+            if (count > 0) {
+                total += count;
+                continue;
+            }
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count < 0 && total == 0) {
+                /* Not supported, so read it the normal way */
+                close(devnull);
+                return 0;
+            }
+            if (count < 0)
+                perror("splice");
+            break;
+        }
+        close(devnull);
+        memset(results, 0, sizeof(*results));
+        results->byte_count = total;
+        return 1;
+    }
+#endif
+#else
+    (void)fp;
+    (void)results;
+#endif
+    return 0;
+}
+
+/**
+ * When <stdin> is a pipe, ask for a bigger pipe buffer, so that whatever
+ * is writing to it can get further ahead of us, and read it in chunks
+ * of the same size, so there are fewer reads.
+ */
+static void
+setup_pipe(FILE *fp, struct config *cfg)
+{
+#if defined(__linux__) && defined(F_SETPIPE_SZ)
+    struct stat st;
+    int size;
+
+    if (fstat(fileno(fp), &st) != 0 || !S_ISFIFO(st.st_mode))
+        return;
+
+    /* This fails past /proc/sys/fs/pipe-max-size, which is 1 MiB by
+     * default, in which case we keep what we have */
+    fcntl(fileno(fp), F_SETPIPE_SZ, 1024 * 1024);
+    size = fcntl(fileno(fp), F_GETPIPE_SZ);
+    if (size > 0 && (size_t)size > cfg->bufsize)
+        cfg->bufsize = size;
+#else
+    (void)fp;
+    (void)cfg;
+#endif
+}
+
+/**
+ * Implements '--split-points=K', printing the K-1 offsets that divide
+ * the input into K shards, each starting at the beginning of a line,
+ * with the lines shared out as evenly as possible. The input is read
+ * once, remembering the offset after every 'stride'-th newline. When
+ * there are too many to remember, every other one is thrown away and
+ * the stride doubles, so memory stays fixed. At the end, a boundary
+ * that falls between two remembered newlines is found by searching
+ * forward from the one before it, which reads at most one stride of
+ * lines. That can't be done with <stdin>, so there the boundary is
+ * rounded to the nearest remembered newline. The offsets are from the
+ * start of the file, not from where reading began, since that's what
+ * 'pread()' wants when <stdin> is a file opened partway in. With '-j',
+ * a file that can be mapped is counted by 'split_parallel()' instead.
+ */
+static struct wc2_results
+split_file(FILE *fp, const char *filename, const struct config *cfg)
+{
+    enum {BUFSIZE=65536, SAMPLE_MAX=65536};
+    struct wc2_results results = {0, 0, 0, 0};
+    uint64_t *samples;
+    uint64_t *offsets;
+    unsigned char *buf;
+    size_t sample_count = 0;
+    unsigned long long stride = 1;
+    unsigned long long k = cfg->split_count;
+    unsigned long long i;
+    off_t start;
+    int is_seekable;
+
+#ifndef _WIN32
+    if (cfg->thread_count > 1 && split_parallel(fp, filename, cfg, &results) == 0)
+        return results;
+#endif
+
+    buf = malloc(BUFSIZE);
+    offsets = malloc(BUFSIZE * sizeof(*offsets));
+    samples = malloc(SAMPLE_MAX * sizeof(*samples));
+    if (buf == NULL || offsets == NULL || samples == NULL)
+        abort();
+
+    /* Pipes have no offset, and count from zero */
+    start = ftello(fp);
+    if (start < 0)
+        start = 0;
+
+    for (;;) {
+        size_t count;
+        size_t n;
+        size_t j;
+
+        count = fread(buf, 1, BUFSIZE, fp);
+        if (count <= 0)
+            break;
+
+        n = wc2_newline_offsets(buf, count, start + results.byte_count, offsets);
+        for (j=0; j<n; j++) {
+            if ((results.line_count + j + 1) % stride != 0)
+                continue;
+            if (sample_count == SAMPLE_MAX) {
+                size_t m;
+                for (m=0; m<SAMPLE_MAX/2; m++)
+                    samples[m] = samples[2*m + 1];
+                sample_count = SAMPLE_MAX/2;
+                stride *= 2;
+                if ((results.line_count + j + 1) % stride != 0)
+                    continue;
+            }
+            samples[sample_count++] = offsets[j] + 1;
+        }
+        results.line_count += n;
+        results.byte_count += count;
+    }
+
+    is_seekable = fseeko(fp, start, SEEK_SET) == 0;
+
+    for (i=1; i<k; i++) {
+        unsigned long long line = results.line_count * i / k;
+        unsigned long long offset = start;
+
+        /* Sample 'j' is just past newline number (j + 1) * stride */
+        if (!is_seekable) {
+            unsigned long long nearest = (line + stride/2) / stride;
+            if (nearest > sample_count)
+                nearest = sample_count;
+            if (nearest)
+                offset = samples[nearest - 1];
+            line = 0;
+        } else if (line >= stride) {
+            size_t j = line / stride - 1;
+            offset = samples[j];
+            line -= (j + 1) * stride;
+        }
+
+        /* Search forward for the exact newline */
+        if (line && is_seekable && fseeko(fp, offset, SEEK_SET) == 0) {
+            while (line) {
+                size_t count = fread(buf, 1, BUFSIZE, fp);
+                const unsigned char *p = buf;
+                const unsigned char *end = buf + count;
+
+                if (count <= 0)
+                    break;
+                while (line && (p = memchr(p, '\n', end - p)) != NULL) {
+                    p++;
+                    line--;
+                }
+                if (line == 0)
+                    offset += p - buf;
+                else
+                    offset += count;
+            }
+        }
+
+        print_split_point(offset, filename);
+    }
+
+    free(samples);
+    free(offsets);
+    free(buf);
+    return results;
+}
+
+
+/**
+ * Implements '--summary', printing the summary of the entire input
+ * from every starting state, so that pieces of some larger input can
+ * be counted separately and combined later with '--merge'. This is
+ * printed as text, so it can move between machines:
+ *
+ *  wc2-summary 1 <hash> <states> <bytes>
+ *  <exit-state> <lines> <words> <chars>     (one line per entry state)
+ */
+static struct wc2_results
+summary_file(FILE *fp, const struct config *cfg)
+{
+    enum {BUFSIZE=65536};
+    struct wc2_summary *total;
+    struct wc2_summary *chunk;
+    struct wc2_results results;
+    unsigned char *buf;
+    unsigned s;
+
+    buf = malloc(BUFSIZE);
+    total = malloc(sizeof(*total));
+    chunk = malloc(sizeof(*chunk));
+    if (buf == NULL || total == NULL || chunk == NULL)
+        abort();
+
+    wc2_summary_init(total);
+    for (;;) {
+        size_t count = fread(buf, 1, BUFSIZE, fp);
+        if (count <= 0)
+            break;
+        wc2_summarize(cfg->machine, buf, count, chunk);
+        wc2_summary_compose(total, chunk);
+    }
+
+    printf("wc2-summary 1 %016llx %u %lu\n",
+            (unsigned long long)wc2_machine_hash(cfg->machine),
+            (unsigned)WC2_STATE_MAX,
+            total->results[0].byte_count);
+    for (s=0; s<WC2_STATE_MAX; s++) {
+        const struct wc2_results *r = &total->results[s];
+        printf("%u %lu %lu %lu\n", total->exit_state[s], r->line_count, r->word_count, r->char_count);
+    }
+
+    results = total->results[0];
+    free(chunk);
+    free(total);
+    free(buf);
+    return results;
+}
+
+/**
+ * Read the summaries in a file written by '--summary', in order,
+ * combining them into 'total'. The summaries must all come from the
+ * state-machine that the counts are being printed for, the one with
+ * the hash 'hash'.
+ */
+static int
+merge_file(FILE *fp, const char *filename, struct wc2_summary *total, unsigned long long hash)
+{
+    for (;;) {
+        struct wc2_summary piece;
+        unsigned long long piece_hash;
+        unsigned version;
+        unsigned state_count;
+        unsigned long byte_count;
+        unsigned s;
+        int x;
+
+        x = fscanf(fp, " wc2-summary %u %llx %u %lu", &version, &piece_hash, &state_count, &byte_count);
+        if (x == EOF)
+            return 0;
+        if (x != 4 || version != 1 || state_count != WC2_STATE_MAX) {
+            fprintf(stderr, "%s: not a summary\n", filename);
+            return -1;
+        }
+        if (piece_hash != hash) {
+            fprintf(stderr, "%s: summary is for a different locale or character-set\n", filename);
+            return -1;
+        }
+
+        for (s=0; s<WC2_STATE_MAX; s++) {
+            unsigned exit_state;
+            struct wc2_results *r = &piece.results[s];
+
+            if (fscanf(fp, "%u %lu %lu %lu", &exit_state, &r->line_count, &r->word_count, &r->char_count) != 4
+                || exit_state >= WC2_STATE_MAX) {
+                fprintf(stderr, "%s: corrupt summary\n", filename);
+                return -1;
+            }
+            piece.exit_state[s] = exit_state;
+            r->byte_count = byte_count;
+        }
+
+        wc2_summary_compose(total, &piece);
+    }
+}
+
+/**
+ * Implements '--merge', reading summaries from the files on the
+ * command-line (or <stdin>) in order, and printing the counts for
+ * all of them together, exactly as if the original pieces had been
+ * counted as one input.
+ */
+static int
+merge_files(int argc, char *argv[], struct config *cfg)
+{
+    struct wc2_summary total;
+    struct file_info merged = {RECORD_TOTAL, -1, 0, 0};
+    unsigned long long hash = wc2_machine_hash(cfg->machine);
+    unsigned long long start = now_nsecs();
+    int i;
+
+    wc2_summary_init(&total);
+
+    for (i=1; i<argc; i++) {
+        FILE *fp;
+
+        if (!is_filename_arg(cfg, argv, i))
+            continue;
+        fp = fopen(argv[i], "rb");
+        if (fp == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+        if (merge_file(fp, argv[i], &total, hash) != 0) {
+            fclose(fp);
+            return 1;
+        }
+        fclose(fp);
+    }
+    if (cfg->is_stdin) {
+        if (merge_file(stdin, "stdin", &total, hash) != 0)
+            return 1;
+    }
+
+    /* The counts for the whole input are those from the start state */
+    cfg->column_width = 1;
+    merged.elapsed_ns = now_nsecs() - start;
+    print_results(NULL, &total.results[0], &merged, cfg);
+    return 0;
+}
+
+/**
+ * The sidecar index written by '--index'. For every block of the file,
+ * it holds the summary from every possible entry state, so that after an
+ * in-place edit only the changed blocks need to be parsed again. It also
+ * holds the true state and running totals at the start of every block,
+ * so that counts for any range of the file can be calculated by reading
+ * just two of those, and parsing the partial blocks at either edge.
+ *
+ * The layout is the header, then 'block_count' rows of WC2_STATE_MAX entries,
+ * then 'block_count + 1' prefixes. Integers are in native byte-order.
+ */
+enum {INDEX_BLOCKSIZE=1024*1024, INDEX_VERSION=1};
+
+struct index_header {
+    char magic[8];          /* "WC2INDEX" */
+    uint32_t version;
+    uint32_t state_count;   /* WC2_STATE_MAX */
+    uint32_t block_size;    /* INDEX_BLOCKSIZE */
+    uint32_t reserved;
+    uint64_t table_hash;    /* changes with the locale or -m */
+    uint64_t file_size;
+    int64_t file_mtime;
+    int64_t file_mtime_nsec;
+    uint64_t block_count;
+};
+
+struct index_entry {
+    uint32_t line_count;
+    uint32_t word_count;
+    uint32_t char_count;
+    uint8_t exit_state;
+    uint8_t reserved[3];
+};
+
+struct index_prefix {
+    uint64_t line_count;
+    uint64_t word_count;
+    uint64_t char_count;
+    uint32_t state;
+    uint32_t reserved;
+};
+
+static void
+stat_mtime(const struct stat *st, int64_t *secs, int64_t *nsecs)
+{
+    *secs = st->st_mtime;
+#if defined(__linux__)
+    *nsecs = st->st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+    *nsecs = st->st_mtimespec.tv_nsec;
+#else
+    *nsecs = 0;
+#endif
+}
+
+static char *
+index_filename(const char *filename)
+{
+    char *result = malloc(strlen(filename) + 6);
+    if (result == NULL)
+        abort();
+    strcpy(result, filename);
+    strcat(result, ".wc2i");
+    return result;
+}
+
+static off_t
+index_prefix_offset(const struct index_header *hdr, uint64_t block)
+{
+    return sizeof(*hdr)
+        + hdr->block_count * WC2_STATE_MAX * sizeof(struct index_entry)
+        + block * sizeof(struct index_prefix);
+}
+
+/**
+ * Open the sidecar index for a file. If 'is_exact' is set, then the index
+ * must match the current file contents, otherwise it just has to have
+ * been built with the same state-machine.
+ */
+static FILE *
+index_open(const char *filename, const struct stat *st, struct index_header *hdr, int is_exact, const struct wc2_machine *machine)
+{
+    char *idxname = index_filename(filename);
+    FILE *fp;
+    int64_t secs;
+    int64_t nsecs;
+
+    fp = fopen(idxname, "rb");
+    free(idxname);
+    if (fp == NULL)
+        return NULL;
+
+    stat_mtime(st, &secs, &nsecs);
+    if (fread(hdr, sizeof(*hdr), 1, fp) != 1
+        || memcmp(hdr->magic, "WC2INDEX", 8) != 0
+        || hdr->version != INDEX_VERSION
+        || hdr->state_count != WC2_STATE_MAX
+        || hdr->block_size != INDEX_BLOCKSIZE
+        || hdr->table_hash != wc2_machine_hash(machine)
+        || (is_exact && (hdr->file_size != (uint64_t)st->st_size
+                            || hdr->file_mtime != secs
+                            || hdr->file_mtime_nsec != nsecs))) {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+static int
+index_read_prefix(FILE *fp, const struct index_header *hdr, uint64_t block, struct index_prefix *prefix)
+{
+    if (fseeko(fp, index_prefix_offset(hdr, block), SEEK_SET) != 0)
+        return -1;
+    if (fread(prefix, sizeof(*prefix), 1, fp) != 1)
+        return -1;
+    return 0;
+}
+
+/**
+ * Parse the bytes between two offsets in a file, starting from the given
+ * state. This is how we handle the partial blocks at the edges of a range.
+ */
+static struct wc2_results
+parse_span(FILE *fp, unsigned long long start, unsigned long long end, unsigned *inout_state, unsigned char *buf, size_t sizeof_buf, const struct config *cfg)
+{
+    struct wc2_results results = {0, 0, 0, 0};
+
+    if (start >= end || fseeko(fp, start, SEEK_SET) != 0)
+        return results;
+
+    while (start < end) {
+        size_t count = sizeof_buf;
+        struct wc2_results x;
+
+        if (count > end - start)
+            count = end - start;
+        count = fread(buf, 1, count, fp);
+        if (count <= 0)
+            break;
+        start += count;
+
+        x = parse_chunk_table(buf, count, inout_state, cfg);
+        results.line_count += x.line_count;
+        results.word_count += x.word_count;
+        results.byte_count += x.byte_count;
+        results.char_count += x.char_count;
+    }
+    return results;
+}
+
+/**
+ * Build the index for the blocks from 'first_block' onward, reusing the
+ * 'entries' from blocks that haven't changed. Blocks in the range
+ * [first_block, last_block] are parsed again, as are any past the end of
+ * what the old index covered. Writes the new index file and returns the
+ * counts for the entire file.
+ */
+static struct wc2_results
+index_build(FILE *fp, const char *filename, const struct stat *st, struct index_entry *entries, uint64_t old_block_count,
+            uint64_t first_block, uint64_t last_block, const struct config *cfg)
+{
+    struct index_header hdr;
+    struct index_prefix *prefixes;
+    struct wc2_results results = {0, 0, 0, 0};
+    struct wc2_summary *summary;
+    unsigned char *buf;
+    uint64_t block_count;
+    uint64_t b;
+    char *idxname;
+    char *tmpname;
+    FILE *out;
+
+    block_count = (st->st_size + INDEX_BLOCKSIZE - 1) / INDEX_BLOCKSIZE;
+    entries = realloc(entries, (block_count + 1) * WC2_STATE_MAX * sizeof(*entries));
+    prefixes = calloc(block_count + 1, sizeof(*prefixes));
+    buf = malloc(INDEX_BLOCKSIZE);
+    summary = malloc(sizeof(*summary));
+    if (entries == NULL || prefixes == NULL || buf == NULL || summary == NULL)
+        abort();
+
+    /* Parse the blocks that we don't already know about */
+    for (b=first_block; b<block_count; b++) {
+        size_t count;
+        unsigned s;
+
+        if (b > last_block && b < old_block_count)
+            continue;
+        if (fseeko(fp, b * INDEX_BLOCKSIZE, SEEK_SET) != 0)
+            break;
+        count = fread(buf, 1, INDEX_BLOCKSIZE, fp);
+        if (count <= 0)
+            break;
+
+        wc2_summarize(cfg->machine, buf, count, summary);
+        for (s=0; s<WC2_STATE_MAX; s++) {
+            struct index_entry *e = &entries[b * WC2_STATE_MAX + s];
+            memset(e, 0, sizeof(*e));
+            e->line_count = summary->results[s].line_count;
+            e->word_count = summary->results[s].word_count;
+            e->char_count = summary->results[s].char_count;
+            e->exit_state = summary->exit_state[s];
+        }
+    }
+    results.byte_count = st->st_size;
+    if (b < block_count) {
+        /* The file shrank while we were reading it */
+        block_count = b;
+        results.byte_count = b * INDEX_BLOCKSIZE;
+    }
+
+    /* Chain the blocks together, starting from the initial state */
+    for (b=0; b<block_count; b++) {
+        const struct index_prefix *p = &prefixes[b];
+        const struct index_entry *e = &entries[b * WC2_STATE_MAX + p->state];
+        struct index_prefix *n = &prefixes[b + 1];
+
+        n->line_count = p->line_count + e->line_count;
+        n->word_count = p->word_count + e->word_count;
+        n->char_count = p->char_count + e->char_count;
+        n->state = e->exit_state;
+    }
+    results.line_count = prefixes[block_count].line_count;
+    results.word_count = prefixes[block_count].word_count;
+    results.char_count = prefixes[block_count].char_count;
+
+    /* Write a temporary file and rename it over the old index, so that
+     * readers never see a half-written one */
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, "WC2INDEX", 8);
+    hdr.version = INDEX_VERSION;
+    hdr.state_count = WC2_STATE_MAX;
+    hdr.block_size = INDEX_BLOCKSIZE;
+    hdr.table_hash = wc2_machine_hash(cfg->machine);
+    hdr.file_size = results.byte_count;
+    stat_mtime(st, &hdr.file_mtime, &hdr.file_mtime_nsec);
+    hdr.block_count = block_count;
+
+    idxname = index_filename(filename);
+    tmpname = malloc(strlen(idxname) + 5);
+    if (tmpname == NULL)
+        abort();
+    strcpy(tmpname, idxname);
+    strcat(tmpname, ".tmp");
+    out = fopen(tmpname, "wb");
+    if (out == NULL) {
+        perror(tmpname);
+    } else {
+        int is_ok = 1;
+        is_ok &= fwrite(&hdr, sizeof(hdr), 1, out) == 1;
+        is_ok &= fwrite(entries, sizeof(*entries) * WC2_STATE_MAX, block_count, out) == block_count;
+        is_ok &= fwrite(prefixes, sizeof(*prefixes), block_count + 1, out) == block_count + 1;
+        is_ok &= fclose(out) == 0;
+        if (!is_ok || rename(tmpname, idxname) != 0) {
+            perror(idxname);
+            remove(tmpname);
+        }
+    }
+
+    free(tmpname);
+    free(idxname);
+    free(summary);
+    free(buf);
+    free(prefixes);
+    free(entries);
+    return results;
+}
+
+/**
+ * Implements '--index': counts the file and writes its sidecar index.
+ * If the index is already up-to-date, the counts come straight from it.
+ */
+static struct wc2_results
+index_file(FILE *fp, const char *filename, const struct config *cfg)
+{
+    struct index_header hdr;
+    struct stat st;
+    FILE *idx;
+
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: can only index regular files\n", filename);
+        return parse_file(fp, cfg);
+    }
+
+    idx = index_open(filename, &st, &hdr, 1, cfg->machine);
+    if (idx) {
+        struct index_prefix last;
+        struct wc2_results results = {0, 0, 0, 0};
+        int err = index_read_prefix(idx, &hdr, hdr.block_count, &last);
+
+        fclose(idx);
+        if (err == 0) {
+            results.line_count = last.line_count;
+            results.word_count = last.word_count;
+            results.char_count = last.char_count;
+            results.byte_count = hdr.file_size;
+            return results;
+        }
+    }
+
+    return index_build(fp, filename, &st, NULL, 0, 0, ~(uint64_t)0, cfg);
+}
+
+/**
+ * Implements '--reindex=OFFSET:LENGTH': after the file has been edited in
+ * place in the given range, parse only the blocks that changed and update
+ * the index. If the edit changed the file size, everything after it has
+ * moved, so all blocks from that point on are parsed again.
+ */
+static struct wc2_results
+index_update(FILE *fp, const char *filename, const struct range *edit, const struct config *cfg)
+{
+    struct index_header hdr;
+    struct index_entry *entries;
+    struct stat st;
+    uint64_t first_block;
+    uint64_t last_block;
+    FILE *idx;
+
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode))
+        return index_file(fp, filename, cfg);
+
+    idx = index_open(filename, &st, &hdr, 0, cfg->machine);
+    if (idx == NULL)
+        return index_file(fp, filename, cfg);
+
+    entries = malloc((hdr.block_count + 1) * WC2_STATE_MAX * sizeof(*entries));
+    if (entries == NULL)
+        abort();
+    if (fread(entries, sizeof(*entries) * WC2_STATE_MAX, hdr.block_count, idx) != hdr.block_count) {
+        fclose(idx);
+        free(entries);
+        return index_file(fp, filename, cfg);
+    }
+    fclose(idx);
+
+    first_block = edit->start / INDEX_BLOCKSIZE;
+    if (hdr.file_size == (uint64_t)st.st_size)
+        last_block = edit->length ? (edit->start + edit->length - 1) / INDEX_BLOCKSIZE : first_block;
+    else
+        last_block = ~(uint64_t)0;
+
+    /* The last block of the old file was partial, so if the file grew it
+     * has to be parsed again */
+    if (first_block > hdr.block_count)
+        first_block = hdr.block_count;
+    if (hdr.file_size != (uint64_t)st.st_size && hdr.block_count && first_block >= hdr.block_count)
+        first_block = hdr.block_count - 1;
+
+    return index_build(fp, filename, &st, entries, hdr.block_count, first_block, last_block, cfg);
+}
+
+/**
+ * Get the state and counts at some offset into the file, using the index
+ * prefix for the start of the block, then parsing up to the offset.
+ */
+static struct wc2_results
+index_seek(FILE *fp, FILE *idx, const struct index_header *hdr, unsigned long long offset, unsigned *state,
+           unsigned char *buf, const struct config *cfg)
+{
+    struct index_prefix prefix;
+    struct wc2_results results = {0, 0, 0, 0};
+    struct wc2_results x;
+    uint64_t block = offset / INDEX_BLOCKSIZE;
+
+    if (block > hdr->block_count)
+        block = hdr->block_count;
+    if (index_read_prefix(idx, hdr, block, &prefix) != 0) {
+        /* Shouldn't happen, but if it does, do it the slow way */
+        *state = 0;
+        return parse_span(fp, 0, offset, state, buf, INDEX_BLOCKSIZE, cfg);
+    }
+
+    *state = prefix.state;
+    x = parse_span(fp, block * INDEX_BLOCKSIZE, offset, state, buf, INDEX_BLOCKSIZE, cfg);
+    results.line_count = prefix.line_count + x.line_count;
+    results.word_count = prefix.word_count + x.word_count;
+    results.char_count = prefix.char_count + x.char_count;
+    results.byte_count = offset;
+    return results;
+}
+
+/**
+ * Find the offset of the start of a line (numbered from 1), which is
+ * just past the preceding newline. With an index we can jump to the
+ * block containing it, otherwise we have to search from the start.
+ */
+static unsigned long long
+find_line(FILE *fp, FILE *idx, const struct index_header *hdr, unsigned long long line, unsigned long long file_size, unsigned char *buf)
+{
+    unsigned long long offset = 0;
+    unsigned long long remaining;
+
+    if (line <= 1)
+        return 0;
+    remaining = line - 1;
+
+    if (idx) {
+        struct index_prefix prefix;
+        uint64_t lo = 0;
+        uint64_t hi = hdr->block_count;
+
+        /* Binary search for the last block starting before the newline.
+         * Newlines don't depend on the state, so this is exact. */
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo + 1) / 2;
+            if (index_read_prefix(idx, hdr, mid, &prefix) != 0)
+                break;
+            if (prefix.line_count < remaining)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        if (index_read_prefix(idx, hdr, lo, &prefix) == 0) {
+            offset = lo * INDEX_BLOCKSIZE;
+            remaining -= prefix.line_count;
+        }
+    }
+
+    if (fseeko(fp, offset, SEEK_SET) != 0)
+        return file_size;
+    for (;;) {
+        size_t count = fread(buf, 1, INDEX_BLOCKSIZE, fp);
+        const unsigned char *p = buf;
+        const unsigned char *end = buf + count;
+
+        if (count <= 0)
+            return file_size;
+        while ((p = memchr(p, '\n', end - p)) != NULL) {
+            p++;
+            if (--remaining == 0)
+                return offset + (p - buf);
+        }
+        offset += count;
+    }
+}
+
+/**
+ * Implements '--range=OFFSET:LENGTH' and '--line-range=FIRST:COUNT',
+ * counting just part of the file. The counts for a range are the
+ * difference in running totals between its end and start, so a word
+ * is counted in whichever range it starts.
+ */
+static struct wc2_results
+range_file(FILE *fp, const char *filename, const struct range *range, int is_lines, const struct config *cfg)
+{
+    struct index_header hdr;
+    struct wc2_results results = {0, 0, 0, 0};
+    struct wc2_results before;
+    struct wc2_results after;
+    unsigned long long start = range->start;
+    unsigned long long end;
+    unsigned char *buf;
+    struct stat st;
+    unsigned state;
+    FILE *idx;
+
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: can only count ranges of regular files\n", filename ? filename : "stdin");
+        return results;
+    }
+
+    buf = malloc(INDEX_BLOCKSIZE);
+    if (buf == NULL)
+        abort();
+
+    /* A redirected <stdin> has no name, so it can't have an index */
+    idx = filename ? index_open(filename, &st, &hdr, 1, cfg->machine) : NULL;
+    if (idx == NULL && filename)
+        fprintf(stderr, "%s: no up-to-date index, scanning\n", filename);
+
+    if (is_lines) {
+        end = find_line(fp, idx, &hdr, range->start + range->length, st.st_size, buf);
+        start = find_line(fp, idx, &hdr, range->start, st.st_size, buf);
+    } else {
+        end = range->start + range->length;
+        if (end > (unsigned long long)st.st_size)
+            end = st.st_size;
+    }
+
+    if (idx) {
+        before = index_seek(fp, idx, &hdr, start, &state, buf, cfg);
+        if (end / INDEX_BLOCKSIZE == start / INDEX_BLOCKSIZE) {
+            /* Both ends are in the same block, so just parse it */
+            after = parse_span(fp, start, end, &state, buf, INDEX_BLOCKSIZE, cfg);
+            after.line_count += before.line_count;
+            after.word_count += before.word_count;
+            after.char_count += before.char_count;
+        } else
+            after = index_seek(fp, idx, &hdr, end, &state, buf, cfg);
+        fclose(idx);
+    } else {
+        state = 0;
+        before = parse_span(fp, 0, start, &state, buf, INDEX_BLOCKSIZE, cfg);
+        after = parse_span(fp, start, end, &state, buf, INDEX_BLOCKSIZE, cfg);
+        after.line_count += before.line_count;
+        after.word_count += before.word_count;
+        after.char_count += before.char_count;
+    }
+
+    if (end > start) {
+        results.line_count = after.line_count - before.line_count;
+        results.word_count = after.word_count - before.word_count;
+        results.char_count = after.char_count - before.char_count;
+        results.byte_count = end - start;
+    }
+
+    free(buf);
+    return results;
+}
+
+/**
+ * Calculate the width for the columns, so that when printing the
+ * results from several files, all the columns will line up. The
+ * width for all the columns is determined by the size of the files.
+ */
+static unsigned
+get_column_width(int argc, char *argv[], const struct config *cfg)
+{
+    int i;
+    off_t maxsize = 1;
+    unsigned width = 0;
+
+    for (i=1; i<argc; i++) {
+        const char *filename = argv[i];
+        struct stat st;
+
+        if (!is_filename_arg(cfg, argv, i))
+            continue;
+
+        if (stat(filename, &st) == 0) {
+            if (S_ISREG(st.st_mode)) {
+                if (maxsize <= st.st_size)
+                    maxsize = st.st_size;
+            } else if (maxsize <= 1000000)
+                maxsize = 1000000;
+        }
+    }
+
+    if (cfg->is_stdin) {
+        if (maxsize <= 1000000)
+            maxsize = 1000000;
+    }
+
+    while (maxsize) {
+        width++;
+        maxsize /= 10;
+    }
+
+    return width;
+}
+
+#ifndef _WIN32
+/**
+ * Per-file state for '-f' follow mode. We remember where we stopped
+ * reading and the state-machine state at that point, so that when the
+ * file grows we only parse the newly appended bytes.
+ */
+struct followed {
+    const char *filename;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    off_t offset;
+    unsigned state;
+    struct wc2_results results;
+    int is_changed;
+};
+
+/**
+ * Return the current time in milliseconds, from a clock that doesn't
+ * jump around when the system time is changed.
+ */
+static unsigned long long
+now_msecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000ULL;
+}
+
+/**
+ * Start counting a file again from the beginning, either because we
+ * are opening it for the first time, it was truncated, or it was
+ * replaced by a new file (log rotation).
+ */
+static void
+follow_restart(struct followed *f)
+{
+    memset(&f->results, 0, sizeof(f->results));
+    f->state = 0;
+    f->offset = 0;
+    f->is_changed = 1;
+}
+
+/**
+ * (Re)open the file by name, remembering its identity so that we can
+ * later detect when it's been rotated out from under us.
+ */
+static int
+follow_open(struct followed *f)
+{
+    struct stat st;
+
+    f->fd = open(f->filename, O_RDONLY);
+    if (f->fd < 0)
+        return -1;
+    if (fstat(f->fd, &st) != 0) {
+        close(f->fd);
+        f->fd = -1;
+        return -1;
+    }
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    follow_restart(f);
+    return 0;
+}
+
+/**
+ * Parse everything that has been appended to the file since the last
+ * time we looked, resuming from the saved state.
+ */
+static void
+follow_drain(struct followed *f, unsigned char *buf, size_t sizeof_buf, const struct config *cfg)
+{
+    for (;;) {
+        ssize_t count;
+        struct wc2_results x;
+
+        count = pread(f->fd, buf, sizeof_buf, f->offset);
+        if (count <= 0)
+            break;
+        f->offset += count;
+
+        x = parse_chunk_cfg(buf, count, &f->state, cfg);
+        f->results.line_count += x.line_count;
+        f->results.word_count += x.word_count;
+        f->results.byte_count += x.byte_count;
+        f->results.char_count += x.char_count;
+        f->is_changed = 1;
+    }
+}
+
+/**
+ * Check a followed file for truncation or rotation, then parse
+ * any new data.
+ */
+static void
+follow_check(struct followed *f, unsigned char *buf, size_t sizeof_buf, const struct config *cfg)
 {
-    int needs_space = 0; /* space needed between output */
-    unsigned width = cfg->column_width;
-
-    /* -l */
-    if (cfg->is_counting_lines)
-        printf("%s%*lu", needs_space++?" ":"", width, results->line_count);
-
-    /* -w */
-    if (cfg->is_counting_words)
-        printf("%s%*lu", needs_space++?" ":"", width, results->word_count);
-
-    /* -c */
-    if (cfg->is_counting_bytes)
-        printf("%s%*lu", needs_space++?" ":"", width, results->byte_count);
+    struct stat st;
+
+    /* If the name now points to a different file, then the old one
+     * was rotated away. Finish whatever was last written to the old
+     * file, then start over counting the new one. */
+    if (stat(f->filename, &st) == 0 && (f->fd < 0 || st.st_dev != f->dev || st.st_ino != f->ino)) {
+        if (f->fd >= 0) {
+            follow_drain(f, buf, sizeof_buf, cfg);
+            close(f->fd);
+        }
+        if (follow_open(f) != 0)
+            return;
+    }
+    if (f->fd < 0)
+        return;
 
-    /* -m */
-    if (cfg->is_counting_chars)
-        printf("%s%*lu", needs_space++?" ":"", width, results->char_count);
+    /* If the file got smaller, it was truncated in place, so we
+     * have to recount from the start */
+    if (fstat(f->fd, &st) == 0 && st.st_size < f->offset)
+        follow_restart(f);
 
-    /* NULL if <stdin>, "total" for the last line showing totals, otherwise,
-     * the name of the file that was processed */
-    if (filename)
-        printf("%s%s", needs_space++?" ":"", filename);
-    printf("\n");
+    follow_drain(f, buf, sizeof_buf, cfg);
 }
 
-
 /**
- * A pointer-arithmetic version for tracking state. This alternative
- * will be called when '-P' is specified on the command-line.
+ * Implements '-f': count the files once, then keep watching them for
+ * new data like 'tail -f', printing updated counts no more often than
+ * once per interval. We use 'inotify' to wake up when files change,
+ * falling back to polling where that isn't available. This never returns.
  */
-static struct results
-parse_chunk_pp(const unsigned char *buf, size_t length, unsigned *inout_state)
+static void
+follow_files(int argc, char *argv[], const struct config *cfg)
 {
-    void **state = (void**)((char*)table_p + *inout_state);
-    const unsigned char *end = buf + length;
-    unsigned long counts[STATE_MAX];
+    enum {BUFSIZE=65536};
+    struct followed *files;
+    size_t file_count = 0;
+    unsigned char *buf;
+    unsigned long long last_print = 0;
+    int is_pending = 0;
+    int ifd = -1;
+    int i;
+
+    buf = malloc(BUFSIZE);
+    files = calloc(argc, sizeof(*files));
+    if (buf == NULL || files == NULL)
+        abort();
 
+#ifdef __linux__
+    ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
 
-    state = (void**)((char*)table_p + (*inout_state) * 256 * sizeof(void*));
+    for (i=1; i<argc; i++) {
+        struct followed *f = &files[file_count];
 
-    /* We only care about the first four states, so these will be initialized to zero.
-     * Since we don't use the other ~100 counts for the other states, we won't initialize them */
-    counts[NEWLINE] = 0;
-    counts[NEWWORD] = 0;
-    counts[WASSPACE] = 0;
-    counts[WASWORD] = 0;
+        if (!is_filename_arg(cfg, argv, i))
+            continue;
 
-    /* This is the inner-loop where 99.9% of the execution time of this program will
-     * be spent. */
-    while (buf < end) {
-        unsigned char c = *buf++;
-        state = state[c];
-        counts[PSTATE(state)]++;
+        f->filename = argv[i];
+        if (follow_open(f) != 0) {
+            perror(argv[i]);
+            continue;
+        }
+#ifdef __linux__
+        if (ifd >= 0)
+            inotify_add_watch(ifd, f->filename, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+#endif
+        file_count++;
     }
+    if (file_count == 0)
+        exit(1);
 
-    /* Save the ending state for the next chunk */
-    *inout_state = PSTATE(state);
+    for (;;) {
+        size_t j;
 
-    /* Return the results */
-    {
-        struct results results;
-        results.line_count = counts[NEWLINE];
-        results.word_count = counts[NEWWORD];
-        results.char_count = counts[NEWLINE] + counts[WASSPACE] + counts[WASWORD] + counts[NEWWORD];
-        results.byte_count = length;
+        for (j=0; j<file_count; j++) {
+            struct followed *f = &files[j];
+            ino_t ino = f->ino;
+
+            follow_check(f, buf, BUFSIZE, cfg);
+#ifdef __linux__
+            /* A rotated file needs a new watch */
+            if (ifd >= 0 && f->ino != ino)
+                inotify_add_watch(ifd, f->filename, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+#else
+            (void)ino;
+#endif
+            if (f->is_changed)
+                is_pending = 1;
+        }
 
-        return results;
+        /* Print the files that changed, but not more often than
+         * the configured interval */
+        if (is_pending && (last_print == 0 || now_msecs() - last_print >= cfg->follow_interval)) {
+            struct wc2_results totals = {0,0,0,0};
+            struct file_info file = {RECORD_FILE, -1, 0, 0};
+            struct file_info total = {RECORD_TOTAL, -1, 0, 0};
+
+            for (j=0; j<file_count; j++) {
+                struct followed *f = &files[j];
+                if (f->is_changed)
+                    print_results(f->filename, &f->results, &file, (struct config *)cfg);
+                f->is_changed = 0;
+                totals.line_count += f->results.line_count;
+                totals.word_count += f->results.word_count;
+                totals.byte_count += f->results.byte_count;
+                totals.char_count += f->results.char_count;
+            }
+            if (file_count > 1)
+                print_results("total", &totals, &total, (struct config *)cfg);
+            out_flush();
+            last_print = now_msecs();
+            is_pending = 0;
+        }
+
+        /* Sleep until something changes or the interval expires. We
+         * still wake up on the interval with 'inotify', because a
+         * rotated file is replaced by a new one we aren't watching. */
+        if (ifd >= 0) {
+            struct pollfd pfd;
+            char events[4096];
+
+            pfd.fd = ifd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, cfg->follow_interval) > 0) {
+                while (read(ifd, events, sizeof(events)) > 0)
+                    ;
+            }
+        } else
+            poll(NULL, 0, cfg->follow_interval);
     }
 }
+#endif
 
+#ifndef _WIN32
 /**
- * Same as 'parse-chunk', but with pointer instead of index
+ * How much synthetic text '--autotune' parses for each generator, and
+ * how many times, keeping the fastest.
  */
-static struct results
-parse_chunk_p(const unsigned char *buf, size_t length, unsigned *inout_state)
-{
-    size_t state = *inout_state;
-    const unsigned char *end;
-    unsigned counts[STATE_MAX];
-    unsigned char c;
+#define AUTOTUNE_SIZE (4 * 1024 * 1024)
+#define AUTOTUNE_REPEAT 3
 
-    /* We only care about the first four states, so these will be initialized to zero.
-     * Since we don't use the other ~100 counts for the other states, we won't initialize them */
-    counts[NEWLINE] = 0;
-    counts[NEWWORD] = 0;
-    counts[WASSPACE] = 0;
-    counts[WASWORD] = 0;
+/**
+ * The generators from 'wctool' that '--autotune' times the engines on
+ */
+static const char *autotune_profiles[] = {"ascii", "utf8", "allspace", NULL};
 
-    /* This is the inner-loop where 99.9% of the execution time of this program will
-     * be spent. */
-    end = buf + length;
-    while (buf < end) {
-        c = *buf++;
-        state = table[state][c];
-        counts[state]++;
-    }
+static const size_t autotune_bufsizes[] = {4096, 16384, 65536, 262144, 1048576, 0};
 
-    /* Save the ending state for the next chunk */
-    *inout_state = state;
+static double
+now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
 
-    /* Return the results */
+/**
+ * Get a description of the CPU, so that a tuned configuration can be
+ * ignored if it was made on a different CPU.
+ */
+static void
+cpu_model(char *buf, size_t sizeof_buf)
+{
+#if defined(__APPLE__)
+    size_t length = sizeof_buf;
+    if (sysctlbyname("machdep.cpu.brand_string", buf, &length, NULL, 0) == 0 && length)
+        return;
+#elif defined(__linux__)
+    FILE *fp = fopen("/proc/cpuinfo", "r");
+    if (fp) {
+        static const char *keys[] = {"model name", "Processor", "CPU part", "cpu model", "cpu", NULL};
+        char line[256];
+        char found[256] = "";
+        int found_rank = -1;
+
+        /* Prefer the more descriptive fields, when there are several */
+        while (fgets(line, sizeof(line), fp)) {
+            char *colon = strchr(line, ':');
+            size_t k;
+            if (colon == NULL)
+                continue;
+            for (k=0; keys[k] && (found_rank < 0 || (int)k < found_rank); k++) {
+                if (strncmp(line, keys[k], strlen(keys[k])) == 0 && isspace(line[strlen(keys[k])] & 0xFF)) {
+                    char *value = colon + 1;
+                    while (*value == ' ' || *value == '\t')
+                        value++;
+                    value[strcspn(value, "\r\n")] = '\0';
+                    snprintf(found, sizeof(found), "%s", value);
+                    found_rank = (int)k;
+                    break;
+                }
+            }
+        }
+        fclose(fp);
+        if (found[0]) {
+            snprintf(buf, sizeof_buf, "%s", found);
+            return;
+        }
+    }
+#endif
     {
-        struct results results;
-        results.line_count = counts[NEWLINE];
-        results.word_count = counts[NEWWORD];
-        results.char_count = counts[NEWLINE] + counts[WASSPACE] + counts[WASWORD] + counts[NEWWORD];
-        results.byte_count = length;
-
-        return results;
+        struct utsname u;
+        if (uname(&u) == 0) {
+            snprintf(buf, sizeof_buf, "%s", u.machine);
+            return;
+        }
     }
+    snprintf(buf, sizeof_buf, "unknown");
 }
 
-
 /**
- * Parse a single 64k chunk. Since a word can cross a chunk
- * boundary, we have to remember the 'state' from a previous
- * chunk.
+ * The name of the per-host configuration file. Home directories are
+ * often shared between machines, so the name includes the hostname.
+ * The environment variable WC2_AUTOTUNE can name a different file.
+ * If 'is_creating', also creates the directory it goes in.
  */
-static struct results
-parse_chunk(const unsigned char *buf, size_t length, unsigned *inout_state)
+static int
+autotune_filename(char *buf, size_t sizeof_buf, int is_creating)
 {
-    size_t state = *inout_state;
-    size_t i;
-    unsigned counts[STATE_MAX];
-    unsigned char c;
-
-    /* We only care about the first four states, so these will be initialized to zero.
-     * Since we don't use the other ~100 counts for the other states, we won't initialize them */
-    counts[NEWLINE] = 0;
-    counts[NEWWORD] = 0;
-    counts[WASSPACE] = 0;
-    counts[WASWORD] = 0;
-
-    /* This is the inner-loop where 99.9% of the execution time of this program will
-     * be spent. */
-    for (i=0; i<length; i++) {
-        c = buf[i];
-        state = table[state][c];
-        counts[state]++;
+    const char *env = getenv("WC2_AUTOTUNE");
+    const char *xdg = getenv("XDG_CONFIG_HOME");
+    const char *home = getenv("HOME");
+    char dirname[1024];
+    char hostname[256];
+
+    if (env && env[0]) {
+        snprintf(buf, sizeof_buf, "%s", env);
+        return 0;
     }
 
-    /* Save the ending state for the next chunk */
-    *inout_state = state;
+    if (xdg && xdg[0])
+        snprintf(dirname, sizeof(dirname), "%s", xdg);
+    else if (home && home[0])
+        snprintf(dirname, sizeof(dirname), "%s/.config", home);
+    else
+        return -1;
+    if (is_creating)
+        mkdir(dirname, 0755);
+    strncat(dirname, "/wc2", sizeof(dirname) - strlen(dirname) - 1);
+    if (is_creating)
+        mkdir(dirname, 0755);
+
+    if (gethostname(hostname, sizeof(hostname)) != 0)
+        snprintf(hostname, sizeof(hostname), "localhost");
+    hostname[sizeof(hostname) - 1] = '\0';
+    snprintf(buf, sizeof_buf, "%s/autotune-%s", dirname, hostname);
+    return 0;
+}
 
-    /* Return the results */
-    {
-        struct results results;
-        results.line_count = counts[NEWLINE];
-        results.word_count = counts[NEWWORD];
-        results.char_count = counts[NEWLINE] + counts[WASSPACE] + counts[WASWORD] + counts[NEWWORD];
-        results.byte_count = length;
+/**
+ * At startup, choose the engine and buffer sizes from the file written
+ * by '--autotune', unless they were chosen on the command-line, or the
+ * file was written on a different CPU.
+ */
+static void
+autotune_load(struct config *cfg)
+{
+    char filename[1200];
+    char model[256];
+    char line[512];
+    char engine_name[64] = "";
+    size_t bufsize = 0;
+    size_t mapsize = 0;
+    int is_same_cpu = 0;
+    FILE *fp;
+
+    if (autotune_filename(filename, sizeof(filename), 0) != 0)
+        return;
+    fp = fopen(filename, "r");
+    if (fp == NULL)
+        return;
+    cpu_model(model, sizeof(model));
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *value = strchr(line, '=');
+        if (line[0] == '#' || value == NULL)
+            continue;
+        *value++ = '\0';
+        value[strcspn(value, "\r\n")] = '\0';
+
+        if (strcmp(line, "cpu") == 0)
+            is_same_cpu = (strcmp(value, model) == 0);
+        else if (strcmp(line, cfg->is_counting_chars ? "engine-m" : "engine") == 0)
+            snprintf(engine_name, sizeof(engine_name), "%s", value);
+        else if (strcmp(line, "bufsize") == 0)
+            bufsize = strtoul(value, NULL, 10);
+        else if (strcmp(line, "mapsize") == 0)
+            mapsize = strtoul(value, NULL, 10);
+    }
+    fclose(fp);
+
+    if (!is_same_cpu)
+        return;
+    if (engine_name[0]) {
+        const struct wc2_engine *engine = wc2_engine_find(engine_name);
+        if (engine && wc2_engine_is_usable(engine, cfg->machine))
+            cfg->engine = engine;
+    }
+    if (bufsize >= 4096 && bufsize <= 16 * 1024 * 1024)
+        cfg->bufsize = bufsize;
+    if (mapsize >= 4096 && mapsize <= 16 * 1024 * 1024)
+        cfg->mapsize = mapsize;
+}
 
-        return results;
+/**
+ * Time parsing the buffer in 64k chunks with the engine, keeping the
+ * fastest of a few runs. Returns the time, and the counts so that they
+ * can be checked.
+ */
+static double
+autotune_time_engine(const struct wc2_engine *engine, const struct wc2_machine *machine,
+                     const unsigned char *buf, size_t length, struct wc2_results *results)
+{
+    double best = 0.0;
+    int r;
+
+    for (r=0; r<AUTOTUNE_REPEAT; r++) {
+        struct wc2_results total = {0, 0, 0, 0};
+        unsigned state = 0;
+        double start = now_seconds();
+        double elapsed;
+        size_t i;
+
+        for (i=0; i<length; i += 65536) {
+            size_t count = (length - i < 65536) ? length - i : 65536;
+            struct wc2_results x = engine->parse(machine, buf + i, count, &state);
+            total.line_count += x.line_count;
+            total.word_count += x.word_count;
+            total.char_count += x.char_count;
+            total.byte_count += x.byte_count;
+        }
+        elapsed = now_seconds() - start;
+        if (r == 0 || elapsed < best)
+            best = elapsed;
+        *results = total;
     }
+    return best;
 }
 
 /**
- * Parse an individual file, or <stdin>, and print the results
+ * Time counting the file in chunks of the given size, keeping the
+ * fastest of a few runs, either reading it as a pipe would be, or
+ * mapping it as 'parse_file()' does with regular files. This is after
+ * the file has been read once, so it's in the page cache, and it's
+ * mostly the cost of the reads, or of the page faults, we're timing.
+ * Returns a negative time if the file can't be mapped.
  */
-static struct results
-parse_file(FILE *fp, const struct config *cfg)
+static double
+autotune_time_bufsize(FILE *fp, size_t bufsize, int is_mapped,
+                      const struct wc2_engine *engine, const struct wc2_machine *machine)
 {
-    enum {BUFSIZE=65536};
-    struct results results = {0, 0, 0, 0};
-    unsigned state = 0; /* state held between chunks */
-    unsigned char *buf;
+    unsigned char *buf = malloc(bufsize);
+    double best = 0.0;
+    int r;
 
-    buf = malloc(BUFSIZE);
     if (buf == NULL)
         abort();
-
-    /* Process a 64k chunk at a time */
-    for (;;) {
+    for (r=0; r<AUTOTUNE_REPEAT; r++) {
+        unsigned state = 0;
+        double start;
+        double elapsed;
         size_t count;
-        struct results x;
-
-        /* Read the next chunk of data from the file */
-        count = fread(buf, 1, BUFSIZE, fp);
-        if (count <= 0)
-            break;
-
-        /* Do the word-count algorithm */
-        if (cfg->is_pointer_arithmetic > 1)
-            x = parse_chunk_pp(buf, count, &state);
-        else if (cfg->is_pointer_arithmetic)
-            x = parse_chunk_p(buf, count, &state);
-        else
-            x = parse_chunk(buf, count, &state);
 
-        /* Sum the results */
-        results.line_count += x.line_count;
-        results.word_count += x.word_count;
-        results.byte_count += x.byte_count;
-        results.char_count += x.char_count;
+        rewind(fp);
+        start = now_seconds();
+        if (is_mapped) {
+            void *map_base;
+            size_t map_base_length;
+            size_t map_length;
+            size_t i;
+            const unsigned char *map = map_input(fp, &map_length, &map_base, &map_base_length);
+
+            if (map == NULL) {
+                best = -1.0;
+                break;
+            }
+            for (i=0; i<map_length; i += count) {
+                count = map_length - i < bufsize ? map_length - i : bufsize;
+                engine->parse(machine, map + i, count, &state);
+            }
+            unmap_input(map_base, map_base_length);
+        } else {
+            while ((count = fread(buf, 1, bufsize, fp)) > 0)
+                engine->parse(machine, buf, count, &state);
+        }
+        elapsed = now_seconds() - start;
+        if (r == 0 || elapsed < best)
+            best = elapsed;
     }
-
     free(buf);
-    return results;
+    return best;
 }
 
 /**
- * Calculate the width for the columns, so that when printing the
- * results from several files, all the columns will line up. The
- * width for all the columns is determined by the size of the files.
+ * Implements '--autotune', timing every engine that can be used, with
+ * and without '-m', on synthetic text, then the buffer sizes. The
+ * fastest are written to the per-host configuration file.
  */
-static unsigned
-get_column_width(int argc, char *argv[], int is_stdin)
+static int
+autotune(void)
 {
-    int i;
-    off_t maxsize = 1;
-    unsigned width = 0;
+    const struct wc2_engine *best_engine[2] = {NULL, NULL};
+    size_t best_bufsize[2] = {65536, 65536}; /* read, then mapped */
+    unsigned char *text;
+    size_t text_length = 0;
+    char filename[1200];
+    char model[256];
+    size_t i;
+    int m;
+    FILE *fp;
 
-    for (i=1; i<argc; i++) {
-        const char *filename = argv[i];
-        struct stat st;
+    /* Generate the text, one section per generator */
+    text = malloc(AUTOTUNE_SIZE * 3 + WCGEN_SLACK);
+    if (text == NULL)
+        abort();
+    for (i=0; autotune_profiles[i]; i++) {
+        const struct wcgen_profile *profile = wcgen_find(autotune_profiles[i]);
+        struct wcgen_state state;
+        wcgen_init(&state, 0, NULL);
+        text_length += profile->generate(text + text_length, AUTOTUNE_SIZE, &state);
+    }
 
-        if (filename[0] == '-')
-            continue;
+    cpu_model(model, sizeof(model));
+    printf("cpu = %s\n", model);
+
+    for (m=0; m<2; m++) {
+        struct wc2_machine *machine;
+        struct wc2_results expected;
+        double best_time = 0.0;
+        const struct wc2_engine *engine;
+
+        machine = wc2_machine_create(m, "");
+        if (machine == NULL)
+            machine = wc2_machine_create(m, "C");
+        if (machine == NULL) {
+            perror("locale");
+            return 1;
+        }
 
-        if (stat(filename, &st) == 0) {
-            if (S_ISREG(st.st_mode)) {
-                if (maxsize <= st.st_size)
-                    maxsize = st.st_size;
-            } else if (maxsize <= 1000000)
-                maxsize = 1000000;
+        /* The counts every engine must agree with */
+        autotune_time_engine(wc2_engine_find("index"), machine, text, text_length, &expected);
+
+        for (i=0; (engine = wc2_engine_at(i)) != NULL; i++) {
+            struct wc2_results results;
+            double elapsed;
+            int is_correct;
+
+            if (!wc2_engine_is_usable(engine, machine))
+                continue;
+            elapsed = autotune_time_engine(engine, machine, text, text_length, &results);
+            is_correct = (memcmp(&results, &expected, sizeof(results)) == 0);
+            printf("%s %-16s %8.1f MB/s%s\n", m ? "-m" : "  ", engine->name,
+                   text_length / elapsed / 1000000.0, is_correct ? "" : " (wrong counts)");
+            if (is_correct && (best_engine[m] == NULL || elapsed < best_time)) {
+                best_engine[m] = engine;
+                best_time = elapsed;
+            }
         }
+        wc2_machine_free(machine);
     }
 
-    if (is_stdin) {
-        if (maxsize <= 1000000)
-            maxsize = 1000000;
+    /* Then the buffer sizes, reading the same text back from a file,
+     * both for pipes, and for regular files, which are mapped */
+    fp = tmpfile();
+    if (fp == NULL || fwrite(text, 1, text_length, fp) != text_length || fflush(fp) != 0) {
+        perror("tmpfile");
+        return 1;
+    } else {
+        struct wc2_machine *machine = wc2_machine_create(0, "");
+        const struct wc2_engine *engine = best_engine[0] ? best_engine[0] : wc2_engine_find("index");
+        static const char *names[2] = {"bufsize", "mapsize"};
+
+        if (machine == NULL)
+            machine = wc2_machine_create(0, "C");
+        for (m=0; m<2; m++) {
+            double best_time = 0.0;
+
+            for (i=0; machine && autotune_bufsizes[i]; i++) {
+                double elapsed = autotune_time_bufsize(fp, autotune_bufsizes[i], m, engine, machine);
+                if (elapsed < 0)
+                    break;
+                printf("   %s=%-8lu %8.1f MB/s\n", names[m], (unsigned long)autotune_bufsizes[i],
+                       text_length / elapsed / 1000000.0);
+                if (i == 0 || elapsed < best_time) {
+                    best_bufsize[m] = autotune_bufsizes[i];
+                    best_time = elapsed;
+                }
+            }
+        }
+        wc2_machine_free(machine);
+        fclose(fp);
     }
+    free(text);
 
-    while (maxsize) {
-        width++;
-        maxsize /= 10;
-    }
+    /* Write the configuration, replacing any older one all at once */
+    if (autotune_filename(filename, sizeof(filename), 1) != 0) {
+        fprintf(stderr, "wc2: --autotune: no HOME to save the configuration in\n");
+        return 1;
+    } else {
+        char tmpname[1300];
 
-    return width;
+        snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+        fp = fopen(tmpname, "w");
+        if (fp == NULL) {
+            perror(tmpname);
+            return 1;
+        }
+        fprintf(fp, "# written by 'wc2 --autotune', ignored if the cpu changes\n");
+        fprintf(fp, "cpu=%s\n", model);
+        fprintf(fp, "engine=%s\n", best_engine[0] ? best_engine[0]->name : "index");
+        fprintf(fp, "engine-m=%s\n", best_engine[1] ? best_engine[1]->name : "index");
+        fprintf(fp, "bufsize=%lu\n", (unsigned long)best_bufsize[0]);
+        fprintf(fp, "mapsize=%lu\n", (unsigned long)best_bufsize[1]);
+        if (fclose(fp) != 0 || rename(tmpname, filename) != 0) {
+            perror(filename);
+            remove(tmpname);
+            return 1;
+        }
+        printf("wrote %s\n", filename);
+    }
+    return 0;
 }
+#endif
+
 
 /**
  * Print a help message
@@ -649,16 +2986,88 @@ static void
 print_help(void)
 {
     printf("wc -- word, line, and byte or character count\n");
-    printf("use:\n wc [-c|-m][-lw][file...]\n");
+    printf("use:\n wc [-c|-m][-lwf][file...]\n");
     printf("where:\n");
     printf(" -c\tPrint the number of bytes in each input file.\n");
     printf(" -l\tPrint the number of newlines in each input file.\n");
     printf(" -m\tPrint number of multibyte characters in each input file.\n");
     printf(" -w\tPrint the number of words in each input file.\n");
+    printf(" -f\tFollow the files as they grow, printing updated counts.\n");
+    printf(" -j N\tCount with N threads, even when reading a pipe.\n");
+    printf(" --blocks=K\n\tWith -j, the most 1 MiB blocks in memory at once (default 2N).\n");
+    printf(" --engine=NAME\n\tWhich inner-loop to count with, or 'list' to list them.\n");
+    printf(" --autotune\tTime the engines, and use the fastest from then on.\n");
+    printf(" --verify=NAME\n\tAlso count with this engine, stopping where they first differ.\n");
+    printf(" --state-profile\n\tPrint how often each state and transition of the state-machine was\n");
+    printf("\tvisited, instead of the counts. Use with -m to see the multibyte states.\n");
+    printf(" --stats\tPrint where the time went to stderr, for each file and in total.\n");
+    printf(" --format=FORMAT\n\tPrint a record per file as json, csv, tsv, or binary.\n");
+    printf(" --interval=SECONDS\n\tHow often -f prints updates, at least 0.001 (default 1).\n");
+    printf(" --newline-offsets=FILE\n\tWrite the offset of every newline to FILE as 64-bit integers.\n");
+    printf(" --word-offsets=FILE\n\tWrite the offset of every word to FILE as 64-bit integers.\n");
+    printf(" --split-points=K\n\tPrint the offsets dividing each input into K shards of equal lines.\n");
+    printf(" --summary\tPrint a summary of each input that can be combined with --merge.\n");
+    printf(" --merge\tCombine the summaries in the files, in order, into one count.\n");
+    printf(" --index\tAlso write a sidecar index FILE.wc2i, or use it if current.\n");
+    printf(" --reindex=OFFSET:LENGTH\n\tUpdate the index after the file was edited in that range.\n");
+    printf(" --range=OFFSET:LENGTH\n\tCount only that range of bytes, using the index if current.\n");
+    printf(" --line-range=FIRST:COUNT\n\tCount only that range of lines, numbered from 1.\n");
     printf("If no files specified, reads from stdin.\n");
     printf("If no options specified, -lwc will be used.\n");
 }
 
+/**
+ * Print the engines that can be chosen with '--engine'
+ */
+static void
+print_engines(void)
+{
+    const struct wc2_engine *engine;
+    size_t i;
+
+    for (i=0; (engine = wc2_engine_at(i)) != NULL; i++) {
+        printf("%-16s %s%s %s\n", engine->name,
+               (engine->flags & WC2_ENGINE_BYTES) ? "c" : "-",
+               (engine->flags & WC2_ENGINE_CHARS) ? "m" : "-",
+               engine->description);
+    }
+}
+
+/**
+ * Parse a range parameter of the form START:LENGTH
+ */
+static int
+parse_range(const char *str, struct range *range)
+{
+    char *p;
+
+    if (!isdigit(*str))
+        return -1;
+    range->start = strtoull(str, &p, 10);
+    if (*p != ':' || !isdigit(p[1]))
+        return -1;
+    range->length = strtoull(p + 1, &p, 10);
+    if (*p != '\0')
+        return -1;
+    return 0;
+}
+
+/**
+ * The value of a single-letter option, either the rest of the same
+ * argument ('-j8') or the next one ('-j 8'), which is then marked so
+ * that it isn't taken for a filename. Returns NULL if there's none.
+ */
+static const char *
+option_value(int argc, char *argv[], int *i, size_t j, struct config *cfg)
+{
+    if (argv[*i][j+1] != '\0')
+        return argv[*i] + j + 1;
+    if (*i + 1 >= argc)
+        return NULL;
+    cfg->is_value[++*i] = 1;
+    return argv[*i];
+}
+
 /**
  * Parse the command-line options in order to get the configuration
  * for the program.
@@ -670,6 +3079,9 @@ read_command_line(int argc, char *argv[])
     int i;
 
     memset(&cfg, 0, sizeof(cfg));
+    cfg.is_value = calloc(argc, sizeof(cfg.is_value[0]));
+    if (cfg.is_value == NULL)
+        abort();
 
     /* We set this as the errno so that 'perror()' will print a localized
      * error message, whatever "Invalid argument" is in the user's local
@@ -700,6 +3112,114 @@ read_command_line(int argc, char *argv[])
             } else if (strcmp(argv[i], "--help") == 0) {
                 print_help();
                 exit(0);
+            } else if (strncmp(argv[i], "--interval=", 11) == 0) {
+                double seconds = atof(argv[i] + 11);
+                if (seconds <= 0.0 || seconds * 1000.0 > INT_MAX) {
+                    perror(argv[i]);
+                    exit(1);
+                }
+                /* Less than a millisecond would round down to zero,
+                 * which means the default, so it's the shortest there is */
+                cfg.follow_interval = (unsigned)(seconds * 1000.0);
+                if (cfg.follow_interval == 0)
+                    cfg.follow_interval = 1;
+                continue;
+            } else if (strncmp(argv[i], "--newline-offsets=", 18) == 0) {
+                cfg.newline_offsets_name = argv[i] + 18;
+                continue;
+            } else if (strncmp(argv[i], "--word-offsets=", 15) == 0) {
+                cfg.word_offsets_name = argv[i] + 15;
+                continue;
+            } else if (strncmp(argv[i], "--split-points=", 15) == 0) {
+                cfg.split_count = strtoull(argv[i] + 15, NULL, 10);
+                if (cfg.split_count == 0) {
+                    perror(argv[i]);
+                    exit(1);
+                }
+                /* The offsets are printed instead of the counts */
+                cfg.is_quiet = 1;
+                continue;
+            } else if (strncmp(argv[i], "--engine=", 9) == 0) {
+                if (strcmp(argv[i] + 9, "list") == 0) {
+                    print_engines();
+                    exit(0);
+                }
+                cfg.engine = wc2_engine_find(argv[i] + 9);
+                if (cfg.engine == NULL) {
+                    perror(argv[i]);
+                    exit(1);
+                }
+                continue;
+            } else if (strncmp(argv[i], "--format=", 9) == 0) {
+                static const char *formats[] = {"human", "json", "csv", "tsv", "binary", NULL};
+                for (j=0; formats[j]; j++) {
+                    if (strcmp(argv[i] + 9, formats[j]) == 0)
+                        break;
+                }
+                if (formats[j] == NULL) {
+                    perror(argv[i]);
+                    exit(1);
+                }
+                cfg.format = (int)j;
+                continue;
+            } else if (strncmp(argv[i], "--blocks=", 9) == 0) {
+                cfg.block_count = strtoul(argv[i] + 9, NULL, 10);
+                if (cfg.block_count < 2) {
+                    perror(argv[i]);
+                    exit(1);
+                }
+                continue;
+            } else if (strcmp(argv[i], "--state-profile") == 0) {
+                /* The profile is printed instead of the counts */
+                cfg.is_profiling = 1;
+                cfg.is_quiet = 1;
+                continue;
+            } else if (strcmp(argv[i], "--stats") == 0) {
+                cfg.is_stats = 1;
+                continue;
+            } else if (strcmp(argv[i], "--autotune") == 0) {
+                cfg.is_autotuning = 1;
+                continue;
+            } else if (strncmp(argv[i], "--verify=", 9) == 0) {
+                cfg.verify_engine = wc2_engine_find(argv[i] + 9);
+                if (cfg.verify_engine == NULL) {
+                    perror(argv[i]);
+                    exit(1);
+                }
+                continue;
+            } else if (strcmp(argv[i], "--summary") == 0) {
+                /* The summaries are printed instead of the counts */
+                cfg.is_summarizing = 1;
+                cfg.is_quiet = 1;
+                continue;
+            } else if (strcmp(argv[i], "--merge") == 0) {
+                cfg.is_merging = 1;
+                continue;
+            } else if (strcmp(argv[i], "--index") == 0) {
+                cfg.is_indexing = 1;
+                continue;
+            } else if (strncmp(argv[i], "--reindex=", 10) == 0) {
+                if (parse_range(argv[i] + 10, &cfg.reindex) != 0) {
+                    perror(argv[i]);
+                    exit(1);
+                }
+                cfg.is_reindexing = 1;
+                continue;
+            } else if (strncmp(argv[i], "--range=", 8) == 0) {
+                if (parse_range(argv[i] + 8, &cfg.range) != 0) {
+                    perror(argv[i]);
+                    exit(1);
+                }
+                cfg.is_range = 1;
+                continue;
+            } else if (strncmp(argv[i], "--line-range=", 13) == 0) {
+                if (parse_range(argv[i] + 13, &cfg.range) != 0 || cfg.range.start == 0) {
+                    perror(argv[i]);
+                    exit(1);
+                }
+                cfg.is_range = 1;
+                cfg.is_line_range = 1;
+                continue;
             } else {
                 perror(argv[i]);
                 exit(1);
@@ -728,12 +3248,7 @@ read_command_line(int argc, char *argv[])
                     cfg.is_counting_chars++;
                     break;
                 case 'W':
-                    if (argv[i][j+1] == '\0') {
-                        if (i+1 < argc)
-                            parm = argv[++i];
-                    } else {
-                        parm = argv[i] + j + 1;
-                    }
+                    parm = option_value(argc, argv, &i, j, &cfg);
                     if (parm == NULL || !isdigit(*parm)) {
                         perror("-W");
                         exit(1);
@@ -741,9 +3256,21 @@ read_command_line(int argc, char *argv[])
                         cfg.column_width = atoi(parm);
                     j = maxj;
                     break;
+                case 'j':
+                    parm = option_value(argc, argv, &i, j, &cfg);
+                    if (parm == NULL || !isdigit(*parm) || atoi(parm) < 1) {
+                        perror("-j");
+                        exit(1);
+                    } else
+                        cfg.thread_count = atoi(parm);
+                    j = maxj;
+                    break;
                 case 'P':
                     cfg.is_pointer_arithmetic++;
                     break;
+                case 'f':
+                    cfg.is_following++;
+                    break;
                 default:
                     {
                         char foo[3];
@@ -758,10 +3285,37 @@ read_command_line(int argc, char *argv[])
         }
     }
 
+    /* The -P and -PP options are the older way of choosing an engine.
+     * If there's none, we'll use the one from '--autotune' */
+    if (cfg.engine == NULL) {
+        if (cfg.is_pointer_arithmetic > 1)
+            cfg.engine = wc2_engine_find("pointer-pointer");
+        else if (cfg.is_pointer_arithmetic)
+            cfg.engine = wc2_engine_find("pointer");
+    }
+    cfg.bufsize = 65536;
+    cfg.mapsize = 65536;
+
+    /* Following only makes sense for named files that can grow */
+    if (cfg.is_following && cfg.file_count == 0) {
+        perror("-f");
+        exit(1);
+    }
+    if (cfg.follow_interval == 0)
+        cfg.follow_interval = 1000;
+
     /* If no files specified, then we do <stdin> instead */
     if (cfg.file_count == 0)
         cfg.is_stdin = 1;
 
+    /* The index is kept in a file next to the one it indexes, so there
+     * can't be one for <stdin> */
+    if ((cfg.is_indexing || cfg.is_reindexing) && cfg.is_stdin) {
+        fprintf(stderr, "wc2: %s: can't index <stdin>, only named files\n",
+                cfg.is_reindexing ? "--reindex" : "--index");
+        exit(1);
+    }
+
     /* Default is -lwc if no options are given */
     if (cfg.is_counting_lines == 0
         && cfg.is_counting_words == 0
@@ -775,7 +3329,7 @@ read_command_line(int argc, char *argv[])
     /* Calculate the width for the columns */
     if (cfg.column_width == 0) {
         if (cfg.file_count > 0) {
-            cfg.column_width = get_column_width(argc, argv, cfg.is_stdin);
+            cfg.column_width = get_column_width(argc, argv, &cfg);
         } else
             cfg.column_width = 1;
     }
@@ -790,11 +3344,42 @@ read_command_line(int argc, char *argv[])
     return cfg;
 }
 
+/**
+ * Open the output for '--newline-offsets' or '--word-offsets'
+ */
+static FILE *
+open_offsets(const char *filename, struct config *cfg)
+{
+    FILE *fp;
+
+    if (strcmp(filename, "-") == 0) {
+        cfg->is_quiet = 1;
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#else
+        setvbuf(stdout, NULL, _IOFBF, 65536);
+#endif
+        return stdout;
+    }
+
+    fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        perror(filename);
+        exit(1);
+    }
+    return fp;
+}
+
 int main(int argc, char *argv[])
 {
     int i;
-    struct results totals = {0,0,0,0};
+    struct wc2_results totals = {0,0,0,0};
+    unsigned long long total_start = now_nsecs();
+    unsigned long long total_bytes = 0;
+    struct io_stats file_stats;
+    struct io_stats total_stats;
     struct config cfg;
+    struct wc2_machine *machine;
 
     /* Force output to be an atomic line-at-a-time, so that other
      * programs reading the output never see a partial line */
@@ -804,30 +3389,146 @@ int main(int argc, char *argv[])
 
     /* Read in the configuration parameters from the command-line */
     cfg = read_command_line(argc, argv);
+    memset(&file_stats, 0, sizeof(file_stats));
+    memset(&total_stats, 0, sizeof(total_stats));
+
+    /* The machine-readable formats are buffered by us, and written
+     * when the buffer fills, or we are done, however that happens */
+    if (cfg.format != FORMAT_HUMAN) {
+#ifdef _WIN32
+        _setmode(1, _O_BINARY);
+#endif
+        atexit(out_flush);
+    }
 
     /* Compile the ASCII/UTF8 state-machine that we'll use to
-     * parse multi-byte characters */
-    compile_utf8_statemachine(cfg.is_counting_chars);
-    compile_pointers();
+     * parse multi-byte characters. We also set the global locale, so
+     * that error messages are in the user's language */
+    setlocale(LC_ALL, "");
+    if (cfg.is_stats)
+        total_stats.compile_ns = now_nsecs();
+    machine = wc2_machine_create(cfg.is_counting_chars, "");
+    if (machine == NULL)
+        machine = wc2_machine_create(cfg.is_counting_chars, "C");
+    if (machine == NULL) {
+        perror("locale");
+        return 1;
+    }
+    cfg.machine = machine;
+    if (cfg.is_stats) {
+        total_stats.compile_ns = now_nsecs() - total_stats.compile_ns;
+        cfg.stats = &file_stats;
+    }
+    if (cfg.is_profiling) {
+        cfg.profile = calloc(1, sizeof(*cfg.profile));
+        if (cfg.profile == NULL)
+            abort();
+    }
+
+    /* With '--autotune', we time the engines instead of counting. Otherwise,
+     * use what it found to be fastest, unless told otherwise */
+#ifndef _WIN32
+    if (cfg.is_autotuning) {
+        wc2_machine_free(machine);
+        return autotune();
+    }
+    if (cfg.engine == NULL)
+        autotune_load(&cfg);
+#else
+    if (cfg.is_autotuning) {
+        perror("--autotune");
+        return 1;
+    }
+#endif
+    if (cfg.engine == NULL)
+        cfg.engine = wc2_engine_find("index");
+
+    /* Some engines only count bytes, and some only characters */
+    if (!wc2_engine_is_usable(cfg.engine, machine)
+        || (cfg.verify_engine && !wc2_engine_is_usable(cfg.verify_engine, machine))) {
+        const struct wc2_engine *engine = wc2_engine_is_usable(cfg.engine, machine) ? cfg.verify_engine : cfg.engine;
+        fprintf(stderr, "wc2: %s: engine can't be used %s -m\n", engine->name,
+                cfg.is_counting_chars ? "with" : "without");
+        return 1;
+    }
+
+    /* Open the files for '--newline-offsets' and '--word-offsets'. If
+     * these are going to <stdout>, then that's binary data, so we don't
+     * print the counts there, and don't need line buffering */
+    if (cfg.newline_offsets_name)
+        cfg.newline_offsets = open_offsets(cfg.newline_offsets_name, &cfg);
+    if (cfg.word_offsets_name) {
+        if (cfg.newline_offsets_name && strcmp(cfg.word_offsets_name, cfg.newline_offsets_name) == 0) {
+            perror(cfg.word_offsets_name);
+            return 1;
+        }
+        cfg.word_offsets = open_offsets(cfg.word_offsets_name, &cfg);
+    }
+
+    /* With '--merge', the files are summaries rather than input */
+    if (cfg.is_merging) {
+        int err = merge_files(argc, argv, &cfg);
+        wc2_machine_free(machine);
+        return err;
+    }
 
+    /* With '-f', we keep watching the files forever */
+    if (cfg.is_following) {
+#ifndef _WIN32
+        follow_files(argc, argv, &cfg);
+#else
+        perror("-f");
+        return 1;
+#endif
+    }
 
     /* Process all the files specified on the command-line */
     for (i=1; i<argc; i++) {
         FILE *fp;
         const char *filename = argv[i];
-        struct results results;
+        struct wc2_results results;
+        struct file_info info = {RECORD_FILE, -1, 0, 0};
+        unsigned long long start;
 
-        if (argv[i][0] == '-')
+        if (!is_filename_arg(&cfg, argv, i))
             continue;
 
+        start = now_nsecs();
+        WC2_PROBE1(file__open, filename);
         fp = fopen(filename, "rb");
         if (fp == NULL) {
+            /* The machine-readable formats also record the failure,
+             * so that every file named has a record */
+            info.error = errno;
             perror(argv[i]);
+            if (cfg.format != FORMAT_HUMAN) {
+                memset(&results, 0, sizeof(results));
+                print_results(filename, &results, &info, &cfg);
+            }
             continue;
         }
-
-        results = parse_file(fp, &cfg);
-        print_results(filename, &results, &cfg);
+        info.size = file_size(fp);
+
+        if (cfg.split_count)
+            results = split_file(fp, filename, &cfg);
+        else if (cfg.is_summarizing)
+            results = summary_file(fp, &cfg);
+        else if (cfg.is_range)
+            results = range_file(fp, filename, &cfg.range, cfg.is_line_range, &cfg);
+        else if (cfg.is_reindexing)
+            results = index_update(fp, filename, &cfg.reindex, &cfg);
+        else if (cfg.is_indexing)
+            results = index_file(fp, filename, &cfg);
+        else if (!is_bytes_only(&cfg) || !count_bytes(fp, &results))
+            results = parse_file(fp, &cfg);
+        info.elapsed_ns = now_nsecs() - start;
+        print_results(filename, &results, &info, &cfg);
+        if (cfg.stats) {
+            print_stats(filename, &file_stats, results.byte_count, info.elapsed_ns, 0);
+            stats_add(&total_stats, &file_stats);
+            memset(&file_stats, 0, sizeof(file_stats));
+            total_bytes += results.byte_count;
+        }
 
         totals.line_count += results.line_count;
         totals.word_count += results.word_count;
@@ -835,6 +3536,7 @@ int main(int argc, char *argv[])
         totals.char_count += results.char_count;
 
         fclose(fp);
+        WC2_PROBE2(file__close, filename, results.byte_count);
     }
 
     /* If no files specified, or the "-" file specified, then
@@ -842,20 +3544,49 @@ int main(int argc, char *argv[])
      * to "binary", to prevent the library from doing it's own
      * notions of text processing */
     if (cfg.is_stdin) {
-        struct results results;
+        struct wc2_results results;
+        struct file_info info = {RECORD_STDIN, -1, 0, 0};
+        unsigned long long start = now_nsecs();
         FILE *fp;
 
         /* Make sure we read <stdin> in binary mode, because on some
          * platforms (Windows) it defaults to text-mode that will
-         * chnage some characters */
+         * chnage some characters. Elsewhere there's no such thing, and
+         * we leave it alone, because 'freopen()' may open the file
+         * again from the start, rather than where the shell left it. */
+#ifdef _WIN32
         fp = freopen(NULL, "rb", stdin);
         if (fp == NULL) {
             perror("stdin");
             fp = stdin;
         }
+#else
+        fp = stdin;
+#endif
 
-        results = parse_file(fp, &cfg);
-        print_results(NULL, &results, &cfg);
+        /* Whether <stdin> is a pipe or was redirected from a file makes
+         * a difference to how we read it. Files get the same treatment
+         * as when they are named on the command-line */
+        setup_pipe(fp, &cfg);
+        info.size = file_size(fp);
+        WC2_PROBE1(file__open, NULL);
+
+        if (cfg.split_count)
+            results = split_file(fp, NULL, &cfg);
+        else if (cfg.is_summarizing)
+            results = summary_file(fp, &cfg);
+        else if (cfg.is_range)
+            results = range_file(fp, NULL, &cfg.range, cfg.is_line_range, &cfg);
+        else if (!is_bytes_only(&cfg) || !count_bytes(fp, &results))
+            results = parse_file(fp, &cfg);
+        WC2_PROBE2(file__close, NULL, results.byte_count);
+        info.elapsed_ns = now_nsecs() - start;
+        print_results(NULL, &results, &info, &cfg);
+        if (cfg.stats) {
+            print_stats(NULL, &file_stats, results.byte_count, info.elapsed_ns, 0);
+            stats_add(&total_stats, &file_stats);
+            total_bytes += results.byte_count;
+        }
 
         totals.line_count += results.line_count;
         totals.word_count += results.word_count;
@@ -865,20 +3596,24 @@ int main(int argc, char *argv[])
 
     /* If we read more than one thing, then we also need to print an
      * additional totals line */
-    if (cfg.is_printing_totals)
-        print_results("total", &totals, &cfg);
+    if (cfg.is_printing_totals) {
+        struct file_info info = {RECORD_TOTAL, -1, 0, 0};
+        info.elapsed_ns = now_nsecs() - total_start;
+        print_results("total", &totals, &info, &cfg);
+    }
 
-#if _WIN32
-    {
-      FILETIME begin;
-      FILETIME end;
-      FILETIME kernel;
-      FILETIME user;
-        if (GetProcessTimes(GetCurrentProcess(), &begin, &end, &kernel, &user)) {
-            unsigned long long elapsed = ((unsigned long long)user.dwLowDateTime | (unsigned long long)user.dwHighDateTime<<32ULL)/10000ULL;
-            printf("user %lu.%03u\n", (unsigned)(elapsed/1000ULL), (unsigned)(elapsed % 1000));
-        }
+    if (close_offsets(cfg.newline_offsets, cfg.newline_offsets_name) != 0)
+        return 1;
+    if (close_offsets(cfg.word_offsets, cfg.word_offsets_name) != 0)
+        return 1;
+
+    wc2_machine_free(machine);
+
+    if (cfg.profile) {
+        print_profile(cfg.profile);
+        free(cfg.profile);
     }
-#endif
+    if (cfg.stats)
+        print_stats("total", &total_stats, total_bytes, now_nsecs() - total_start, 1);
     return 0;
 }
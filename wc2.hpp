@@ -0,0 +1,456 @@
+/*
+    A header-only C++17 version of the 'wc2' engine, for embedding
+    word-counting in C++ programs.
+
+    The engine is a template, specialized at compile-time on which
+    counters are wanted and which state-machine to use, so that nothing
+    is done in the inner-loop for counters that aren't wanted:
+
+        wc2::engine<wc2::lines | wc2::words, wc2::ascii_machine> e;
+        e.feed(std::string_view("hello world\n"));
+        wc2::results r = e.finish();
+
+    There are two state-machines. The 'ascii_machine' is the 4-state
+    machine from 'wc2o.c', which is generated at compile-time. The
+    'utf8_machine' is the same UTF-8 machine as 'libwc2.c'. It can be
+    generated at compile-time too, for the whitespace characters of
+    the usual UTF-8 locales ('wc2::utf8'), or at runtime for whatever
+    locale is named ('wc2::utf8_machine::from_locale("")'). These give
+    exactly the same counts as 'wc2 -lwc' and 'wc2 -lwm' respectively.
+*/
+#ifndef WC2_HPP
+#define WC2_HPP
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
+#include <locale.h>
+#include <wctype.h>
+#include <ctype.h>
+#ifdef __APPLE__
+#include <xlocale.h>
+#endif
+
+namespace wc2 {
+
+/**
+ * The counters, which can be or'ed together as the first parameter
+ * of the 'engine' template.
+ */
+enum counter : unsigned {
+    lines = 1,
+    words = 2,
+    chars = 4,
+    bytes = 8,
+    all = lines | words | chars | bytes
+};
+
+/**
+ * Holds the counts from reading a chunk, a file, or totals. Counters
+ * that weren't enabled are left as zero.
+ */
+struct results {
+    unsigned long long line_count = 0;
+    unsigned long long word_count = 0;
+    unsigned long long char_count = 0;
+    unsigned long long byte_count = 0;
+};
+
+/**
+ * The states that get counted, the same as in 'libwc2.c'. All the
+ * others are partway through a multibyte character.
+ */
+enum state : unsigned char {
+    WASSPACE = 0,
+    NEWLINE,
+    NEWWORD,
+    WASWORD
+};
+
+template <std::size_t States>
+using table_type = std::array<std::array<unsigned char, 256>, States>;
+
+/**
+ * The 4-state ASCII machine from 'wc2o.c', where the spaces are those
+ * of the "C" locale. The 'column' table is folded into the state table,
+ * so the inner-loop is the same as for the UTF-8 machine.
+ */
+struct ascii_machine {
+    static constexpr bool is_multibyte = false;
+    static constexpr std::size_t state_count = 4;
+    table_type<state_count> table{};
+
+    constexpr ascii_machine()
+    {
+        for (unsigned c = 0; c < 256; c++) {
+            if (c == '\n') {
+                table[WASSPACE][c] = NEWLINE;
+                table[NEWLINE][c] = NEWLINE;
+                table[NEWWORD][c] = NEWLINE;
+                table[WASWORD][c] = NEWLINE;
+            } else if (c == ' ' || c == '\t' || c == '\v' || c == '\f' || c == '\r') {
+                table[WASSPACE][c] = WASSPACE;
+                table[NEWLINE][c] = WASSPACE;
+                table[NEWWORD][c] = WASSPACE;
+                table[WASWORD][c] = WASSPACE;
+            } else {
+                table[WASSPACE][c] = NEWWORD;
+                table[NEWLINE][c] = NEWWORD;
+                table[NEWWORD][c] = WASWORD;
+                table[WASWORD][c] = WASWORD;
+            }
+        }
+    }
+};
+
+/**
+ * The whitespace characters of the usual UTF-8 locales (glibc, macOS),
+ * which are the Unicode spaces except for the no-break ones.
+ */
+constexpr bool
+unicode_isspace(unsigned c)
+{
+    return (c >= 0x09 && c <= 0x0D) || c == 0x20
+        || c == 0x1680
+        || (c >= 0x2000 && c <= 0x200A && c != 0x2007)
+        || c == 0x2028 || c == 0x2029 || c == 0x205F || c == 0x3000;
+}
+
+/**
+ * The UTF-8 machine, built the same way as in 'libwc2.c'.
+ */
+struct utf8_machine {
+    static constexpr bool is_multibyte = true;
+
+    enum : unsigned char {
+        DUO2_xx, DUO2_C2,
+        TRI2_E0, TRI2_E1, TRI2_E2, TRI2_E3, TRI2_ED, TRI2_EE, TRI2_xx,
+        TRI3_E0_xx, TRI3_E1_xx, TRI3_E1_9a, TRI3_E2_80, TRI3_E2_81, TRI3_E2_xx,
+        TRI3_E3_80, TRI3_E3_81, TRI3_E3_xx, TRI3_Ed_xx, TRI3_Ee_xx, TRI3_xx_xx,
+        QUAD2_xx, QUAD2_F0, QUAD2_F4,
+        QUAD3_xx_xx, QUAD3_F0_xx, QUAD3_F4_xx,
+        QUAD4_xx_xx_xx, QUAD4_F0_xx_xx, QUAD4_F4_xx_xx,
+        ILLEGAL
+    };
+    enum : unsigned char {
+        USPACE = 4,
+        UWORD = USPACE + ILLEGAL + 1
+    };
+    static constexpr std::size_t state_count = UWORD + ILLEGAL + 1;
+    table_type<state_count> table{};
+
+    /**
+     * Build the machine, where 'is_space' tells us which code-points
+     * are spaces.
+     */
+    template <typename IsSpace>
+    constexpr explicit utf8_machine(IsSpace is_space)
+    {
+        build_basic(table[WASSPACE], NEWWORD, USPACE, is_space);
+        build_basic(table[NEWLINE], NEWWORD, USPACE, is_space);
+        build_basic(table[WASWORD], WASWORD, UWORD, is_space);
+        build_basic(table[NEWWORD], WASWORD, UWORD, is_space);
+        build_unicode(NEWWORD, USPACE, is_space);
+        build_unicode(WASWORD, UWORD, is_space);
+    }
+
+    /**
+     * Build the machine at runtime, with the spaces of the named locale,
+     * where "" means the one from the environment.
+     */
+    static utf8_machine
+    from_locale(const char *name)
+    {
+#ifdef _WIN32
+        _locale_t loc = _create_locale(LC_CTYPE, name);
+        if (loc == nullptr)
+            throw std::runtime_error("unknown locale");
+        utf8_machine machine([loc](unsigned c) { return _iswspace_l(c, loc) != 0; });
+        _free_locale(loc);
+#else
+        locale_t loc = newlocale(LC_CTYPE_MASK, name, (locale_t)0);
+        if (loc == (locale_t)0)
+            throw std::runtime_error("unknown locale");
+        utf8_machine machine([loc](unsigned c) { return iswspace_l(c, loc) != 0; });
+        freelocale(loc);
+#endif
+        return machine;
+    }
+
+private:
+    template <typename IsSpace>
+    static constexpr void
+    build_basic(std::array<unsigned char, 256> &row, unsigned char default_state, unsigned char ubase, IsSpace is_space)
+    {
+        for (unsigned c = 0; c < 256; c++) {
+            if (c & 0x80) {
+                if ((c & 0xE0) == 0xC0) {
+                    /* 110x xxxx - unicode 2 byte sequence */
+                    if (c < 0xC2)
+                        row[c] = ubase + ILLEGAL;
+                    else if (c == 0xC2)
+                        row[c] = ubase + DUO2_C2;
+                    else
+                        row[c] = ubase + DUO2_xx;
+                } else if ((c & 0xF0) == 0xE0) {
+                    /* 1110 xxxx - unicode 3 byte sequence */
+                    switch (c) {
+                    case 0xE0: row[c] = ubase + TRI2_E0; break;
+                    case 0xE1: row[c] = ubase + TRI2_E1; break;
+                    case 0xE2: row[c] = ubase + TRI2_E2; break;
+                    case 0xE3: row[c] = ubase + TRI2_E3; break;
+                    case 0xED: row[c] = ubase + TRI2_ED; break;
+                    case 0xEE: row[c] = ubase + TRI2_EE; break;
+                    default: row[c] = ubase + TRI2_xx; break;
+                    }
+                } else if ((c & 0xF8) == 0xF0) {
+                    /* 1111 0xxx - unicode 4 byte sequence */
+                    if (c >= 0xF5)
+                        row[c] = ubase + ILLEGAL;
+                    else if (c == 0xF0)
+                        row[c] = ubase + QUAD2_F0;
+                    else if (c == 0xF4)
+                        row[c] = ubase + QUAD2_F4;
+                    else
+                        row[c] = ubase + QUAD2_xx;
+                } else
+                    row[c] = ubase + ILLEGAL;
+            } else if (c == '\n')
+                row[c] = NEWLINE;
+            else if (is_space(c))
+                row[c] = WASSPACE;
+            else
+                row[c] = default_state;
+        }
+    }
+
+    constexpr void
+    build_urow(unsigned ubase, unsigned id, unsigned next)
+    {
+        unsigned char default_state = table[ubase + ILLEGAL][0];
+        unsigned char to = next ? ubase + next : default_state;
+
+        /* Anything but a continuation byte ends the sequence, which is
+         * illegal, and starts over with that byte */
+        table[ubase + id] = table[ubase + ILLEGAL];
+        for (unsigned i = 0x80; i < 0xC0; i++)
+            table[ubase + id][i] = to;
+    }
+
+    template <typename IsSpace>
+    constexpr void
+    build_unicode(unsigned char default_state, unsigned char ubase, IsSpace is_space)
+    {
+        build_basic(table[ubase + ILLEGAL], default_state, ubase, is_space);
+
+        /* Two byte */
+        build_urow(ubase, DUO2_xx, 0);
+        build_urow(ubase, DUO2_C2, 0);
+
+        /* Three byte */
+        build_urow(ubase, TRI2_E0, TRI3_E0_xx);
+        build_urow(ubase, TRI2_E1, TRI3_E1_xx);
+        build_urow(ubase, TRI2_E2, TRI3_E2_xx);
+        build_urow(ubase, TRI2_E3, TRI3_E3_xx);
+        build_urow(ubase, TRI2_ED, TRI3_Ed_xx);
+        build_urow(ubase, TRI2_EE, TRI3_Ee_xx);
+        build_urow(ubase, TRI2_xx, TRI3_xx_xx);
+        for (unsigned id : {TRI3_E0_xx, TRI3_E1_xx, TRI3_E1_9a, TRI3_E2_80, TRI3_E2_81, TRI3_E2_xx,
+                            TRI3_E3_80, TRI3_E3_81, TRI3_E3_xx, TRI3_Ed_xx, TRI3_Ee_xx, TRI3_xx_xx})
+            build_urow(ubase, id, 0);
+        table[ubase + TRI2_E1][0x9a] = ubase + TRI3_E1_9a;
+        table[ubase + TRI2_E2][0x80] = ubase + TRI3_E2_80;
+        table[ubase + TRI2_E2][0x81] = ubase + TRI3_E2_81;
+        table[ubase + TRI2_E3][0x80] = ubase + TRI3_E3_80;
+        table[ubase + TRI2_E3][0x81] = ubase + TRI3_E3_81;
+
+        /* Four byte */
+        build_urow(ubase, QUAD2_xx, QUAD3_xx_xx);
+        build_urow(ubase, QUAD2_F0, QUAD3_F0_xx);
+        build_urow(ubase, QUAD2_F4, QUAD3_F4_xx);
+        build_urow(ubase, QUAD3_xx_xx, QUAD4_xx_xx_xx);
+        build_urow(ubase, QUAD3_F0_xx, QUAD4_F0_xx_xx);
+        build_urow(ubase, QUAD3_F4_xx, QUAD4_F4_xx_xx);
+        build_urow(ubase, QUAD4_xx_xx_xx, 0);
+        build_urow(ubase, QUAD4_F0_xx_xx, 0);
+        build_urow(ubase, QUAD4_F4_xx_xx, 0);
+
+        /* Mark Unicode spaces */
+        if (is_space(0x0085))
+            table[ubase + DUO2_C2][0x85] = WASSPACE;
+        if (is_space(0x00A0))
+            table[ubase + DUO2_C2][0xA0] = WASSPACE;
+        if (is_space(0x1680))
+            table[ubase + TRI3_E1_9a][0x80] = WASSPACE;
+        for (unsigned i = 0x2000; i < 0x200b + 1; i++) {
+            if (is_space(i))
+                table[ubase + TRI3_E2_80][0x80 + (i & 0x6F)] = WASSPACE;
+        }
+        if (is_space(0x2028))
+            table[ubase + TRI3_E2_80][0xA8] = WASSPACE;
+        if (is_space(0x2029))
+            table[ubase + TRI3_E2_80][0xA9] = WASSPACE;
+        if (is_space(0x202F))
+            table[ubase + TRI3_E2_80][0xAF] = WASSPACE;
+        if (is_space(0x205F))
+            table[ubase + TRI3_E2_81][0x9F] = WASSPACE;
+        if (is_space(0x3000))
+            table[ubase + TRI3_E3_80][0x80] = WASSPACE;
+
+        /* Mark overlong sequences, those past U+10FFFF, and surrogates
+         * as illegal */
+        for (unsigned i = 0x80; i < 0xA0; i++)
+            table[ubase + TRI2_E0][i] = ubase + ILLEGAL;
+        for (unsigned i = 0x80; i < 0x90; i++)
+            table[ubase + QUAD2_F0][i] = ubase + ILLEGAL;
+        for (unsigned i = 0x90; i < 0xC0; i++)
+            table[ubase + QUAD2_F4][i] = ubase + ILLEGAL;
+        for (unsigned i = 0xA0; i < 0xC0; i++)
+            table[ubase + TRI2_ED][i] = ubase + ILLEGAL;
+    }
+};
+
+/**
+ * The machines, generated at compile-time.
+ */
+inline constexpr ascii_machine ascii{};
+inline constexpr utf8_machine utf8{unicode_isspace};
+
+/**
+ * The engine, which holds the state between chunks of input and the
+ * counts so far. It's tiny, so there can be one for every stream.
+ */
+template <unsigned Counters, typename Machine = ascii_machine>
+class engine {
+public:
+    constexpr engine() : machine_(default_machine()) {}
+    constexpr explicit engine(const Machine &machine) : machine_(&machine) {}
+
+    /**
+     * Parse the next chunk of input, which is any contiguous range of
+     * bytes, such as a std::string, std::vector<char>, or std::span.
+     */
+    template <typename Range>
+    auto
+    feed(const Range &range) -> decltype(std::data(range), std::size(range), void())
+    {
+        static_assert(sizeof(*std::data(range)) == 1, "input must be bytes");
+        auto p = reinterpret_cast<const unsigned char *>(std::data(range));
+        feed(p, p + std::size(range));
+    }
+
+    /**
+     * Parse the next chunk of input, given as a pair of iterators over
+     * bytes. If these are pointers, this is the fast inner-loop.
+     */
+    template <typename Iterator>
+    void
+    feed(Iterator first, Iterator last)
+    {
+        constexpr bool is_lines = (Counters & lines) != 0;
+        constexpr bool is_words = (Counters & words) != 0;
+        constexpr bool is_chars = (Counters & chars) != 0 && Machine::is_multibyte;
+        constexpr bool is_bytes = (Counters & bytes) != 0 || ((Counters & chars) && !Machine::is_multibyte);
+
+        /* Newlines don't depend on the state, so if that's all that's
+         * wanted, we don't need the state-machine at all */
+        if constexpr (!is_words && !is_chars) {
+            if constexpr (is_lines)
+                line_count_ += std::count_if(first, last, [](auto x) { return static_cast<unsigned char>(x) == '\n'; });
+            if constexpr (is_bytes)
+                byte_count_ += std::distance(first, last);
+            return;
+        } else {
+            const auto &table = machine_->table;
+            unsigned state = state_;
+            unsigned long long l = 0;
+            unsigned long long w = 0;
+            unsigned long long c = 0;
+            unsigned long long b = 0;
+
+            /* This is the inner-loop. The counters that aren't wanted
+             * are discarded at compile time. */
+            for (; first != last; ++first) {
+                state = table[state][static_cast<unsigned char>(*first)];
+                if constexpr (is_lines)
+                    l += (state == NEWLINE);
+                if constexpr (is_words)
+                    w += (state == NEWWORD);
+                if constexpr (is_chars)
+                    c += (state <= WASWORD);
+                if constexpr (is_bytes)
+                    b++;
+            }
+
+            state_ = state;
+            line_count_ += l;
+            word_count_ += w;
+            char_count_ += c;
+            byte_count_ += b;
+        }
+    }
+
+    /**
+     * Return the counts, and reset so the engine can be used again
+     * for another stream.
+     */
+    results
+    finish()
+    {
+        results r;
+        if constexpr ((Counters & lines) != 0)
+            r.line_count = line_count_;
+        if constexpr ((Counters & words) != 0)
+            r.word_count = word_count_;
+        if constexpr ((Counters & chars) != 0)
+            r.char_count = Machine::is_multibyte ? char_count_ : byte_count_;
+        if constexpr ((Counters & bytes) != 0)
+            r.byte_count = byte_count_;
+        *this = engine(*machine_);
+        return r;
+    }
+
+private:
+    static constexpr const Machine *
+    default_machine()
+    {
+        if constexpr (std::is_same_v<Machine, ascii_machine>)
+            return &ascii;
+        else
+            return &utf8;
+    }
+
+    const Machine *machine_;
+    unsigned state_ = WASSPACE;
+    unsigned long long line_count_ = 0;
+    unsigned long long word_count_ = 0;
+    unsigned long long char_count_ = 0;
+    unsigned long long byte_count_ = 0;
+};
+
+/**
+ * Count an entire range of input at once.
+ */
+template <unsigned Counters, typename Machine = ascii_machine, typename Range>
+results
+count(const Range &range, const Machine &machine)
+{
+    engine<Counters, Machine> e(machine);
+    e.feed(range);
+    return e.finish();
+}
+
+template <unsigned Counters, typename Machine = ascii_machine, typename Range>
+results
+count(const Range &range)
+{
+    engine<Counters, Machine> e;
+    e.feed(range);
+    return e.finish();
+}
+
+} /* namespace wc2 */
+#endif
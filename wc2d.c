@@ -0,0 +1,606 @@
+/*
+    A word-count service, counting the text sent over many network
+    connections at once.
+
+    This is where the asynchronous design pays off. Each connection
+    is just a small DFA state plus its counters, and every segment
+    is parsed as it arrives, in place, then forgotten. There is no thread
+    per connection, and no buffering of input, so the memory cost is
+    fixed: one 'struct connection' each, allocated up front.
+
+    A client connects, sends its text, then half-closes its side of the
+    connection with 'shutdown(SHUT_WR)'. The service then sends back the
+    counts in the same format as 'wc2' would print them for <stdin>, and
+    closes the connection.
+
+        $ ./wc2d -lwm --port=7777 --unix=/tmp/wc2d.sock &
+        $ ./wc2load --port=7777 --connections=10000 --size=65536
+
+    It listens only on localhost. This is Linux only, since it uses
+    'epoll'.
+*/
+#define _GNU_SOURCE
+#include "libwc2.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * The most sockets we listen on, one TCP and one local
+ */
+#define LISTENER_MAX 2
+
+/**
+ * The size of the receive buffer, shared by all connections, since
+ * each segment is parsed as soon as it's received.
+ */
+#define RECV_BUFSIZE 65536
+
+struct config {
+    int is_counting_lines;
+    int is_counting_words;
+    int is_counting_bytes;
+    int is_counting_chars;
+    unsigned port;
+    const char *unix_name;
+    unsigned connection_max;
+};
+
+/**
+ * The state for a single connection. This is all the memory that
+ * a connection uses.
+ */
+struct connection {
+    int fd;
+    struct wc2_stream stream;
+    struct connection *next_free;
+    unsigned reply_offset;
+    unsigned reply_length;
+    char reply[96];
+};
+
+/**
+ * A listening socket
+ */
+struct listener {
+    int fd;
+};
+
+/**
+ * Everything the service needs
+ */
+struct service {
+    const struct config *cfg;
+    const struct wc2_machine *machine;
+    int epfd;
+    struct listener listeners[LISTENER_MAX];
+    unsigned listener_count;
+    struct connection *connections;
+    struct connection *free_list;
+    unsigned long long accepted;
+    unsigned long long completed;
+    unsigned long long rejected;
+    unsigned long long total_bytes;
+    unsigned char buf[RECV_BUFSIZE];
+};
+
+static volatile sig_atomic_t is_stopping;
+
+static void
+on_signal(int sig)
+{
+    (void)sig;
+    is_stopping = 1;
+}
+
+/**
+ * Connections are tagged in epoll by their index plus the number of
+ * listeners, so that small values mean listening sockets.
+ */
+static uint64_t
+connection_tag(const struct service *svc, const struct connection *conn)
+{
+    return (uint64_t)(conn - svc->connections) + LISTENER_MAX;
+}
+
+/**
+ * Format the counts the same way as 'wc2' prints them for <stdin>
+ */
+static unsigned
+format_results(char *buf, size_t sizeof_buf, const struct wc2_results *results, const struct config *cfg)
+{
+    int needs_space = 0;
+    size_t offset = 0;
+
+    if (cfg->is_counting_lines)
+        offset += snprintf(buf + offset, sizeof_buf - offset, "%s%lu", needs_space++?" ":"", results->line_count);
+    if (cfg->is_counting_words)
+        offset += snprintf(buf + offset, sizeof_buf - offset, "%s%lu", needs_space++?" ":"", results->word_count);
+    if (cfg->is_counting_bytes)
+        offset += snprintf(buf + offset, sizeof_buf - offset, "%s%lu", needs_space++?" ":"", results->byte_count);
+    if (cfg->is_counting_chars)
+        offset += snprintf(buf + offset, sizeof_buf - offset, "%s%lu", needs_space++?" ":"", results->char_count);
+    offset += snprintf(buf + offset, sizeof_buf - offset, "\n");
+    return (unsigned)offset;
+}
+
+/**
+ * Close the connection and put it back on the free list
+ */
+static void
+connection_close(struct service *svc, struct connection *conn)
+{
+    close(conn->fd);
+    conn->fd = -1;
+    conn->next_free = svc->free_list;
+    svc->free_list = conn;
+}
+
+/**
+ * Send as much of the reply as we can. Returns 1 when the whole reply
+ * has been sent, 0 if we need to wait for the socket to be writable,
+ * or -1 on error.
+ */
+static int
+connection_send(struct connection *conn)
+{
+    while (conn->reply_offset < conn->reply_length) {
+        ssize_t count;
+
+        count = send(conn->fd, conn->reply + conn->reply_offset,
+                     conn->reply_length - conn->reply_offset, MSG_NOSIGNAL);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        conn->reply_offset += (unsigned)count;
+    }
+    return 1;
+}
+
+/**
+ * The client half-closed the connection, so send back the counts.
+ */
+static void
+connection_reply(struct service *svc, struct connection *conn)
+{
+    struct wc2_results results;
+    struct epoll_event ev;
+    int err;
+
+    results = wc2_finish(&conn->stream);
+    svc->total_bytes += results.byte_count;
+    conn->reply_offset = 0;
+    conn->reply_length = format_results(conn->reply, sizeof(conn->reply), &results, svc->cfg);
+
+    err = connection_send(conn);
+    if (err != 0) {
+        if (err > 0)
+            svc->completed++;
+        connection_close(svc, conn);
+        return;
+    }
+
+    /* The send buffer is full, which is unlikely for such a small reply,
+     * so wait until it drains */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT;
+    ev.data.u64 = connection_tag(svc, conn);
+    if (epoll_ctl(svc->epfd, EPOLL_CTL_MOD, conn->fd, &ev) != 0) {
+        perror("epoll_ctl");
+        connection_close(svc, conn);
+    }
+}
+
+/**
+ * Parse everything that's waiting on the connection, in place, a segment
+ * at a time.
+ */
+static void
+connection_recv(struct service *svc, struct connection *conn)
+{
+    for (;;) {
+        ssize_t count;
+
+        count = recv(conn->fd, svc->buf, sizeof(svc->buf), 0);
+        if (count > 0) {
+            wc2_feed(&conn->stream, svc->buf, (size_t)count);
+            continue;
+        }
+        if (count == 0) {
+            connection_reply(svc, conn);
+            return;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            connection_close(svc, conn);
+        return;
+    }
+}
+
+/**
+ * Accept all the connections waiting on a listening socket.
+ */
+static void
+listener_accept(struct service *svc, struct listener *listener)
+{
+    for (;;) {
+        struct connection *conn;
+        struct epoll_event ev;
+        int fd;
+
+        fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+
+        /* When all the connections are in use, we refuse new ones
+         * rather than grow */
+        conn = svc->free_list;
+        if (conn == NULL) {
+            svc->rejected++;
+            close(fd);
+            continue;
+        }
+        svc->free_list = conn->next_free;
+
+        conn->fd = fd;
+        conn->next_free = NULL;
+        wc2_init(&conn->stream, svc->machine);
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.u64 = connection_tag(svc, conn);
+        if (epoll_ctl(svc->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            perror("epoll_ctl");
+            connection_close(svc, conn);
+            continue;
+        }
+        svc->accepted++;
+    }
+}
+
+/**
+ * Create a listening socket on localhost, either TCP (if 'port' is set)
+ * or local (if 'unix_name' is set).
+ */
+static int
+listener_open(struct service *svc, unsigned port, const char *unix_name)
+{
+    struct listener *listener = &svc->listeners[svc->listener_count];
+    struct epoll_event ev;
+    int fd;
+
+    if (unix_name) {
+        struct sockaddr_un sun;
+
+        if (strlen(unix_name) >= sizeof(sun.sun_path)) {
+            errno = ENAMETOOLONG;
+            perror(unix_name);
+            return -1;
+        }
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, unix_name);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            perror("socket");
+            return -1;
+        }
+        unlink(unix_name);
+        if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+            perror(unix_name);
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_in sin;
+        int yes = 1;
+
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons((unsigned short)port);
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            perror("socket");
+            return -1;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+            perror("bind");
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (listen(fd, SOMAXCONN) != 0) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+
+    listener->fd = fd;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = svc->listener_count;
+    if (epoll_ctl(svc->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        perror("epoll_ctl");
+        close(fd);
+        return -1;
+    }
+    svc->listener_count++;
+    return 0;
+}
+
+/**
+ * The event loop
+ */
+static void
+service_run(struct service *svc)
+{
+    struct epoll_event events[256];
+
+    while (!is_stopping) {
+        int count;
+        int i;
+
+        count = epoll_wait(svc->epfd, events, sizeof(events)/sizeof(events[0]), -1);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (i=0; i<count; i++) {
+            uint64_t tag = events[i].data.u64;
+            struct connection *conn;
+
+            if (tag < LISTENER_MAX) {
+                listener_accept(svc, &svc->listeners[tag]);
+                continue;
+            }
+
+            conn = &svc->connections[tag - LISTENER_MAX];
+            if (conn->fd < 0)
+                continue; /* closed earlier in this batch */
+
+            if (events[i].events & EPOLLOUT) {
+                int err = connection_send(conn);
+                if (err > 0)
+                    svc->completed++;
+                if (err != 0)
+                    connection_close(svc, conn);
+            } else if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                /* A half-close shows up as a zero-length read */
+                connection_recv(svc, conn);
+            }
+        }
+    }
+}
+
+/**
+ * Print a help message
+ */
+static void
+print_help(void)
+{
+    printf("wc2d -- word, line, and byte or character count service\n");
+    printf("use:\n wc2d [-c|-m][-lw] [--port=PORT] [--unix=PATH]\n");
+    printf("where:\n");
+    printf(" -c\tReply with the number of bytes.\n");
+    printf(" -l\tReply with the number of newlines.\n");
+    printf(" -m\tReply with the number of multibyte characters.\n");
+    printf(" -w\tReply with the number of words.\n");
+    printf(" --port=PORT\n\tListen for TCP connections on localhost.\n");
+    printf(" --unix=PATH\n\tListen for local connections on the socket PATH.\n");
+    printf(" --connections=N\n\tThe most connections at once (default 10000).\n");
+    printf("Clients send text, then shutdown(SHUT_WR), then read the counts.\n");
+    printf("If no options specified, -lwc will be used.\n");
+}
+
+/**
+ * Parse the command-line options in order to get the configuration
+ * for the program.
+ */
+static struct config
+read_command_line(int argc, char *argv[])
+{
+    struct config cfg;
+    int i;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.connection_max = 10000;
+
+    /* We set this as the errno so that 'perror()' will print a localized
+     * error message, whatever "Invalid argument" is in the user's local
+     * language */
+    errno = EINVAL;
+
+    for (i=1; i<argc; i++) {
+        size_t j;
+
+        if (argv[i][0] != '-' || argv[i][1] == '\0') {
+            perror(argv[i]);
+            exit(1);
+        }
+        if (argv[i][1] == '-') {
+            if (strcmp(argv[i], "--help") == 0) {
+                print_help();
+                exit(0);
+            } else if (strncmp(argv[i], "--port=", 7) == 0) {
+                cfg.port = strtoul(argv[i] + 7, NULL, 10);
+                if (cfg.port == 0 || cfg.port > 65535) {
+                    perror(argv[i]);
+                    exit(1);
+                }
+            } else if (strncmp(argv[i], "--unix=", 7) == 0) {
+                cfg.unix_name = argv[i] + 7;
+                if (cfg.unix_name[0] == '\0') {
+                    perror(argv[i]);
+                    exit(1);
+                }
+            } else if (strncmp(argv[i], "--connections=", 14) == 0) {
+                cfg.connection_max = strtoul(argv[i] + 14, NULL, 10);
+                if (cfg.connection_max == 0) {
+                    perror(argv[i]);
+                    exit(1);
+                }
+            } else {
+                perror(argv[i]);
+                exit(1);
+            }
+            continue;
+        }
+
+        for (j=1; argv[i][j]; j++) {
+            char c = argv[i][j];
+            switch (c) {
+            case 'c':
+                if (cfg.is_counting_chars) {
+                    perror("-c");
+                    exit(1);
+                }
+                cfg.is_counting_bytes++;
+                break;
+            case 'm':
+                if (cfg.is_counting_bytes) {
+                    perror("-m");
+                    exit(1);
+                }
+                cfg.is_counting_chars++;
+                break;
+            case 'l':
+                cfg.is_counting_lines++;
+                break;
+            case 'w':
+                cfg.is_counting_words++;
+                break;
+            default:
+                {
+                    char foo[3] = "-X";
+                    foo[1] = c;
+                    perror(foo);
+                    exit(1);
+                }
+            }
+        }
+    }
+
+    /* The default is '-lwc' */
+    if (cfg.is_counting_lines == 0
+        && cfg.is_counting_words == 0
+        && cfg.is_counting_bytes == 0
+        && cfg.is_counting_chars == 0) {
+        cfg.is_counting_lines = 1;
+        cfg.is_counting_words = 1;
+        cfg.is_counting_bytes = 1;
+    }
+
+    if (cfg.port == 0 && cfg.unix_name == NULL) {
+        fprintf(stderr, "wc2d: need --port or --unix to listen on\n");
+        exit(1);
+    }
+    return cfg;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct config cfg;
+    struct service *svc;
+    struct wc2_machine *machine;
+    struct sigaction sa;
+    unsigned i;
+
+    cfg = read_command_line(argc, argv);
+
+    setlocale(LC_ALL, "");
+    machine = wc2_machine_create(cfg.is_counting_chars, "");
+    if (machine == NULL)
+        machine = wc2_machine_create(cfg.is_counting_chars, "C");
+    if (machine == NULL) {
+        perror("locale");
+        return 1;
+    }
+
+    svc = calloc(1, sizeof(*svc));
+    if (svc == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    svc->cfg = &cfg;
+    svc->machine = machine;
+
+    /* All the connections are allocated up front, so that the memory
+     * used doesn't depend on the load */
+    svc->connections = calloc(cfg.connection_max, sizeof(svc->connections[0]));
+    if (svc->connections == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (i=cfg.connection_max; i>0; i--) {
+        struct connection *conn = &svc->connections[i - 1];
+        conn->fd = -1;
+        conn->next_free = svc->free_list;
+        svc->free_list = conn;
+    }
+
+    svc->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (svc->epfd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    if (cfg.port && listener_open(svc, cfg.port, NULL) != 0)
+        return 1;
+    if (cfg.unix_name && listener_open(svc, 0, cfg.unix_name) != 0)
+        return 1;
+
+    /* Stop cleanly on Ctrl-C, printing what we've done */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    service_run(svc);
+
+    fprintf(stderr, "wc2d: %llu connections, %llu completed, %llu rejected, %llu bytes\n",
+            svc->accepted, svc->completed, svc->rejected, svc->total_bytes);
+
+    for (i=0; i<svc->listener_count; i++)
+        close(svc->listeners[i].fd);
+    if (cfg.unix_name)
+        unlink(cfg.unix_name);
+    for (i=0; i<cfg.connection_max; i++) {
+        if (svc->connections[i].fd >= 0)
+            close(svc->connections[i].fd);
+    }
+    close(svc->epfd);
+    free(svc->connections);
+    free(svc);
+    wc2_machine_free(machine);
+    return 0;
+}
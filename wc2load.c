@@ -0,0 +1,529 @@
+/*
+    A load generator for 'wc2d', for benchmarking it with many
+    connections at once.
+
+    Every connection sends the same text, but cut into randomly sized
+    pieces, so that segments end in the middle of words and multibyte
+    characters. The reply is checked against the counts from 'libwc2',
+    which means the same options have to be given as for 'wc2d'.
+
+        $ ./wc2d -lwm --port=7777 &
+        $ ./wc2load -lwm --port=7777 --connections=100000 --concurrency=1000
+
+    Like 'wc2d', this uses 'epoll', so it's Linux only.
+*/
+#define _GNU_SOURCE
+#include "libwc2.h"
+#include <errno.h>
+#include <locale.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct config {
+    int is_counting_lines;
+    int is_counting_words;
+    int is_counting_bytes;
+    int is_counting_chars;
+    unsigned port;
+    const char *unix_name;
+    unsigned long long connection_count;
+    unsigned concurrency;
+    size_t size;
+    unsigned seed;
+};
+
+enum {
+    CLIENT_CONNECTING,
+    CLIENT_SENDING,
+    CLIENT_RECEIVING
+};
+
+/**
+ * A single client connection
+ */
+struct client {
+    int fd;
+    int state;
+    unsigned seed;
+    size_t offset;
+    unsigned reply_length;
+    char reply[96];
+};
+
+/**
+ * Everything shared by the clients
+ */
+struct load {
+    const struct config *cfg;
+    int epfd;
+    const unsigned char *text;
+    const char *expected;
+    unsigned long long started;
+    unsigned long long completed;
+    unsigned long long failed;
+    unsigned long long mismatched;
+    unsigned active;
+};
+
+static unsigned
+r_rand(unsigned *seed)
+{
+    static const unsigned a = 214013;
+    static const unsigned c = 2531011;
+
+    *seed = (*seed) * a + c;
+    return (*seed)>>16 & 0x7fff;
+}
+
+static double
+now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/**
+ * Generate text of words, spaces, newlines, and some multibyte
+ * characters, so that every counter has something to count.
+ */
+static void
+generate_text(unsigned char *buf, size_t size, unsigned seed)
+{
+    static const char *pieces[] = {
+        "a", "the", "word", "counting", " ", " ", "  ", "\t", "\n", "\r\n",
+        "\xC3\xA9", "\xE2\x82\xAC", "\xF0\x9F\x98\x80", "\xE3\x80\x80", "\xC2\xA0",
+    };
+    size_t offset = 0;
+
+    while (offset < size) {
+        const char *piece = pieces[r_rand(&seed) % (sizeof(pieces)/sizeof(pieces[0]))];
+        size_t length = strlen(piece);
+
+        if (length > size - offset)
+            length = size - offset;
+        memcpy(buf + offset, piece, length);
+        offset += length;
+    }
+}
+
+/**
+ * Format the counts the same way as 'wc2d' sends them
+ */
+static void
+format_results(char *buf, size_t sizeof_buf, const struct wc2_results *results, const struct config *cfg)
+{
+    int needs_space = 0;
+    size_t offset = 0;
+
+    if (cfg->is_counting_lines)
+        offset += snprintf(buf + offset, sizeof_buf - offset, "%s%lu", needs_space++?" ":"", results->line_count);
+    if (cfg->is_counting_words)
+        offset += snprintf(buf + offset, sizeof_buf - offset, "%s%lu", needs_space++?" ":"", results->word_count);
+    if (cfg->is_counting_bytes)
+        offset += snprintf(buf + offset, sizeof_buf - offset, "%s%lu", needs_space++?" ":"", results->byte_count);
+    if (cfg->is_counting_chars)
+        offset += snprintf(buf + offset, sizeof_buf - offset, "%s%lu", needs_space++?" ":"", results->char_count);
+    snprintf(buf + offset, sizeof_buf - offset, "\n");
+}
+
+/**
+ * Finish with a client, successfully or not
+ */
+static void
+client_close(struct load *load, struct client *client, int is_success)
+{
+    if (is_success) {
+        client->reply[client->reply_length] = '\0';
+        if (strcmp(client->reply, load->expected) == 0)
+            load->completed++;
+        else
+            load->mismatched++;
+    } else
+        load->failed++;
+    close(client->fd);
+    client->fd = -1;
+    load->active--;
+}
+
+/**
+ * Start a new connection for the client
+ */
+static int
+client_start(struct load *load, struct client *client)
+{
+    const struct config *cfg = load->cfg;
+    struct sockaddr_storage ss;
+    socklen_t sizeof_ss;
+    struct epoll_event ev;
+    int fd;
+    int err;
+
+    memset(&ss, 0, sizeof(ss));
+    if (cfg->unix_name) {
+        struct sockaddr_un *sun = (struct sockaddr_un *)&ss;
+        sun->sun_family = AF_UNIX;
+        snprintf(sun->sun_path, sizeof(sun->sun_path), "%s", cfg->unix_name);
+        sizeof_ss = sizeof(*sun);
+    } else {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons((unsigned short)cfg->port);
+        sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sizeof_ss = sizeof(*sin);
+    }
+
+    fd = socket(ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    client->fd = fd;
+    client->state = CLIENT_CONNECTING;
+    client->offset = 0;
+    client->reply_length = 0;
+    load->started++;
+    load->active++;
+
+    err = connect(fd, (struct sockaddr *)&ss, sizeof_ss);
+    if (err != 0 && errno != EINPROGRESS && errno != EAGAIN) {
+        client_close(load, client, 0);
+        return 0;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT;
+    ev.data.ptr = client;
+    if (epoll_ctl(load->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        perror("epoll_ctl");
+        client_close(load, client, 0);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Send the next few pieces of text. When it's all been sent, half-close
+ * the connection and wait for the reply.
+ */
+static void
+client_send(struct load *load, struct client *client)
+{
+    const struct config *cfg = load->cfg;
+
+    if (client->state == CLIENT_CONNECTING) {
+        int err = 0;
+        socklen_t sizeof_err = sizeof(err);
+
+        getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &err, &sizeof_err);
+        if (err != 0) {
+            client_close(load, client, 0);
+            return;
+        }
+        client->state = CLIENT_SENDING;
+    }
+
+    while (client->offset < cfg->size) {
+        size_t length = 1 + (r_rand(&client->seed) * 2 + (r_rand(&client->seed) & 1)) % 16384;
+        ssize_t count;
+
+        if (length > cfg->size - client->offset)
+            length = cfg->size - client->offset;
+        count = send(client->fd, load->text + client->offset, length, MSG_NOSIGNAL);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            client_close(load, client, 0);
+            return;
+        }
+        client->offset += (size_t)count;
+    }
+
+    if (client->state == CLIENT_SENDING) {
+        struct epoll_event ev;
+
+        shutdown(client->fd, SHUT_WR);
+        client->state = CLIENT_RECEIVING;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = client;
+        if (epoll_ctl(load->epfd, EPOLL_CTL_MOD, client->fd, &ev) != 0)
+            client_close(load, client, 0);
+    }
+}
+
+/**
+ * Read the reply, until the service closes the connection
+ */
+static void
+client_recv(struct load *load, struct client *client)
+{
+    for (;;) {
+        ssize_t count;
+
+        count = recv(client->fd, client->reply + client->reply_length,
+                     sizeof(client->reply) - 1 - client->reply_length, 0);
+        if (count > 0) {
+            client->reply_length += (unsigned)count;
+            if (client->reply_length >= sizeof(client->reply) - 1) {
+                client_close(load, client, 1);
+                return;
+            }
+            continue;
+        }
+        if (count == 0) {
+            client_close(load, client, 1);
+            return;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            client_close(load, client, 0);
+        return;
+    }
+}
+
+/**
+ * Keep 'concurrency' connections going until they've all been made
+ */
+static void
+load_run(struct load *load, struct client *clients)
+{
+    const struct config *cfg = load->cfg;
+    struct epoll_event events[256];
+    unsigned i;
+
+    for (i=0; i<cfg->concurrency && load->started < cfg->connection_count; i++) {
+        if (client_start(load, &clients[i]) != 0)
+            return;
+    }
+
+    while (load->active) {
+        int count;
+        int j;
+
+        count = epoll_wait(load->epfd, events, sizeof(events)/sizeof(events[0]), -1);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return;
+        }
+
+        for (j=0; j<count; j++) {
+            struct client *client = events[j].data.ptr;
+
+            if (client->fd < 0)
+                continue;
+            if (client->state == CLIENT_RECEIVING)
+                client_recv(load, client);
+            else
+                client_send(load, client);
+
+            /* Replace finished connections with new ones */
+            if (client->fd < 0 && load->started < cfg->connection_count) {
+                if (client_start(load, client) != 0)
+                    return;
+            }
+        }
+    }
+}
+
+/**
+ * Print a help message
+ */
+static void
+print_help(void)
+{
+    printf("wc2load -- load generator for wc2d\n");
+    printf("use:\n wc2load [-c|-m][-lw] [--port=PORT|--unix=PATH] [options]\n");
+    printf("where:\n");
+    printf(" -c -l -m -w\tThe same options that 'wc2d' was started with.\n");
+    printf(" --port=PORT\n\tConnect to TCP port on localhost.\n");
+    printf(" --unix=PATH\n\tConnect to the local socket PATH.\n");
+    printf(" --connections=N\n\tHow many connections to make in total (default 10000).\n");
+    printf(" --concurrency=N\n\tHow many connections at once (default 100).\n");
+    printf(" --size=BYTES\n\tHow much text to send on each connection (default 65536).\n");
+    printf(" --seed=N\n\tThe seed for the text and how it's cut up (default 0).\n");
+    printf("If no options specified, -lwc will be used.\n");
+}
+
+/**
+ * Parse the command-line options in order to get the configuration
+ * for the program.
+ */
+static struct config
+read_command_line(int argc, char *argv[])
+{
+    struct config cfg;
+    int i;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.connection_count = 10000;
+    cfg.concurrency = 100;
+    cfg.size = 65536;
+
+    /* We set this as the errno so that 'perror()' will print a localized
+     * error message, whatever "Invalid argument" is in the user's local
+     * language */
+    errno = EINVAL;
+
+    for (i=1; i<argc; i++) {
+        size_t j;
+
+        if (argv[i][0] != '-' || argv[i][1] == '\0') {
+            perror(argv[i]);
+            exit(1);
+        }
+        if (argv[i][1] == '-') {
+            if (strcmp(argv[i], "--help") == 0) {
+                print_help();
+                exit(0);
+            } else if (strncmp(argv[i], "--port=", 7) == 0) {
+                cfg.port = strtoul(argv[i] + 7, NULL, 10);
+                if (cfg.port == 0 || cfg.port > 65535) {
+                    perror(argv[i]);
+                    exit(1);
+                }
+            } else if (strncmp(argv[i], "--unix=", 7) == 0) {
+                cfg.unix_name = argv[i] + 7;
+            } else if (strncmp(argv[i], "--connections=", 14) == 0) {
+                cfg.connection_count = strtoull(argv[i] + 14, NULL, 10);
+            } else if (strncmp(argv[i], "--concurrency=", 14) == 0) {
+                cfg.concurrency = strtoul(argv[i] + 14, NULL, 10);
+                if (cfg.concurrency == 0) {
+                    perror(argv[i]);
+                    exit(1);
+                }
+            } else if (strncmp(argv[i], "--size=", 7) == 0) {
+                cfg.size = strtoull(argv[i] + 7, NULL, 10);
+            } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+                cfg.seed = strtoul(argv[i] + 7, NULL, 10);
+            } else {
+                perror(argv[i]);
+                exit(1);
+            }
+            continue;
+        }
+
+        for (j=1; argv[i][j]; j++) {
+            switch (argv[i][j]) {
+            case 'c': cfg.is_counting_bytes++; break;
+            case 'm': cfg.is_counting_chars++; break;
+            case 'l': cfg.is_counting_lines++; break;
+            case 'w': cfg.is_counting_words++; break;
+            default:
+                {
+                    char foo[3] = "-X";
+                    foo[1] = argv[i][j];
+                    perror(foo);
+                    exit(1);
+                }
+            }
+        }
+    }
+
+    /* The default is '-lwc' */
+    if (cfg.is_counting_lines == 0
+        && cfg.is_counting_words == 0
+        && cfg.is_counting_bytes == 0
+        && cfg.is_counting_chars == 0) {
+        cfg.is_counting_lines = 1;
+        cfg.is_counting_words = 1;
+        cfg.is_counting_bytes = 1;
+    }
+
+    if (cfg.port == 0 && cfg.unix_name == NULL) {
+        fprintf(stderr, "wc2load: need --port or --unix to connect to\n");
+        exit(1);
+    }
+    return cfg;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct config cfg;
+    struct load load;
+    struct client *clients;
+    struct wc2_machine *machine;
+    struct wc2_results results;
+    unsigned char *text;
+    char expected[96];
+    unsigned state = WC2_WASSPACE;
+    double start, elapsed;
+    unsigned i;
+
+    cfg = read_command_line(argc, argv);
+
+    /* The text is the same for every connection, so we only need to
+     * count it once, using the same locale as 'wc2d' */
+    setlocale(LC_ALL, "");
+    machine = wc2_machine_create(cfg.is_counting_chars, "");
+    if (machine == NULL)
+        machine = wc2_machine_create(cfg.is_counting_chars, "C");
+    if (machine == NULL) {
+        perror("locale");
+        return 1;
+    }
+    text = malloc(cfg.size + 1);
+    if (text == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    generate_text(text, cfg.size, cfg.seed);
+    results = wc2_parse(machine, text, cfg.size, &state);
+    format_results(expected, sizeof(expected), &results, &cfg);
+
+    clients = calloc(cfg.concurrency, sizeof(clients[0]));
+    if (clients == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (i=0; i<cfg.concurrency; i++) {
+        clients[i].fd = -1;
+        clients[i].seed = cfg.seed + i;
+    }
+
+    memset(&load, 0, sizeof(load));
+    load.cfg = &cfg;
+    load.text = text;
+    load.expected = expected;
+    load.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (load.epfd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    start = now_seconds();
+    load_run(&load, clients);
+    elapsed = now_seconds() - start;
+
+    printf("connections = %llu\n", load.completed + load.failed + load.mismatched);
+    printf("completed   = %llu\n", load.completed);
+    printf("failed      = %llu\n", load.failed);
+    printf("mismatched  = %llu\n", load.mismatched);
+    printf("elapsed     = %.3f seconds\n", elapsed);
+    if (elapsed > 0) {
+        printf("rate        = %.0f connections/second\n", load.completed / elapsed);
+        printf("throughput  = %.1f MB/second\n", load.completed * (double)cfg.size / elapsed / 1000000.0);
+    }
+
+    close(load.epfd);
+    free(clients);
+    free(text);
+    wc2_machine_free(machine);
+    return (load.failed || load.mismatched) ? 1 : 0;
+}
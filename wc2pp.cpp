@@ -0,0 +1,196 @@
+/*
+    The 'wc' program again, using the header-only C++ engine in 'wc2.hpp'
+    instead of 'libwc2.c'. The output is the same as 'wc2' for the
+    same options, which is how we check that the two engines agree.
+*/
+#include "wc2.hpp"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/stat.h>
+
+namespace {
+
+struct config {
+    unsigned counters = 0;
+    bool is_multibyte = false;
+    unsigned column_width = 0;
+};
+
+/**
+ * Count a file with the engine specialized for the given counters.
+ */
+template <unsigned Counters, typename Machine>
+wc2::results
+count_file(std::FILE *fp, const Machine &machine)
+{
+    wc2::engine<Counters, Machine> e(machine);
+    std::vector<unsigned char> buf(65536);
+
+    for (;;) {
+        std::size_t count = std::fread(buf.data(), 1, buf.size(), fp);
+        if (count == 0)
+            break;
+        e.feed(buf.data(), buf.data() + count);
+    }
+    return e.finish();
+}
+
+/**
+ * The counters are chosen at runtime from the command-line, so we
+ * make a table of all the specializations to choose from.
+ */
+template <typename Machine, std::size_t... N>
+constexpr auto
+make_dispatch(std::index_sequence<N...>)
+{
+    return std::array<wc2::results (*)(std::FILE *, const Machine &), sizeof...(N)>{&count_file<N, Machine>...};
+}
+
+wc2::results
+count_file(std::FILE *fp, const config &cfg, const wc2::utf8_machine &utf8)
+{
+    static constexpr auto ascii_dispatch = make_dispatch<wc2::ascii_machine>(std::make_index_sequence<16>());
+    static constexpr auto utf8_dispatch = make_dispatch<wc2::utf8_machine>(std::make_index_sequence<16>());
+
+    if (cfg.is_multibyte)
+        return utf8_dispatch[cfg.counters](fp, utf8);
+    else
+        return ascii_dispatch[cfg.counters](fp, wc2::ascii);
+}
+
+/**
+ * Print the results the same way as 'print_results()' in 'wc2.c'
+ */
+void
+print_results(const char *filename, const wc2::results &r, const config &cfg)
+{
+    std::string line;
+    char buf[64];
+
+    auto field = [&](unsigned long long value) {
+        std::snprintf(buf, sizeof(buf), "%s%*llu", line.empty() ? "" : " ", cfg.column_width, value);
+        line += buf;
+    };
+    if (cfg.counters & wc2::lines)
+        field(r.line_count);
+    if (cfg.counters & wc2::words)
+        field(r.word_count);
+    if (cfg.counters & wc2::bytes)
+        field(r.byte_count);
+    if (cfg.counters & wc2::chars)
+        field(r.char_count);
+    if (filename) {
+        if (!line.empty())
+            line += " ";
+        line += filename;
+    }
+    std::printf("%s\n", line.c_str());
+}
+
+/**
+ * The same column width calculation as 'get_column_width()' in 'wc2.c'
+ */
+unsigned
+get_column_width(const std::vector<const char *> &filenames, bool is_stdin)
+{
+    long long maxsize = 1;
+    unsigned width = 0;
+
+    for (const char *filename : filenames) {
+        struct stat st;
+        if (stat(filename, &st) == 0) {
+            if (S_ISREG(st.st_mode))
+                maxsize = std::max<long long>(maxsize, st.st_size);
+            else
+                maxsize = std::max<long long>(maxsize, 1000000);
+        }
+    }
+    if (is_stdin)
+        maxsize = std::max<long long>(maxsize, 1000000);
+    for (; maxsize; maxsize /= 10)
+        width++;
+    return width;
+}
+
+} /* anonymous namespace */
+
+int
+main(int argc, char *argv[])
+{
+    config cfg;
+    std::vector<const char *> filenames;
+    bool is_stdin = false;
+    wc2::results totals;
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-') {
+            filenames.push_back(argv[i]);
+            continue;
+        }
+        if (argv[i][1] == '\0') {
+            is_stdin = true;
+            continue;
+        }
+        for (const char *p = argv[i] + 1; *p; p++) {
+            switch (*p) {
+            case 'l': cfg.counters |= wc2::lines; break;
+            case 'w': cfg.counters |= wc2::words; break;
+            case 'c': cfg.counters |= wc2::bytes; break;
+            case 'm': cfg.counters |= wc2::chars; cfg.is_multibyte = true; break;
+            default:
+                std::fprintf(stderr, "-%c: Invalid argument\n", *p);
+                return 1;
+            }
+        }
+    }
+    if ((cfg.counters & wc2::bytes) && (cfg.counters & wc2::chars)) {
+        std::fprintf(stderr, "-m: Invalid argument\n");
+        return 1;
+    }
+    if (cfg.counters == 0)
+        cfg.counters = wc2::lines | wc2::words | wc2::bytes;
+    if (filenames.empty())
+        is_stdin = true;
+    cfg.column_width = filenames.empty() ? 1 : get_column_width(filenames, is_stdin);
+
+    /* The UTF-8 machine for the user's locale, built at runtime */
+    setlocale(LC_ALL, "");
+    wc2::utf8_machine utf8 = wc2::utf8;
+    if (cfg.is_multibyte) {
+        try {
+            utf8 = wc2::utf8_machine::from_locale("");
+        } catch (const std::exception &) {
+        }
+    }
+
+    for (const char *filename : filenames) {
+        std::FILE *fp = std::fopen(filename, "rb");
+        if (fp == nullptr) {
+            std::perror(filename);
+            continue;
+        }
+        wc2::results r = count_file(fp, cfg, utf8);
+        print_results(filename, r, cfg);
+        totals.line_count += r.line_count;
+        totals.word_count += r.word_count;
+        totals.char_count += r.char_count;
+        totals.byte_count += r.byte_count;
+        std::fclose(fp);
+    }
+    if (is_stdin) {
+        std::FILE *fp = std::freopen(nullptr, "rb", stdin);
+        wc2::results r = count_file(fp ? fp : stdin, cfg, utf8);
+        print_results(nullptr, r, cfg);
+        totals.line_count += r.line_count;
+        totals.word_count += r.word_count;
+        totals.char_count += r.char_count;
+        totals.byte_count += r.byte_count;
+    }
+    if (filenames.size() > 1 || (!filenames.empty() && is_stdin))
+        print_results("total", totals, cfg);
+    return 0;
+}
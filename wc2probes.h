@@ -0,0 +1,49 @@
+/*
+    Static tracepoints (USDT probes) in 'wc2', for watching a running
+    program with 'perf', 'bpftrace', or SystemTap, without rebuilding
+    or restarting it.
+
+    When built where <sys/sdt.h> exists (the 'systemtap-sdt-dev' or
+    'systemtap-sdt-devel' package), each probe is a single 'nop'
+    instruction, plus a note in the ELF file saying where it is and
+    where to find its arguments. Nothing happens unless a tracer
+    attaches, which replaces the 'nop' with a breakpoint. Elsewhere,
+    the probes compile to nothing at all.
+
+    The probes, all in the provider 'wc2':
+
+        file__open(filename)            filename is NULL for <stdin>
+        file__close(filename, bytes)
+        read__start(requested)
+        read__done(count)               the latency is from read__start
+        parse__start(length, state)
+        parse__done(length, state)      the state at the end of the chunk
+
+    For example, a histogram of how long reads take:
+
+        $ sudo bpftrace -e '
+            usdt:./wc2:wc2:read__start { @start[tid] = nsecs; }
+            usdt:./wc2:wc2:read__done /@start[tid]/ {
+                @usecs = hist((nsecs - @start[tid]) / 1000); delete(@start[tid]); }'
+
+    or list them with 'perf list sdt_wc2:*' after 'perf buildid-cache --add ./wc2'.
+*/
+#ifndef WC2PROBES_H
+#define WC2PROBES_H
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define WC2_HAS_SDT 1
+#endif
+#endif
+
+#if defined(WC2_HAS_SDT) && !defined(WC2_NO_PROBES)
+#include <sys/sdt.h>
+#define WC2_PROBE1(name, a)     DTRACE_PROBE1(wc2, name, a)
+#define WC2_PROBE2(name, a, b)  DTRACE_PROBE2(wc2, name, a, b)
+#else
+#define WC2_PROBE1(name, a)     do {} while (0)
+#define WC2_PROBE2(name, a, b)  do {} while (0)
+#endif
+
+#endif
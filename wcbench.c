@@ -0,0 +1,421 @@
+/*
+    Microbenchmarks for the counting engines in 'libwc2'.
+
+    The 'bench-*.sh' scripts time the whole 'wc2' program, which
+    includes starting the process, reading the file, and compiling the
+    state-machine. This instead generates the text in memory, with the
+    same generators as 'wctool', and times only the calls to each
+    engine, after a first call to warm the caches.
+
+        $ ./wcbench --size=16777216 --repeat=20 > results.json
+
+    Each line of output is a JSON object for one engine, counting one
+    kind of text, either bytes (-c) or characters (-m). Where the kernel
+    allows it ('perf_event_paranoid' of 2 or less), 'perf_event_open()'
+    also gives the cycles, instructions, branch-misses, and L1 data
+    cache misses. Otherwise, on x86 the cycles come from the timestamp
+    counter, which ticks at a fixed rate rather than the CPU's current
+    clock, so only compare those on the same machine.
+*/
+#define _GNU_SOURCE
+#include "libwc2.h"
+#include "wcgen.h"
+#include <errno.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAS_TSC 1
+#endif
+
+struct config {
+    size_t size;
+    unsigned repeat;
+    unsigned seed;
+    const char *engine_name;
+    const char *profile_name;
+    int is_counting_bytes;
+    int is_counting_chars;
+};
+
+/**
+ * The hardware counters we ask for. Any of these may not be available,
+ * such as inside virtual machines, in which case it's left out.
+ */
+enum {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_L1D_MISSES,
+    COUNTER_MAX
+};
+
+static const char *counter_names[COUNTER_MAX] = {
+    "cycles", "instructions", "branch_misses", "l1d_misses"
+};
+
+struct counters {
+    int fd[COUNTER_MAX];
+    unsigned long long value[COUNTER_MAX];
+};
+
+#ifdef __linux__
+static int
+counter_open(unsigned type, unsigned long long config)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+static void
+counters_open(struct counters *c)
+{
+    size_t i;
+
+    for (i=0; i<COUNTER_MAX; i++)
+        c->fd[i] = -1;
+#ifdef __linux__
+    c->fd[COUNTER_CYCLES] = counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    c->fd[COUNTER_INSTRUCTIONS] = counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    c->fd[COUNTER_BRANCH_MISSES] = counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    c->fd[COUNTER_L1D_MISSES] = counter_open(PERF_TYPE_HW_CACHE,
+                                             PERF_COUNT_HW_CACHE_L1D
+                                             | PERF_COUNT_HW_CACHE_OP_READ << 8
+                                             | PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+#endif
+}
+
+static void
+counters_start(struct counters *c)
+{
+#ifdef __linux__
+    size_t i;
+
+    for (i=0; i<COUNTER_MAX; i++) {
+        if (c->fd[i] >= 0) {
+            ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#else
+    (void)c;
+#endif
+}
+
+static void
+counters_stop(struct counters *c)
+{
+    size_t i;
+
+    for (i=0; i<COUNTER_MAX; i++) {
+        c->value[i] = 0;
+#ifdef __linux__
+        if (c->fd[i] >= 0) {
+            ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(c->fd[i], &c->value[i], sizeof(c->value[i])) != sizeof(c->value[i]))
+                c->value[i] = 0;
+        }
+#endif
+    }
+}
+
+static unsigned long long
+now_nsecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+compare_u64(const void *lhs, const void *rhs)
+{
+    unsigned long long a = *(const unsigned long long *)lhs;
+    unsigned long long b = *(const unsigned long long *)rhs;
+    return (a > b) - (a < b);
+}
+
+/**
+ * Time one engine on one buffer, and print the results as a line of
+ * JSON. The counts are checked against the default engine, since a
+ * fast engine that gets the wrong answer isn't interesting. They can
+ * legitimately differ for 'mbrtowc' in the "C" locale, where it
+ * doesn't decode UTF-8 at all.
+ */
+static void
+bench_engine(const struct wc2_engine *engine, const struct wc2_machine *machine, const char *mode,
+             const char *profile, const unsigned char *buf, size_t length,
+             const struct wc2_results *expected, struct counters *c, const struct config *cfg)
+{
+    unsigned long long *elapsed;
+    unsigned long long total[COUNTER_MAX];
+    unsigned long long tsc = 0;
+    unsigned long long cycles;
+    const char *cycles_source = NULL;
+    struct wc2_results results;
+    unsigned state = 0;
+    int is_matching;
+    double median;
+    unsigned i;
+    size_t j;
+
+    elapsed = malloc(cfg->repeat * sizeof(elapsed[0]));
+    if (elapsed == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(total, 0, sizeof(total));
+
+    /* Warm up the caches and branch predictors, and check it's right */
+    results = engine->parse(machine, buf, length, &state);
+    is_matching = results.line_count == expected->line_count
+                  && results.word_count == expected->word_count
+                  && results.char_count == expected->char_count;
+
+    for (i=0; i<cfg->repeat; i++) {
+        unsigned long long start;
+#ifdef HAS_TSC
+        unsigned long long tsc_start;
+#endif
+
+        state = 0;
+        counters_start(c);
+        start = now_nsecs();
+#ifdef HAS_TSC
+        tsc_start = __rdtsc();
+#endif
+        engine->parse(machine, buf, length, &state);
+#ifdef HAS_TSC
+        tsc += __rdtsc() - tsc_start;
+#endif
+        elapsed[i] = now_nsecs() - start;
+        counters_stop(c);
+        for (j=0; j<COUNTER_MAX; j++)
+            total[j] += c->value[j];
+    }
+    qsort(elapsed, cfg->repeat, sizeof(elapsed[0]), compare_u64);
+    median = (cfg->repeat & 1) ? elapsed[cfg->repeat/2]
+                               : (elapsed[cfg->repeat/2 - 1] + elapsed[cfg->repeat/2]) / 2.0;
+
+    /* Prefer the real cycles from the CPU to the timestamp counter */
+    if (c->fd[COUNTER_CYCLES] >= 0 && total[COUNTER_CYCLES]) {
+        cycles = total[COUNTER_CYCLES];
+        cycles_source = "perf";
+    } else {
+        cycles = tsc;
+        if (tsc)
+            cycles_source = "tsc";
+    }
+
+    printf("{\"engine\":\"%s\",\"mode\":\"%s\",\"profile\":\"%s\",\"bytes\":%lu,\"repeat\":%u,",
+           engine->name, mode, profile, (unsigned long)length, cfg->repeat);
+    printf("\"matches\":%s,", is_matching ? "true" : "false");
+    printf("\"ns_min\":%llu,\"ns_median\":%.0f,\"gb_per_sec\":%.3f,",
+           elapsed[0], median, median ? length / median : 0.0);
+    if (cycles_source) {
+        printf("\"cycles_source\":\"%s\",\"bytes_per_cycle\":%.4f,",
+               cycles_source, (double)length * cfg->repeat / cycles);
+    } else
+        printf("\"cycles_source\":null,\"bytes_per_cycle\":null,");
+    for (j=0; j<COUNTER_MAX; j++) {
+        if (c->fd[j] >= 0)
+            printf("\"%s\":%llu,", counter_names[j], total[j] / cfg->repeat);
+        else
+            printf("\"%s\":null,", counter_names[j]);
+    }
+#ifdef __VERSION__
+    printf("\"compiler\":\"%s\"}\n", __VERSION__);
+#else
+    printf("\"compiler\":null}\n");
+#endif
+    fflush(stdout);
+    free(elapsed);
+}
+
+/**
+ * Time all the engines that can count with this machine, over all the
+ * kinds of text.
+ */
+static void
+bench_machine(const struct wc2_machine *machine, const char *mode, unsigned char *buf,
+              struct counters *c, const struct config *cfg)
+{
+    const struct wcgen_profile *profile;
+    size_t i;
+
+    for (i=0; (profile = wcgen_at(i)) != NULL; i++) {
+        const struct wc2_engine *engine;
+        struct wc2_results expected;
+        struct wcgen_state gen;
+        unsigned state = 0;
+        size_t j;
+
+        if (cfg->profile_name && strcmp(cfg->profile_name, profile->name) != 0)
+            continue;
+
+        wcgen_init(&gen, cfg->seed, NULL);
+        profile->generate(buf, cfg->size, &gen);
+        expected = wc2_parse(machine, buf, cfg->size, &state);
+
+        for (j=0; (engine = wc2_engine_at(j)) != NULL; j++) {
+            if (cfg->engine_name && strcmp(cfg->engine_name, engine->name) != 0)
+                continue;
+            if (!wc2_engine_is_usable(engine, machine))
+                continue;
+            bench_engine(engine, machine, mode, profile->name, buf, cfg->size, &expected, c, cfg);
+        }
+    }
+}
+
+static void
+print_help(void)
+{
+    const struct wcgen_profile *profile;
+    size_t i;
+
+    printf("wcbench -- time the counting engines on text in memory\n");
+    printf("use:\n wcbench [-c|-m] [--engine=NAME] [--profile=NAME] [--size=N] [--repeat=N] [--seed=N]\n");
+    printf("where:\n");
+    printf(" -c\tOnly count bytes.\n");
+    printf(" -m\tOnly count multibyte characters, in the locale from the environment.\n");
+    printf(" --engine=NAME\n\tOnly time this engine (see 'wc2 --engine=list').\n");
+    printf(" --profile=NAME\n\tOnly time on this kind of text, one of:\n");
+    for (i=0; (profile = wcgen_at(i)) != NULL; i++)
+        printf("\t%-10s %s\n", profile->name, profile->description);
+    printf(" --size=N\n\tBytes of text (default 16777216).\n");
+    printf(" --repeat=N\n\tTimes to run each engine after warming up (default 10).\n");
+    printf(" --seed=N\n\tFor generating the text (default 0).\n");
+}
+
+static struct config
+read_command_line(int argc, char *argv[])
+{
+    struct config cfg;
+    int i;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.size = 16 * 1024 * 1024;
+    cfg.repeat = 10;
+
+    errno = EINVAL;
+
+    for (i=1; i<argc; i++) {
+        size_t j;
+
+        if (argv[i][0] != '-' || argv[i][1] == '\0') {
+            perror(argv[i]);
+            exit(1);
+        }
+        if (argv[i][1] == '-') {
+            if (strcmp(argv[i], "--help") == 0) {
+                print_help();
+                exit(0);
+            } else if (strncmp(argv[i], "--engine=", 9) == 0) {
+                cfg.engine_name = argv[i] + 9;
+                if (wc2_engine_find(cfg.engine_name) == NULL) {
+                    perror(argv[i]);
+                    exit(1);
+                }
+            } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+                cfg.profile_name = argv[i] + 10;
+                if (wcgen_find(cfg.profile_name) == NULL) {
+                    perror(argv[i]);
+                    exit(1);
+                }
+            } else if (strncmp(argv[i], "--size=", 7) == 0) {
+                cfg.size = strtoull(argv[i] + 7, NULL, 10);
+                if (cfg.size == 0) {
+                    perror(argv[i]);
+                    exit(1);
+                }
+            } else if (strncmp(argv[i], "--repeat=", 9) == 0) {
+                cfg.repeat = strtoul(argv[i] + 9, NULL, 10);
+                if (cfg.repeat == 0) {
+                    perror(argv[i]);
+                    exit(1);
+                }
+            } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+                cfg.seed = strtoul(argv[i] + 7, NULL, 10);
+            } else {
+                perror(argv[i]);
+                exit(1);
+            }
+            continue;
+        }
+
+        for (j=1; argv[i][j]; j++) {
+            switch (argv[i][j]) {
+            case 'c': cfg.is_counting_bytes++; break;
+            case 'm': cfg.is_counting_chars++; break;
+            default:
+                {
+                    char foo[3] = "-X";
+                    foo[1] = argv[i][j];
+                    perror(foo);
+                    exit(1);
+                }
+            }
+        }
+    }
+
+    /* The default is both */
+    if (cfg.is_counting_bytes == 0 && cfg.is_counting_chars == 0) {
+        cfg.is_counting_bytes = 1;
+        cfg.is_counting_chars = 1;
+    }
+    return cfg;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct config cfg;
+    struct counters counters;
+    unsigned char *buf;
+
+    cfg = read_command_line(argc, argv);
+
+    setlocale(LC_ALL, "");
+    buf = malloc(cfg.size + WCGEN_SLACK);
+    if (buf == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    counters_open(&counters);
+
+    if (cfg.is_counting_bytes) {
+        struct wc2_machine *machine = wc2_machine_create(0, "");
+        if (machine == NULL)
+            machine = wc2_machine_create(0, "C");
+        bench_machine(machine, "c", buf, &counters, &cfg);
+        wc2_machine_free(machine);
+    }
+    if (cfg.is_counting_chars) {
+        struct wc2_machine *machine = wc2_machine_create(1, "");
+        if (machine == NULL)
+            machine = wc2_machine_create(1, "C");
+        bench_machine(machine, "m", buf, &counters, &cfg);
+        wc2_machine_free(machine);
+    }
+
+    free(buf);
+    return 0;
+}
@@ -1,6 +1,22 @@
 /* Compares the output of two 'wc' programs and where they differ. It
  * searches for the shortest string that will result in a difference
- * between the programs. */
+ * between the programs.
+ *
+ * Instead of programs, it can compare two of the engines in 'libwc2',
+ * called directly on buffers in memory, which is fast enough to search
+ * the text from thousands of seeds:
+ *
+ *      $ ./wcdiff --engine=index --engine=mbrtowc -m --seeds=10000
+ *
+ * The searches only find a substring. With '--ddmin', that's then
+ * minimised further by delta debugging, which removes any bytes that
+ * aren't needed for the difference, trying several candidates at once
+ * on separate threads. With '--options=all', programs are compared
+ * with every combination of -l, -w, -c, and -m.
+ */
+#define _GNU_SOURCE
+#include "libwc2.h"
+#include "wcgen.h"
 #include <stdio.h>
 #include <sys/stat.h>
 #include <string.h>
@@ -11,6 +27,7 @@
 #include <ctype.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <pthread.h>
 
 /**
  * Tests the filename to make sure it exists
@@ -51,6 +68,29 @@ struct handles
     int child_stderr;
 };
 
+/**
+ * Create a pipe that isn't inherited by child processes
+ */
+static int
+make_pipe(int fds[2])
+{
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC);
+#else
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    int err;
+
+    pthread_mutex_lock(&lock);
+    err = pipe(fds);
+    if (err == 0) {
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    }
+    pthread_mutex_unlock(&lock);
+    return err;
+#endif
+}
+
 struct handles
 my_spawn(const char *progname, const char *parms)
 {
@@ -60,34 +100,31 @@ my_spawn(const char *progname, const char *parms)
     int pipe_stdin[2];
     struct handles handles = {0,0,0};
     int err;
-    char **new_argv;
+    char *new_argv[3];
 
 
-    err = pipe(pipe_stdout);
+    /* Configure the pipes be be non-inheritable. In other words, none
+     * of the children can read from these pipes, nor will they exist
+     * in child process space, except where they are dup'd to the
+     * child's stdin/stdout/stderr. This matters when several threads
+     * are spawning children at once, since otherwise one child could
+     * hold open the stdin of another, which would then never end. */
+    err = make_pipe(pipe_stdout);
     if (err < 0) {
         fprintf(stderr, "[-] pipe(): %s\n", strerror(errno));
         return handles;
     }
-    err = pipe(pipe_stderr);
+    err = make_pipe(pipe_stderr);
     if (err < 0) {
         fprintf(stderr, "[-] pipe(): %s\n", strerror(errno));
         return handles;
     }
-    err = pipe(pipe_stdin);
+    err = make_pipe(pipe_stdin);
     if (err < 0) {
         fprintf(stderr, "[-] pipe(): %s\n", strerror(errno));
         return handles;
     }
 
-
-
-    /* Configure the parent end of the pipes be be non-inheritable.
-     * In other words, none of the children can read from these
-     * pipes, nor will they exist in child process space */
-    /*fcntl(pipe_stdout[0], F_SETFD, FD_CLOEXEC);
-    fcntl(pipe_stderr[0], F_SETFD, FD_CLOEXEC);
-    fcntl(pipe_stdin[0], F_SETFD, FD_CLOEXEC);*/
-
     pid = fork();
     if (pid == -1) {
         fprintf(stderr, "[-] fork(): %s\n", strerror(errno));
@@ -95,19 +132,13 @@ my_spawn(const char *progname, const char *parms)
     }
 
     /* Setup child parameters */
-    new_argv = malloc(10 * sizeof(char*));
     new_argv[0] = (char *)progname;
     new_argv[1] = (char *)parms;
     new_argv[2] = NULL;
-    new_argv[3] = NULL;
 
     if (pid == 0) {
         int err;
 
-        close(pipe_stdin[1]);
-        close(pipe_stdout[0]);
-        close(pipe_stderr[0]);
-
         dup2(pipe_stdin[0], 0);
         dup2(pipe_stdout[1], 1);
         dup2(pipe_stderr[1], 2);
@@ -116,7 +147,7 @@ my_spawn(const char *progname, const char *parms)
         err = execvp(progname, new_argv);
         if (err) {
             fprintf(stderr, "[+] execvp(%s) failed: %s\n", progname, strerror(errno));
-            return handles;
+            _exit(127);
         }
 
     } else {
@@ -134,25 +165,32 @@ my_spawn(const char *progname, const char *parms)
     return handles;
 }
 
+/**
+ * The numbers printed by a 'wc' program, in the order it prints them,
+ * or the lines, words, characters, and bytes counted by an engine.
+ */
+enum {MAX_COUNTS = 4};
 struct wcresults {
-    long line_count;
-    long word_count;
-    long char_count;
+    long counts[MAX_COUNTS];
+    unsigned count;
 };
 
+/**
+ * Parse the next integer from the output, moving past it.
+ */
 static long
-get_integer(int fd)
+get_integer(const char **p)
 {
     int state = 0;
     long result = -1;
 
     for (;;) {
-        char c;
-        int count;
+        char c = *(*p)++;
 
-        count = read(fd, &c, 1);
-        if (count <= 0)
-            return -1;
+        if (c == '\0') {
+            (*p)--;
+            return state ? result : -1;
+        }
 
         switch (state) {
         case 0:
@@ -179,15 +217,32 @@ get_integer(int fd)
 }
 /**
  * Read the results, which are a series of integers from the
- * 'wc' program. */
+ * 'wc' program. The output is read all at once, rather than a
+ * byte at a time, since it's only a line. */
 struct wcresults
 get_results(int fd)
 {
     struct wcresults results;
+    char buf[1024];
+    const char *p = buf;
+    size_t length = 0;
+
+    for (;;) {
+        ssize_t count = read(fd, buf + length, sizeof(buf) - 1 - length);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            break;
+        length += (size_t)count;
+    }
+    buf[length] = '\0';
 
-    results.line_count = get_integer(fd);
-    results.word_count = get_integer(fd);
-    results.char_count = get_integer(fd);
+    for (results.count=0; results.count<MAX_COUNTS; results.count++) {
+        long n = get_integer(&p);
+        if (n == -1)
+            break;
+        results.counts[results.count] = n;
+    }
 
     return results;
 }
@@ -243,27 +298,30 @@ cleanup_children(void)
     return 0;
 }
 
-long
-word_count(const char *progname, const char *parms, const unsigned char *buf, size_t length)
+/**
+ * Run a 'wc' program with the buffer as its input.
+ */
+static struct wcresults
+run_program(const char *progname, const char *parms, const unsigned char *buf, size_t length)
 {
     struct handles h;
     size_t offset = 0;
-    struct wcresults results;
+    struct wcresults results = {{0}, 0};
 
 
     h = my_spawn(progname, parms);
     if (h.child_stdin <= 0 || h.child_stdout <= 0) {
         fprintf(stderr, "[-] spawn failed\n");
-        return -1;
+        return results;
     }
 
     /* keep writing until we've written the entire chunk */
     while (offset < length) {
-        size_t count;
+        ssize_t count;
         count = write(h.child_stdin, buf+offset, length-offset);
-        if (count == 0) {
-            perror("write()");
-            exit(1);
+        if (count <= 0) {
+            /* the program quit without reading everything */
+            break;
         }
         offset += count;
     }
@@ -278,9 +336,243 @@ word_count(const char *progname, const char *parms, const unsigned char *buf, si
     close(h.child_stderr);
     cleanup_children();
 
-    return results.word_count;
+    return results;
 }
 
+/**
+ * One way of comparing the two, which is either the options to run
+ * both programs with, or the machine for both engines to count with.
+ */
+struct check {
+    const char *parms[2];
+    const struct wc2_machine *machine;
+    const char *name;
+};
+
+enum {MAX_CHECKS = 16};
+
+/**
+ * The two things being compared, which are either two programs, run
+ * once for every probe, or two engines, called in this process.
+ */
+struct target {
+    const char *name[2];
+    const struct wc2_engine *engine[2];
+    struct check checks[MAX_CHECKS];
+    size_t check_count;
+    int is_ddmin;
+    unsigned thread_count;
+};
+
+static struct wcresults
+word_count(const struct target *t, const struct check *c, int which, const unsigned char *buf, size_t length)
+{
+    struct wcresults results;
+
+    if (t->engine[which]) {
+        unsigned state = 0;
+        struct wc2_results x = t->engine[which]->parse(c->machine, buf, length, &state);
+        results.counts[0] = (long)x.line_count;
+        results.counts[1] = (long)x.word_count;
+        results.counts[2] = (long)x.char_count;
+        results.counts[3] = (long)x.byte_count;
+        results.count = 4;
+    } else
+        results = run_program(t->name[which], c->parms[which], buf, length);
+    return results;
+}
+
+/**
+ * Whether the two give different counts for the buffer, with any of
+ * the checks, returning which one plus one, or 0 if they're the same.
+ * If one of the programs failed, then that's reported as the same,
+ * since the failure is not what we are searching for.
+ */
+static size_t
+is_different(const struct target *t, const unsigned char *buf, size_t length,
+             struct wcresults *x, struct wcresults *y)
+{
+    size_t i;
+
+    for (i=0; i<t->check_count; i++) {
+        *x = word_count(t, &t->checks[i], 0, buf, length);
+        *y = word_count(t, &t->checks[i], 1, buf, length);
+        if (x->count == 0 || y->count == 0)
+            continue;
+        if (x->count != y->count || memcmp(x->counts, y->counts, x->count * sizeof(x->counts[0])) != 0)
+            return i + 1;
+    }
+    return 0;
+}
+
+/**
+ * Build candidate 'i' of a round of ddmin with 'n' pieces into 'out':
+ * the first 'n' are each piece on its own, the rest everything except
+ * one piece. Returns its length.
+ */
+static size_t
+make_candidate(const unsigned char *buf, size_t length, size_t n, size_t i, unsigned char *out)
+{
+    size_t piece = (i < n) ? i : i - n;
+    size_t start = piece * length / n;
+    size_t end = (piece + 1) * length / n;
+
+    if (i < n) {
+        memcpy(out, buf + start, end - start);
+        return end - start;
+    }
+    memcpy(out, buf, start);
+    memcpy(out + start, buf + end, length - end);
+    return length - (end - start);
+}
+
+/**
+ * Trying several candidate inputs at once, each on its own thread,
+ * to see which of them still show a difference. Each thread builds
+ * the candidates it tests in its own buffer, so that the memory needed
+ * doesn't grow with the number of candidates.
+ */
+struct candidates {
+    const struct target *t;
+    const unsigned char *buf;
+    size_t length;
+    size_t n;
+    int *results;
+    size_t first;
+    size_t count;
+    size_t next;
+    pthread_mutex_t lock;
+};
+
+static void *
+candidate_thread(void *arg)
+{
+    struct candidates *c = (struct candidates *)arg;
+    unsigned char *candidate;
+
+    candidate = malloc(c->length ? c->length : 1);
+    if (candidate == NULL)
+        abort();
+
+    for (;;) {
+        struct wcresults x, y;
+        size_t candidate_length;
+        size_t i;
+
+        pthread_mutex_lock(&c->lock);
+        i = c->next++;
+        pthread_mutex_unlock(&c->lock);
+        if (i >= c->count)
+            break;
+        candidate_length = make_candidate(c->buf, c->length, c->n, c->first + i, candidate);
+        c->results[i] = is_different(c->t, candidate, candidate_length, &x, &y) != 0;
+    }
+    free(candidate);
+    return NULL;
+}
+
+/**
+ * Test the 'count' candidates for a round with 'n' pieces, returning
+ * the index of the first that still shows a difference, or 'count' if
+ * none do. All are tested, in waves of 'thread_count' at a time, so the
+ * answer is the same however many threads there are.
+ */
+static size_t
+test_candidates(const struct target *t, const unsigned char *buf, size_t length, size_t n, size_t count,
+                unsigned thread_count)
+{
+    pthread_t threads[256];
+    struct candidates c;
+    int *results;
+    size_t start;
+    size_t i;
+
+    results = calloc(count, sizeof(results[0]));
+    if (results == NULL)
+        abort();
+    if (thread_count > sizeof(threads)/sizeof(threads[0]))
+        thread_count = sizeof(threads)/sizeof(threads[0]);
+
+    for (start=0; start<count; start += thread_count) {
+        size_t end = start + thread_count;
+        size_t threads_used;
+
+        if (end > count)
+            end = count;
+        memset(&c, 0, sizeof(c));
+        c.t = t;
+        c.buf = buf;
+        c.length = length;
+        c.n = n;
+        c.results = results + start;
+        c.first = start;
+        c.count = end - start;
+        pthread_mutex_init(&c.lock, NULL);
+
+        threads_used = (thread_count > 1) ? c.count : 0;
+        for (i=0; i<threads_used; i++)
+            pthread_create(&threads[i], NULL, candidate_thread, &c);
+        if (threads_used == 0)
+            candidate_thread(&c);
+        for (i=0; i<threads_used; i++)
+            pthread_join(threads[i], NULL);
+        pthread_mutex_destroy(&c.lock);
+
+        for (i=start; i<end; i++) {
+            if (results[i]) {
+                free(results);
+                return i;
+            }
+        }
+    }
+    free(results);
+    return count;
+}
+
+/**
+ * Delta debugging (Zeller's "ddmin"): split the input into 'n' pieces,
+ * and see whether any one piece, or everything except one piece, still
+ * shows a difference. If so, keep that and start again, otherwise
+ * split into twice as many pieces, until the pieces are single bytes.
+ * The result is 1-minimal: removing any one byte makes the difference
+ * go away. Returns the new length of the buffer.
+ */
+static size_t
+ddmin(const struct target *t, unsigned char *buf, size_t length, unsigned thread_count)
+{
+    unsigned char *next;
+    size_t n = 2;
+
+    next = malloc(length ? length : 1);
+    if (next == NULL)
+        abort();
+
+    while (length >= 2) {
+        size_t count;
+        size_t found;
+
+        if (n > length)
+            n = length;
+
+        /* Each piece on its own, then everything except each piece */
+        count = (n > 2) ? 2 * n : n;
+        found = test_candidates(t, buf, length, n, count, thread_count);
+        if (found < count) {
+            length = make_candidate(buf, length, n, found, next);
+            memcpy(buf, next, length);
+            if (found < n)
+                n = 2;
+            else if (n > 2)
+                n--;
+        } else if (n < length) {
+            n *= 2;
+        } else
+            break;
+    }
+
+    free(next);
+    return length;
+}
 
 unsigned
 utf8_len(unsigned char c)
@@ -303,76 +595,100 @@ void print_diff(const unsigned char *buf, size_t offset, size_t max)
         printf("0x%02x - len(%u)\n", buf[i], utf8_len(buf[i]));
     }
 }
-int main(int argc, char *argv[])
+/**
+ * Print the counts from one side, like "3/12/80" for -lwc.
+ */
+static void
+print_counts(FILE *fp, const struct wcresults *r)
 {
-    unsigned char *buf;
-    unsigned seed = 0;
-    unsigned length = 1024 * 1024;
-    unsigned i;
-    unsigned min = 0;
-    unsigned max = length;
-    unsigned min_diff, max_diff;
-    long x, y;
-    const char *progname1 = "./wc2";
-    const char *progname2 = "./wc2";
-    const char *parms1 = NULL;
-    char *parms2 = NULL;
+    unsigned k;
 
-    signal(SIGPIPE, SIG_IGN);
+    for (k=0; k<r->count; k++)
+        fprintf(fp, "%s%ld", k ? "/" : "", r->counts[k]);
+}
 
-    /* The first parameter is the program we are testing against 'wc' */
-    if (argc < 2 || !is_executable(argv[1])) {
-        fprintf(stderr, "[-] first parameter must be an executable program\n");
-        return 1;
-    } else
-        progname2 = argv[1];
+/**
+ * Print the counts that differ, for every check where they do.
+ */
+static void
+print_difference(const struct target *t, const unsigned char *buf, size_t length, unsigned seed)
+{
+    size_t i;
 
-    /* The second parameter is option parameters */
-    if (argc >= 3) {
-        parms1 = argv[2];
-    } else
-        parms1 = NULL;
+    for (i=0; i<t->check_count; i++) {
+        const struct check *c = &t->checks[i];
+        struct wcresults r[2];
+        int j;
+
+        r[0] = word_count(t, c, 0, buf, length);
+        r[1] = word_count(t, c, 1, buf, length);
+        if (r[0].count == 0 || r[1].count == 0)
+            continue;
+        if (r[0].count == r[1].count && memcmp(r[0].counts, r[1].counts, r[0].count * sizeof(r[0].counts[0])) == 0)
+            continue;
 
-    if (parms1) {
-        parms2 = malloc(strlen(parms1) + 2);
-        strcpy(parms2, parms1);
-        strcat(parms2, "P");
+        printf("Diff string: seed=%u", seed);
+        if (c->name)
+            printf(" %s", c->name);
+        for (j=0; j<2; j++) {
+            printf(" %s=", t->name[j]);
+            print_counts(stdout, &r[j]);
+        }
+        printf("\n");
+    }
+    printf("\"");
+    for (i=0; i<length; i++) {
+        printf("\\\\x%02x", buf[i]);
     }
+    printf("\"\n");
+}
 
-    /* Create a buffer of deterministically random data. This will be the
-     * same data whenever we run this program, on any CPu, any OS, and
-     * any compiler */
-    buf = malloc(length);
-    for (i=0; i<length; i++)
-        buf[i] = r_rand(&seed);
+/**
+ * Search for the shortest string that shows a difference, printing it,
+ * and returning 1, or returning 0 if there's no difference.
+ */
+static int
+search(const struct target *t, const unsigned char *buf, size_t length, unsigned seed, int is_verbose)
+{
+    struct wcresults x, y;
+    size_t min, max;
+    size_t min_diff, max_diff;
+    unsigned char *diff;
+    size_t diff_length;
+    size_t which;
 
     /* First, make sure there's a difference */
-    x = word_count(progname1, parms1, buf, max);
-    y = word_count(progname2, parms2, buf, max);
-    if (x == -1) {
-        fprintf(stderr, "[-] %s: failed\n", progname1);
-        exit(1);
-    }
-    if (y == -1) {
-        fprintf(stderr, "[-] %s: failed\n", progname2);
-        exit(1);
-    }
-    if (x == y) {
-        fprintf(stderr, "[+] difference: none! (identical results)\n");
+    which = is_different(t, buf, length, &x, &y);
+    if (!which) {
+        if (x.count == 0)
+            fprintf(stderr, "[-] %s: failed\n", t->name[0]);
+        else if (y.count == 0)
+            fprintf(stderr, "[-] %s: failed\n", t->name[1]);
+        else if (is_verbose)
+            fprintf(stderr, "[+] difference: none! (identical results)\n");
         return 0;
-    } else {
-        fprintf(stderr, "[+] difference: %s=%lu %s=%lu\n", progname1, x, progname2, y);
+    }
+    if (is_verbose) {
+        const struct check *c = &t->checks[which - 1];
+
+        fprintf(stderr, "[+] difference:");
+        if (c->name)
+            fprintf(stderr, " %s", c->name);
+        fprintf(stderr, " %s=", t->name[0]);
+        print_counts(stderr, &x);
+        fprintf(stderr, " %s=", t->name[1]);
+        print_counts(stderr, &y);
+        fprintf(stderr, "\n");
     }
 
     /* Now search for one past the first difference */
     min = 0;
     max = length;
     while (min < max) {
-        unsigned half = (max - min)/2 + min;
-        fprintf(stderr, "max=%8lu\b\b\b\b\b\b\b\b\b\b\b\b", (unsigned long)(max));
-        x = word_count(progname1, parms1, buf, half);
-        y = word_count(progname2, parms2, buf, half);
-        if (x == y) {
+        size_t half = (max - min)/2 + min;
+        if (is_verbose)
+            fprintf(stderr, "max=%8lu\b\b\b\b\b\b\b\b\b\b\b\b", (unsigned long)(max));
+        if (!is_different(t, buf, half, &x, &y)) {
             /* we went too far, so we need to go back */
             min = half + 1;
         } else {
@@ -381,18 +697,17 @@ int main(int argc, char *argv[])
         }
     }
     max_diff = max;
-    fprintf(stderr, "max=%8lu\n", (unsigned long)(max_diff));
+    if (is_verbose)
+        fprintf(stderr, "max=%8lu\n", (unsigned long)(max_diff));
 
     /* Now search for one before the first difference */
     min = 0;
     max = max_diff;
     while (min < max) {
-        unsigned half = (max - min)/2 + min;
-        fprintf(stderr, "min=%8lu\b\b\b\b\b\b\b\b\b\b\b\b", (unsigned long)(min));
-        /* fprintf(stderr, "min=%u, half=%u, max=%u\n", min, half, max); */
-        x = word_count(progname1, parms1, buf + half, max_diff - half);
-        y = word_count(progname2, parms2, buf + half, max_diff - half);
-        if (x == y) {
+        size_t half = (max - min)/2 + min;
+        if (is_verbose)
+            fprintf(stderr, "min=%8lu\b\b\b\b\b\b\b\b\b\b\b\b", (unsigned long)(min));
+        if (!is_different(t, buf + half, max_diff - half, &x, &y)) {
             /* we went too far, so we need to go back */
             max = half;
         } else {
@@ -403,40 +718,266 @@ int main(int argc, char *argv[])
     min_diff = min;
 
     /* If they are equal, reduce min by one */
-    if (min_diff > 0) {
-        x = word_count(progname1, parms1, buf + min_diff, max_diff - min_diff);
-        y = word_count(progname2, parms2, buf + min_diff, max_diff - min_diff);
-        if (x == y) {
-            min_diff--;
-        }
+    if (min_diff > 0 && !is_different(t, buf + min_diff, max_diff - min_diff, &x, &y))
+        min_diff--;
+    if (is_verbose)
+        fprintf(stderr, "min=%8lu\n", (unsigned long)(min_diff));
+
+    /* Then remove whatever else isn't needed from the middle */
+    diff_length = max_diff - min_diff;
+    diff = malloc(diff_length + 1);
+    if (diff == NULL)
+        abort();
+    memcpy(diff, buf + min_diff, diff_length);
+    if (t->is_ddmin) {
+        diff_length = ddmin(t, diff, diff_length, t->thread_count);
+        if (is_verbose)
+            fprintf(stderr, "ddmin=%lu\n", (unsigned long)diff_length);
     }
-    fprintf(stderr, "min=%8lu\n", (unsigned long)(min_diff));
 
     /* print results */
-    x = word_count(progname1, parms1, buf + min_diff, max_diff - min_diff);
-    y = word_count(progname2, parms2, buf + min_diff, max_diff - min_diff);
-    printf("Diff string: wc=%ld wc2=%ld \n", x, y);
-    /* print_diff(buf, min_diff, max_diff); */
-    printf("\"");
-    for (i=min_diff; i<max_diff; i++) {
-        printf("\\\\x%02x", buf[i]);
+    print_difference(t, diff, diff_length, seed);
+    free(diff);
+    return 1;
+}
+
+static void
+print_help(void)
+{
+    printf("wcdiff -- find the shortest text two 'wc' programs count differently\n");
+    printf("use:\n wcdiff PROGRAM [PARMS] [options]\n");
+    printf(" wcdiff --engine=NAME --engine=NAME [-c] [-m] [--locale=NAME] [options]\n");
+    printf("where:\n");
+    printf(" PROGRAM\n\tCompared with './wc2', each run with PARMS for every probe, with\n");
+    printf("\t'P' added for PROGRAM.\n");
+    printf(" --reference=PROGRAM\n\tCompare with this instead of './wc2', like '/usr/bin/wc'.\n");
+    printf(" --options=all|LIST\n\tRun both programs with every combination of -l, -w, -c, and -m,\n");
+    printf("\tor with each of a comma-separated list, like '-lwc,-lwm'.\n");
+    printf(" --engine=NAME\n\tCompare two of the engines of 'libwc2' in this process instead\n");
+    printf("\t(see 'wc2 --engine=list'), counting bytes (-c), characters (-m),\n");
+    printf("\tor both.\n");
+    printf(" --locale=NAME\n\tThe locale for the engines (default from the environment).\n");
+    printf(" --seed=N\n\tThe first seed for the random text (default 0).\n");
+    printf(" --seeds=N\n\tHow many seeds to search, one after another (default 1).\n");
+    printf(" --size=N\n\tBytes of text for each seed (default 1048576).\n");
+    printf(" --profile=NAME\n\tUse the text from a generator of 'wctool', instead of random bytes.\n");
+    printf(" --ddmin\n\tMinimise the difference further, removing bytes from anywhere.\n");
+    printf(" --threads=N\n\tCandidates to try at once while minimising (default the number of CPUs).\n");
+}
+
+/**
+ * Add a check for each option in the comma-separated list, or for
+ * every combination of -l, -w, -c, and -m, for 'all'.
+ */
+static int
+add_option_checks(struct target *t, const char *list)
+{
+    static char combos[15][6];
+    static char buf[256];
+    char *p;
+    unsigned i;
+
+    if (strcmp(list, "all") == 0) {
+        for (i=1; i<16; i++) {
+            char *q = combos[i - 1];
+            *q++ = '-';
+            if (i & 1) *q++ = 'l';
+            if (i & 2) *q++ = 'w';
+            if (i & 4) *q++ = 'c';
+            if (i & 8) *q++ = 'm';
+            *q = '\0';
+            t->checks[t->check_count].parms[0] = combos[i - 1];
+            t->checks[t->check_count].parms[1] = combos[i - 1];
+            t->checks[t->check_count].name = combos[i - 1];
+            t->check_count++;
+        }
+        return 0;
     }
-    printf("\"\n");
 
+    snprintf(buf, sizeof(buf), "%s", list);
+    for (p = strtok(buf, ","); p; p = strtok(NULL, ",")) {
+        if (t->check_count >= MAX_CHECKS || p[0] != '-')
+            return -1;
+        t->checks[t->check_count].parms[0] = p;
+        t->checks[t->check_count].parms[1] = p;
+        t->checks[t->check_count].name = p;
+        t->check_count++;
+    }
+    return t->check_count ? 0 : -1;
+}
 
+int main(int argc, char *argv[])
+{
+    unsigned char *buf;
+    unsigned seed = 0;
+    unsigned seed_count = 1;
+    size_t length = 1024 * 1024;
+    const struct wcgen_profile *profile = NULL;
+    const char *locale = "";
+    const char *program = NULL;
+    const char *parms1 = NULL;
+    const char *options = NULL;
+    char *parms2 = NULL;
+    struct target t;
+    size_t engine_count = 0;
+    int is_bytes = 0;
+    int is_multibyte = 0;
+    unsigned found = 0;
+    long cpus;
+    unsigned n;
+    size_t j;
+    int i;
 
-/*
+    signal(SIGPIPE, SIG_IGN);
+    memset(&t, 0, sizeof(t));
+    t.name[0] = "./wc2";
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    t.thread_count = cpus > 0 ? (unsigned)cpus : 1;
+
+    errno = EINVAL;
+    for (i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--help") == 0) {
+            print_help();
+            return 0;
+        } else if (strncmp(argv[i], "--engine=", 9) == 0 && engine_count < 2) {
+            t.engine[engine_count] = wc2_engine_find(argv[i] + 9);
+            if (t.engine[engine_count] == NULL) {
+                perror(argv[i]);
+                return 1;
+            }
+            t.name[engine_count] = t.engine[engine_count]->name;
+            engine_count++;
+        } else if (strncmp(argv[i], "--locale=", 9) == 0) {
+            locale = argv[i] + 9;
+        } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+            seed = strtoul(argv[i] + 7, NULL, 0);
+        } else if (strncmp(argv[i], "--seeds=", 8) == 0) {
+            seed_count = strtoul(argv[i] + 8, NULL, 0);
+        } else if (strncmp(argv[i], "--size=", 7) == 0) {
+            length = strtoul(argv[i] + 7, NULL, 0);
+            if (length == 0) {
+                perror(argv[i]);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profile = wcgen_find(argv[i] + 10);
+            if (profile == NULL) {
+                perror(argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--ddmin") == 0) {
+            t.is_ddmin = 1;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            t.thread_count = strtoul(argv[i] + 10, NULL, 0);
+            if (t.thread_count == 0) {
+                perror(argv[i]);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--options=", 10) == 0) {
+            options = argv[i] + 10;
+        } else if (strncmp(argv[i], "--reference=", 12) == 0) {
+            t.name[0] = argv[i] + 12;
+        } else if (program == NULL && strcmp(argv[i], "-m") == 0) {
+            is_multibyte = 1;
+        } else if (program == NULL && strcmp(argv[i], "-c") == 0) {
+            is_bytes = 1;
+        } else if (program == NULL && argv[i][0] != '-') {
+            /* The first parameter is the program we are testing against 'wc' */
+            if (!is_executable(argv[i])) {
+                fprintf(stderr, "[-] first parameter must be an executable program\n");
+                return 1;
+            }
+            program = argv[i];
+        } else if (program && parms1 == NULL) {
+            /* The second parameter is option parameters */
+            parms1 = argv[i];
+        } else {
+            perror(argv[i]);
+            return 1;
+        }
+    }
+
+    if (engine_count) {
+        /* Compare two engines in this process, with a machine for
+         * bytes, or for characters, or both */
+        int m;
+
+        if (engine_count != 2 || program || options) {
+            fprintf(stderr, "[-] --engine must be given twice, without a program\n");
+            return 1;
+        }
+        if (!is_multibyte)
+            is_bytes = 1;
+        for (m=0; m<2; m++) {
+            struct check *c = &t.checks[t.check_count];
 
-    if (argc < 3 || argv[2][0] != '-') {
-        fprintf(stderr, "[-] second parameter must be option like -m or -w\n");
+            if (!(m ? is_multibyte : is_bytes))
+                continue;
+            c->machine = wc2_machine_create(m, locale);
+            c->name = m ? "-m" : "-c";
+            if (c->machine == NULL) {
+                fprintf(stderr, "[-] %s: unknown locale\n", locale);
+                return 1;
+            }
+            for (i=0; i<2; i++) {
+                if (!wc2_engine_is_usable(t.engine[i], c->machine)) {
+                    fprintf(stderr, "[-] %s: can't count %s\n", t.engine[i]->name, m ? "characters" : "bytes");
+                    return 1;
+                }
+            }
+            t.check_count++;
+        }
+    } else if (program == NULL) {
+        fprintf(stderr, "[-] first parameter must be an executable program\n");
         return 1;
+    } else {
+        t.name[1] = program;
+        if (options) {
+            if (parms1 || add_option_checks(&t, options) != 0) {
+                fprintf(stderr, "[-] --options=%s: bad options\n", options);
+                return 1;
+            }
+        } else {
+            if (parms1) {
+                parms2 = malloc(strlen(parms1) + 2);
+                strcpy(parms2, parms1);
+                strcat(parms2, "P");
+            }
+            t.checks[0].parms[0] = parms1;
+            t.checks[0].parms[1] = parms2;
+            t.check_count = 1;
+        }
     }
 
-    if (argc < 4 || !is_exists(argv[3])) {
-        fprintf(stderr, "[-] third parameter must be file\n");
-        return 1;
+    buf = malloc(length + WCGEN_SLACK);
+    if (buf == NULL)
+        abort();
+
+    for (n=0; n<seed_count; n++, seed++) {
+        /* Create a buffer of deterministically random data. This will be the
+         * same data whenever we run this program, on any CPu, any OS, and
+         * any compiler */
+        if (profile) {
+            struct wcgen_state state;
+            wcgen_init(&state, seed, NULL);
+            profile->generate(buf, length, &state);
+        } else {
+            unsigned r = seed;
+            for (j=0; j<length; j++)
+                buf[j] = r_rand(&r);
+        }
+
+        found += search(&t, buf, length, seed, seed_count == 1);
     }
-*/
 
+    if (seed_count > 1)
+        fprintf(stderr, "[+] differences: %u of %u seeds\n", found, seed_count);
+
+    for (j=0; j<t.check_count; j++) {
+        if (t.checks[j].machine)
+            wc2_machine_free((struct wc2_machine *)t.checks[j].machine);
+    }
+    free(buf);
+    free(parms2);
     return 0;
 }
@@ -0,0 +1,346 @@
+/*
+    A fuzz target for the counting engines in 'libwc2', for libFuzzer
+    or AFL. Every engine counts the input as a whole, a byte at a time,
+    and split into chunks at places chosen by the fuzzer, carrying its
+    state from one chunk to the next, and the summaries that '-j' uses
+    are composed from the same chunks. All of them must agree with a
+    slow reference, which decodes a character at a time with 'mbrtowc()'
+    and tests it with 'iswspace()', the same as 'other/wc2m.c', but
+    without its bugs with illegal sequences: those are skipped a byte at
+    a time, with a fresh 'mbstate_t' for the next character, and what
+    glibc decodes past U+10FFFF is illegal too.
+
+    The header-only C++ engine in 'wc2.hpp' has its own copy of the
+    state-machine, so it's checked the same way, through 'wcfuzzpp.cpp'.
+
+    This is to catch the bugs that happen only where a chunk ends in the
+    middle of a character or a word, like the one 'wcstream' finds in
+    macOS's 'wc', in the fast paths of 'libwc2'.
+
+    The first byte of the input is a seed for where to split the rest,
+    which is the text to count. With clang:
+
+        $ make fuzz
+
+    builds it with '-fsanitize=fuzzer,address,undefined' and runs it on
+    the corpus in 'fuzz-corpus/'. Without libFuzzer, '-DWCFUZZ_MAIN'
+    adds a 'main()' that runs the target on each file named on the
+    command-line, or on <stdin>, which is how AFL runs it, and how to
+    replay a crash ('make wcfuzz-replay').
+
+    The corpus starts with the inputs for the bugs this has found, which
+    'make fuzz-replay' (and so 'make test') runs without needing clang:
+    a lead byte after a character cut short, which has to start a new
+    character, and the lead bytes from F5 on, which glibc decodes past
+    U+10FFFF.
+*/
+#include "libwc2.h"
+#include <ctype.h>
+#include <locale.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+
+enum {MAX_CHUNKS = 4096};
+
+/* In 'wcfuzzpp.cpp' */
+struct wc2_results
+wcfuzz_hpp(int is_multibyte, int is_compiled, const char *locale,
+           const unsigned char *buf, const size_t *chunks, size_t chunk_count);
+
+/**
+ * The machines for counting bytes and counting characters, made the
+ * first time the target runs.
+ */
+static struct wc2_machine *machines[2];
+static const char *machine_locale;
+
+/**
+ * Chunks of a single byte, for feeding the engines a byte at a time
+ */
+static size_t ones[MAX_CHUNKS];
+
+static void
+initialize(void)
+{
+    static const char *locales[] = {"C.UTF-8", "C.utf8", "en_US.UTF-8", NULL};
+    size_t i;
+
+    for (i=0; locales[i]; i++) {
+        if (setlocale(LC_CTYPE, locales[i]) != NULL)
+            break;
+    }
+    if (locales[i] == NULL) {
+        fprintf(stderr, "wcfuzz: no UTF-8 locale\n");
+        abort();
+    }
+    machine_locale = locales[i];
+    machines[0] = wc2_machine_create(0, locales[i]);
+    machines[1] = wc2_machine_create(1, locales[i]);
+    if (machines[0] == NULL || machines[1] == NULL)
+        abort();
+
+    for (i=0; i<MAX_CHUNKS; i++)
+        ones[i] = 1;
+}
+
+/**
+ * The reference for counting bytes, using 'isspace()'
+ */
+static struct wc2_results
+reference_bytes(const unsigned char *buf, size_t length)
+{
+    struct wc2_results results;
+    int was_space = 1;
+    size_t i;
+
+    memset(&results, 0, sizeof(results));
+    for (i=0; i<length; i++) {
+        int is_space = isspace(buf[i]) != 0;
+        results.line_count += (buf[i] == '\n');
+        results.word_count += (was_space && !is_space);
+        was_space = is_space;
+    }
+    results.char_count = length;
+    results.byte_count = length;
+    return results;
+}
+
+/**
+ * The reference for counting characters, using 'mbrtowc()' and
+ * 'iswspace()'. An illegal byte, or a character cut short by the end
+ * of the input, counts as nothing, not even the end of a word, and
+ * decoding starts again from the next byte.
+ */
+static struct wc2_results
+reference_chars(const unsigned char *buf, size_t length)
+{
+    struct wc2_results results;
+    int was_space = 1;
+    size_t i;
+
+    memset(&results, 0, sizeof(results));
+    for (i=0; i<length; ) {
+        mbstate_t mbstate;
+        wchar_t wc;
+        size_t len;
+        int is_space;
+
+        memset(&mbstate, 0, sizeof(mbstate));
+        len = mbrtowc(&wc, (const char *)buf + i, length - i, &mbstate);
+        if (len == (size_t)-1 || len == (size_t)-2 || (unsigned long)wc > 0x10FFFF) {
+            i++;
+            continue;
+        }
+        if (len == 0)
+            len = 1; /* a NUL character */
+
+        is_space = iswspace(wc) != 0;
+        results.char_count++;
+        results.line_count += (wc == L'\n');
+        results.word_count += (was_space && !is_space);
+        was_space = is_space;
+        i += len;
+    }
+    results.byte_count = length;
+    return results;
+}
+
+/**
+ * Where to split the input, from a seed. Mostly short chunks, to put
+ * as many boundaries in the middle of characters as possible, with the
+ * occasional empty or longer chunk.
+ */
+static size_t
+make_chunks(unsigned seed, size_t length, size_t *chunks)
+{
+    size_t count = 0;
+    size_t offset = 0;
+
+    while (offset < length && count < MAX_CHUNKS - 1) {
+        size_t n;
+
+        seed = seed * 214013 + 2531011;
+        n = (seed >> 16) & 0x7fff;
+        if (n % 16 == 0)
+            n = n % 257;
+        else
+            n = n % 7;
+        if (n > length - offset)
+            n = length - offset;
+        chunks[count++] = n;
+        offset += n;
+    }
+    if (offset < length)
+        chunks[count++] = length - offset;
+    return count;
+}
+
+static void
+check(const char *what, const char *engine, int is_multibyte,
+      const struct wc2_results *x, const struct wc2_results *expected)
+{
+    if (x->line_count == expected->line_count
+            && x->word_count == expected->word_count
+            && x->byte_count == expected->byte_count
+            && (!is_multibyte || x->char_count == expected->char_count))
+        return;
+
+    fprintf(stderr, "wcfuzz: %s %s (%s): lines=%lu words=%lu chars=%lu bytes=%lu, expected %lu %lu %lu %lu\n",
+            engine, is_multibyte ? "-m" : "-c", what,
+            x->line_count, x->word_count, x->char_count, x->byte_count,
+            expected->line_count, expected->word_count, expected->char_count, expected->byte_count);
+    abort();
+}
+
+/**
+ * Count the chunks one after another with the engine, carrying the
+ * state from each to the next.
+ */
+static struct wc2_results
+parse_chunks(const struct wc2_engine *engine, const struct wc2_machine *machine,
+             const unsigned char *buf, const size_t *chunks, size_t chunk_count)
+{
+    struct wc2_results total;
+    unsigned state = 0;
+    size_t i;
+
+    memset(&total, 0, sizeof(total));
+    for (i=0; i<chunk_count; i++) {
+        struct wc2_results x = engine->parse(machine, buf, chunks[i], &state);
+        total.line_count += x.line_count;
+        total.word_count += x.word_count;
+        total.char_count += x.char_count;
+        total.byte_count += x.byte_count;
+        buf += chunks[i];
+    }
+    return total;
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static size_t chunks[MAX_CHUNKS];
+    const unsigned char *buf;
+    size_t length;
+    size_t chunk_count;
+    int m;
+
+    if (machines[0] == NULL)
+        initialize();
+    if (size == 0)
+        return 0;
+
+    buf = data + 1;
+    length = size - 1;
+    chunk_count = make_chunks(data[0], length, chunks);
+
+    for (m=0; m<2; m++) {
+        const struct wc2_machine *machine = machines[m];
+        const struct wc2_engine *engine;
+        struct wc2_results expected;
+        struct wc2_results x;
+        size_t i;
+
+        expected = m ? reference_chars(buf, length) : reference_bytes(buf, length);
+
+        for (i=0; (engine = wc2_engine_at(i)) != NULL; i++) {
+            if (!wc2_engine_is_usable(engine, machine))
+                continue;
+
+            x = parse_chunks(engine, machine, buf, &length, 1);
+            check("whole", engine->name, m, &x, &expected);
+
+            x = parse_chunks(engine, machine, buf, chunks, chunk_count);
+            check("chunks", engine->name, m, &x, &expected);
+
+            if (length <= MAX_CHUNKS) {
+                x = parse_chunks(engine, machine, buf, ones, length);
+                check("bytes", engine->name, m, &x, &expected);
+            }
+        }
+
+        /* The C++ engine, with the machines built at runtime and at
+         * compile-time, which only knows the spaces of UTF-8 locales */
+        x = wcfuzz_hpp(m, 0, machine_locale, buf, chunks, chunk_count);
+        check("chunks", "wc2.hpp", m, &x, &expected);
+        if (m) {
+            x = wcfuzz_hpp(m, 1, machine_locale, buf, chunks, chunk_count);
+            check("chunks", "wc2.hpp (compiled)", m, &x, &expected);
+        }
+        if (length <= MAX_CHUNKS) {
+            x = wcfuzz_hpp(m, 0, machine_locale, buf, ones, length);
+            check("bytes", "wc2.hpp", m, &x, &expected);
+        }
+
+        /* The summaries of the chunks, composed in order, as '-j' does */
+        {
+            static struct wc2_summary total;
+            static struct wc2_summary part;
+            const unsigned char *p = buf;
+
+            wc2_summary_init(&total);
+            for (i=0; i<chunk_count; i++) {
+                wc2_summarize(machine, p, chunks[i], &part);
+                wc2_summary_compose(&total, &part);
+                p += chunks[i];
+            }
+            check("summaries", "summarize", m, &total.results[0], &expected);
+        }
+    }
+    return 0;
+}
+
+#ifdef WCFUZZ_MAIN
+/**
+ * Run the target on each file, or on <stdin>, for AFL, or for replaying
+ * a crash found by libFuzzer without needing clang.
+ */
+static int
+run_file(FILE *fp)
+{
+    unsigned char *data = NULL;
+    size_t size = 0;
+    size_t max = 0;
+
+    for (;;) {
+        size_t count;
+        if (size == max) {
+            max = max ? max * 2 : 65536;
+            data = realloc(data, max);
+            if (data == NULL)
+                abort();
+        }
+        count = fread(data + size, 1, max - size, fp);
+        if (count == 0)
+            break;
+        size += count;
+    }
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int i;
+
+    if (argc < 2)
+        return run_file(stdin);
+
+    for (i=1; i<argc; i++) {
+        FILE *fp = fopen(argv[i], "rb");
+        if (fp == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+        run_file(fp);
+        fclose(fp);
+    }
+    return 0;
+}
+#endif
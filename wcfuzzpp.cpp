@@ -0,0 +1,48 @@
+/*
+    The part of 'wcfuzz' that runs the header-only C++ engine in
+    'wc2.hpp', which has its own copy of the state-machine, so that
+    the fuzzer checks it against the same reference as 'libwc2'.
+*/
+#include "wc2.hpp"
+#include "libwc2.h"
+
+namespace {
+
+template <typename Machine>
+wc2_results
+count_chunks(const Machine &machine, const unsigned char *buf, const size_t *chunks, size_t chunk_count)
+{
+    wc2::engine<wc2::all, Machine> e(machine);
+    for (size_t i = 0; i < chunk_count; i++) {
+        e.feed(buf, buf + chunks[i]);
+        buf += chunks[i];
+    }
+
+    wc2::results r = e.finish();
+    wc2_results x;
+    x.line_count = (unsigned long)r.line_count;
+    x.word_count = (unsigned long)r.word_count;
+    x.char_count = (unsigned long)r.char_count;
+    x.byte_count = (unsigned long)r.byte_count;
+    return x;
+}
+
+} /* namespace */
+
+/**
+ * Count the chunks one after another with the C++ engine, using the
+ * ASCII machine for '-c', and for '-m' either the UTF-8 machine built
+ * at runtime for 'locale', or the one built at compile-time.
+ */
+extern "C" wc2_results
+wcfuzz_hpp(int is_multibyte, int is_compiled, const char *locale,
+           const unsigned char *buf, const size_t *chunks, size_t chunk_count)
+{
+    static const wc2::utf8_machine machine = wc2::utf8_machine::from_locale(locale);
+
+    if (!is_multibyte)
+        return count_chunks(wc2::ascii, buf, chunks, chunk_count);
+    if (is_compiled)
+        return count_chunks(wc2::utf8, buf, chunks, chunk_count);
+    return count_chunks(machine, buf, chunks, chunk_count);
+}
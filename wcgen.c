@@ -0,0 +1,349 @@
+/*
+    The text generators from 'wctool'. See 'wcgen.h'.
+*/
+#include "wcgen.h"
+#include <string.h>
+
+unsigned
+wcgen_rand(unsigned *seed)
+{
+    static const unsigned a = 214013;
+    static const unsigned c = 2531011;
+
+    *seed = (*seed) * a + c;
+    return (*seed)>>16 & 0x7fff;
+}
+
+/**
+ * A random number from 0 to 999999, for the parts-per-million settings
+ */
+static unsigned
+rand_ppm(unsigned *seed)
+{
+    unsigned r = wcgen_rand(seed) << 15 | wcgen_rand(seed);
+    return r % 1000000;
+}
+
+static const struct wcgen_params default_params = {10000, 10000};
+
+void
+wcgen_init(struct wcgen_state *state, unsigned seed, const struct wcgen_params *params)
+{
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->params = params ? params : &default_params;
+}
+
+/**
+ * Random Chinese, emoji, and ASCII and Unicode spaces
+ */
+static const char *utf8_list[] = {
+    "\xe7\x9a\x84",     /* U+7684 的 */
+    "\xe4\xb8\x80",     /* U+4e00 一 */
+    "\xe6\x98\xaf",     /* U+662f 是 */
+    "\xe6\x96\x87",     /* U+6587 文 */
+    "\xe3\x81\xaa",     /* U+306a な */
+    "\xf0\x9f\x98\x82", /* U+1f602 😂 */
+    "\xe2\x9d\xa4\xef\xb8\x8f", /* U+2764 ❤️ */
+    "\xf0\x9f\x92\xa9", /* U+1f4a9 💩 */
+    "\xe2\x80\x83",     /* U+2003   */
+    "\xe1\xa0\x8e",     /* U+180e ᠎ */
+    "\xe3\x80\x80",     /* U+3000 　 */
+    "\n",               /* U+000a */
+    " ",                /* U+0020   */
+    "\xef\xbb\xbf",     /* U+feff ﻿ */
+    "\xe1\x9a\x80",     /* U+1680   */
+    "\t",               /* U+0009   */
+    0};
+
+static size_t
+gen_utf8(unsigned char *buf, size_t length, struct wcgen_state *state)
+{
+    size_t i;
+
+    for (i=0; i<length; ) {
+        const char *out = utf8_list[wcgen_rand(&state->seed)%16];
+        size_t out_length = strlen(out);
+        memcpy(buf + i, out, out_length);
+        i += out_length;
+    }
+    return i;
+}
+
+/**
+ * One long word
+ */
+static size_t
+gen_allword(unsigned char *buf, size_t length, struct wcgen_state *state)
+{
+    (void)state;
+    memset(buf, 'x', length);
+    return length;
+}
+
+/**
+ * Nothing but spaces
+ */
+static size_t
+gen_allspace(unsigned char *buf, size_t length, struct wcgen_state *state)
+{
+    (void)state;
+    memset(buf, ' ', length);
+    return length;
+}
+
+/**
+ * Random ASCII, half of it spaces, to defeat branch prediction
+ */
+static size_t
+gen_ascii(unsigned char *buf, size_t length, struct wcgen_state *state)
+{
+    size_t i;
+
+    for (i=0; i<length; i++)
+        buf[i] = " x\ty\rz\na"[wcgen_rand(&state->seed)%8];
+    return length;
+}
+
+/**
+ * The lengths of English words, per thousand words, from 1 letter up
+ * to 16 letters. Taken from counting a few novels, so only roughly.
+ */
+static const unsigned short word_lengths[16] = {
+    30, 170, 210, 160, 110, 80, 70, 50, 40, 30, 20, 12, 8, 5, 3, 2
+};
+
+static unsigned
+random_word_length(unsigned *seed)
+{
+    unsigned r = wcgen_rand(seed) % 1000;
+    unsigned i;
+
+    for (i=0; i<15 && r >= word_lengths[i]; i++)
+        r -= word_lengths[i];
+    return i + 1;
+}
+
+/**
+ * The kinds of things that prose is in the middle of
+ */
+enum {
+    PROSE_BETWEEN,      /* choosing what comes next */
+    PROSE_WORD,         /* 'remaining' letters to go */
+    PROSE_NUL           /* 'remaining' NUL bytes to go */
+};
+
+/**
+ * Text that looks like prose: words of realistic lengths, separated
+ * by spaces and some punctuation, with about 12 words to a line, and
+ * sometimes an empty line between paragraphs. The lines end with
+ * 'newline', and if 'nul_chance' (per million words) isn't zero, there
+ * are regions of NUL bytes from 4K to 1M long, like a sparse file or a
+ * database with holes in it.
+ */
+static size_t
+gen_prose_common(unsigned char *buf, size_t length, struct wcgen_state *state,
+                 const char *newline, unsigned nul_chance)
+{
+    size_t i = 0;
+
+    while (i < length) {
+        switch (state->kind) {
+        case PROSE_BETWEEN:
+        {
+            unsigned r = wcgen_rand(&state->seed) % 100;
+
+            if (nul_chance && rand_ppm(&state->seed) < nul_chance) {
+                state->kind = PROSE_NUL;
+                state->remaining = 4096 + (wcgen_rand(&state->seed) << 5) % (1024 * 1024 - 4096);
+                break;
+            }
+
+            /* The separator before the next word */
+            if (r < 8) {
+                size_t n = strlen(newline);
+                memcpy(buf + i, newline, n);
+                i += n;
+                if (wcgen_rand(&state->seed) % 8 == 0) {
+                    memcpy(buf + i, newline, n);
+                    i += n;
+                }
+            } else if (r < 14) {
+                memcpy(buf + i, ", ", 2);
+                i += 2;
+            } else if (r < 18) {
+                memcpy(buf + i, ". ", 2);
+                i += 2;
+            } else
+                buf[i++] = ' ';
+
+            state->kind = PROSE_WORD;
+            state->remaining = random_word_length(&state->seed);
+            break;
+        }
+        case PROSE_WORD:
+            while (i < length && state->remaining) {
+                buf[i++] = (unsigned char)('a' + wcgen_rand(&state->seed) % 26);
+                state->remaining--;
+            }
+            if (state->remaining == 0)
+                state->kind = PROSE_BETWEEN;
+            break;
+        case PROSE_NUL:
+        {
+            size_t n = length - i;
+            if (n > state->remaining)
+                n = (size_t)state->remaining;
+            memset(buf + i, 0, n);
+            i += n;
+            state->remaining -= n;
+            if (state->remaining == 0)
+                state->kind = PROSE_BETWEEN;
+            break;
+        }
+        }
+    }
+    return i;
+}
+
+static size_t
+gen_prose(unsigned char *buf, size_t length, struct wcgen_state *state)
+{
+    return gen_prose_common(buf, length, state, "\n", 0);
+}
+
+static size_t
+gen_crlf(unsigned char *buf, size_t length, struct wcgen_state *state)
+{
+    return gen_prose_common(buf, length, state, "\r\n", 0);
+}
+
+static size_t
+gen_nul(unsigned char *buf, size_t length, struct wcgen_state *state)
+{
+    return gen_prose_common(buf, length, state, "\n", 500);
+}
+
+/**
+ * Long runs of the same thing, from a single byte up to 128K, of
+ * spaces, letters, newlines, NULs, or a multibyte character. These are
+ * the best case for predicting branches, until the run ends.
+ */
+static size_t
+gen_runs(unsigned char *buf, size_t length, struct wcgen_state *state)
+{
+    static const char *runs[] = {" ", "x", "\n", "\0", "\xe7\x9a\x84", "\xe3\x80\x80"};
+    size_t i = 0;
+
+    while (i < length) {
+        const char *run;
+        size_t run_length;
+
+        if (state->remaining == 0) {
+            unsigned bits = wcgen_rand(&state->seed) % 18;
+            unsigned r = wcgen_rand(&state->seed) << 15 | wcgen_rand(&state->seed);
+            state->kind = wcgen_rand(&state->seed) % 6;
+            state->remaining = 1 + r % (1U << bits);
+        }
+        run = runs[state->kind];
+        run_length = state->kind == 3 ? 1 : strlen(run);
+
+        if (run_length == 1) {
+            size_t n = length - i;
+            if (n > state->remaining)
+                n = (size_t)state->remaining;
+            memset(buf + i, run[0], n);
+            i += n;
+            state->remaining -= n;
+        } else {
+            memcpy(buf + i, run, run_length);
+            i += run_length;
+            state->remaining--;
+        }
+    }
+    return i;
+}
+
+/**
+ * Bytes that can never appear in UTF-8 where they are: continuation
+ * bytes on their own, lead bytes that are never used, and sequences
+ * cut short or encoding the surrogates.
+ */
+static const char *illegal_list[] = {
+    "\x80", "\xbf", "\xc0", "\xc1", "\xf5", "\xff",
+    "\xe4\xb8", "\xf0\x9f\x98", "\xed\xa0\x80",
+};
+
+/**
+ * Characters encoded in more bytes than they need, including the
+ * overlong spaces and newline, which a careless decoder would count
+ */
+static const char *overlong_list[] = {
+    "\xc0\xa0",             /* U+0020 in 2 bytes */
+    "\xc0\x8a",             /* U+000A in 2 bytes */
+    "\xc1\xa1",             /* U+0061 in 2 bytes */
+    "\xe0\x80\xa0",         /* U+0020 in 3 bytes */
+    "\xe0\x9f\xbf",         /* U+07FF in 3 bytes */
+    "\xf0\x80\x80\xa0",     /* U+0020 in 4 bytes */
+    "\xf0\x8f\xbf\xbf",     /* U+FFFF in 4 bytes */
+};
+
+/**
+ * The same as 'utf8', but with illegal and overlong sequences mixed in,
+ * as many as the parameters say.
+ */
+static size_t
+gen_broken(unsigned char *buf, size_t length, struct wcgen_state *state)
+{
+    const struct wcgen_params *params = state->params;
+    size_t i;
+
+    for (i=0; i<length; ) {
+        unsigned r = rand_ppm(&state->seed);
+        const char *out;
+        size_t out_length;
+
+        if (r < params->illegal)
+            out = illegal_list[wcgen_rand(&state->seed) % (sizeof(illegal_list)/sizeof(illegal_list[0]))];
+        else if (r < params->illegal + params->overlong)
+            out = overlong_list[wcgen_rand(&state->seed) % (sizeof(overlong_list)/sizeof(overlong_list[0]))];
+        else
+            out = utf8_list[wcgen_rand(&state->seed)%16];
+        out_length = strlen(out);
+        memcpy(buf + i, out, out_length);
+        i += out_length;
+    }
+    return i;
+}
+
+static const struct wcgen_profile profiles[] = {
+    {"ascii", gen_ascii, "random ASCII letters and spaces"},
+    {"utf8", gen_utf8, "random multibyte characters and spaces"},
+    {"allword", gen_allword, "a single word"},
+    {"allspace", gen_allspace, "nothing but spaces"},
+    {"prose", gen_prose, "words and lines of realistic lengths"},
+    {"crlf", gen_crlf, "the same as prose, with CRLF line endings"},
+    {"nul", gen_nul, "prose with regions of NUL bytes from 4K to 1M"},
+    {"runs", gen_runs, "long runs of the same character"},
+    {"broken", gen_broken, "utf8 with illegal and overlong sequences"},
+};
+
+const struct wcgen_profile *
+wcgen_at(size_t index)
+{
+    if (index >= sizeof(profiles)/sizeof(profiles[0]))
+        return NULL;
+    return &profiles[index];
+}
+
+const struct wcgen_profile *
+wcgen_find(const char *name)
+{
+    size_t i;
+
+    for (i=0; i<sizeof(profiles)/sizeof(profiles[0]); i++) {
+        if (strcmp(profiles[i].name, name) == 0)
+            return &profiles[i];
+    }
+    return NULL;
+}
@@ -0,0 +1,80 @@
+/*
+    Generators for synthetic text, shared by 'wctool', which writes it
+    to files, and by the programs that benchmark the engines in memory.
+
+    Each generator fills a buffer with the next part of its text. Text
+    is made of whole pieces, like a multibyte character, so a generator
+    keeps going until it has written at least 'length' bytes, which may
+    be up to WCGEN_SLACK-1 bytes past that. Calling it again with the
+    same 'state' continues where it left off, so the text doesn't depend
+    on the size of the buffers it's generated in.
+*/
+#ifndef WCGEN_H
+#define WCGEN_H
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {WCGEN_SLACK = 8};
+
+/**
+ * Settings for the generators that can produce bad UTF-8, as parts
+ * per million of the characters generated.
+ */
+struct wcgen_params {
+    unsigned illegal;   /* bytes that aren't a valid part of UTF-8 */
+    unsigned overlong;  /* characters encoded in more bytes than needed */
+};
+
+/**
+ * Where a generator is in its text. Besides the random numbers, some
+ * generators are partway through something longer than a buffer, like
+ * a run of the same character.
+ */
+struct wcgen_state {
+    unsigned seed;
+    unsigned kind;
+    unsigned long long remaining;
+    const struct wcgen_params *params;
+};
+
+typedef size_t (*wcgen_fn)(unsigned char *buf, size_t length, struct wcgen_state *state);
+
+struct wcgen_profile {
+    const char *name;
+    wcgen_fn generate;
+    const char *description;
+};
+
+/**
+ * Start generating from the beginning. If 'params' is NULL, the
+ * defaults are used, which is 1% of each kind of bad UTF-8.
+ */
+void
+wcgen_init(struct wcgen_state *state, unsigned seed, const struct wcgen_params *params);
+
+/**
+ * Look up a generator by name, returning NULL if there's none.
+ */
+const struct wcgen_profile *
+wcgen_find(const char *name);
+
+/**
+ * Enumerate the generators, returning NULL past the last one.
+ */
+const struct wcgen_profile *
+wcgen_at(size_t index);
+
+/**
+ * The pseudo-random numbers used by all the generators, which are the
+ * same on any CPU, OS, or compiler.
+ */
+unsigned
+wcgen_rand(unsigned *seed);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
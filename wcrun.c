@@ -0,0 +1,479 @@
+/*
+    Runs the end-to-end benchmarks, comparing 'wc2' with 'wc2.js', the
+    variants in 'other/', and the system 'wc', on all the test files,
+    which 'make bench' creates first.
+
+    This replaces the 'bench-*.sh' scripts, which kept the best of 10
+    runs. The best time hides how noisy a measurement is, so instead
+    every program is run many times, and we report the median and the
+    95th percentile, along with a 95% confidence interval for the
+    median. With '--cache=cold', the test files are evicted from the
+    page-cache before each run (with 'posix_fadvise()'), so that we
+    measure reading from the disk, too. Each run then names the file
+    only once, since the second copy would be read from the cache, and
+    the times shown are wall-clock time, since waiting for the disk
+    isn't user time.
+
+    The results are written to 'bench-results/REVISION.json', where the
+    revision comes from 'git describe', with one line per measurement,
+    always in the same order. So comparing two commits is just:
+
+        $ git diff --no-index bench-results/v1.0.json bench-results/v1.1.json
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+
+enum {MAX_ITEMS = 32};
+
+/**
+ * A set of options to run every program with, and the locale to run
+ * them in, since '-m' only means something in a multibyte locale.
+ */
+struct option_set {
+    const char *options;
+    const char *locale;
+};
+
+/**
+ * What we are comparing against, when none are given on the command-line.
+ * Those that haven't been built, or need 'node' when it's not installed,
+ * are skipped. Some of the variants in 'other/' don't take options, but
+ * always count the same things, so are only run for those options.
+ */
+struct program {
+    const char *name;
+    const char *fixed_options;
+};
+
+struct config {
+    unsigned repeat;
+    unsigned copies;
+    int is_cold;
+    const char *output_dir;
+    struct program programs[MAX_ITEMS];
+    size_t program_count;
+    const char *files[MAX_ITEMS];
+    size_t file_count;
+    struct option_set option_sets[MAX_ITEMS];
+    size_t option_set_count;
+    const char *locale;
+};
+
+static const struct program default_programs[] = {
+    {"./wc2", NULL},
+    {"./wc2.js", NULL},
+    {"other/wc2a", NULL},
+    {"other/wc2b", NULL},
+    {"other/wc2c", "-lwc"},
+    {"other/wc2m", "-lwm"},
+    {"other/wc2p", NULL},
+    {"other/wc2z", "-lwc"},
+    {"wc", NULL},
+    {NULL, NULL}
+};
+
+static const char *default_files[] = {
+    "space.txt", "word.txt", "ascii.txt", "utf8.txt", "pocorgtfo18.pdf", NULL
+};
+
+/**
+ * Statistics for one set of measurements
+ */
+struct stats {
+    double min;
+    double median;
+    double p95;
+    double ci_low;
+    double ci_high;
+};
+
+static double
+now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static int
+compare_double(const void *lhs, const void *rhs)
+{
+    double a = *(const double *)lhs;
+    double b = *(const double *)rhs;
+    return (a > b) - (a < b);
+}
+
+/**
+ * Sort the samples and calculate the statistics. The confidence
+ * interval for the median doesn't assume the times are normally
+ * distributed, which they aren't, with a long tail of slow runs. It's
+ * between the order statistics whose ranks come from the binomial
+ * distribution, n/2 - 0.98*sqrt(n) and 1 + n/2 + 0.98*sqrt(n), rounded,
+ * which for 10 runs is between the 2nd and 9th fastest.
+ */
+static struct stats
+calculate_stats(double *samples, size_t count)
+{
+    struct stats stats;
+    double half_width = 0.98 * sqrt((double)count);
+    long low, high;
+
+    qsort(samples, count, sizeof(samples[0]), compare_double);
+    stats.min = samples[0];
+    stats.median = (count & 1) ? samples[count/2] : (samples[count/2 - 1] + samples[count/2]) / 2;
+    stats.p95 = samples[(size_t)ceil(0.95 * count) - 1];
+
+    /* The ranks count from 1, the indexes from 0 */
+    low = lround(count / 2.0 - half_width) - 1;
+    high = lround(1 + count / 2.0 + half_width) - 1;
+    if (low < 0)
+        low = 0;
+    if (high > (long)count - 1)
+        high = (long)count - 1;
+    stats.ci_low = samples[low];
+    stats.ci_high = samples[high];
+    return stats;
+}
+
+/**
+ * Whether we can run the program, either because it's an executable
+ * file, or a bare name found in the PATH. Scripts also need their
+ * interpreter, which we check for 'node' only.
+ */
+static int
+is_runnable(const char *program)
+{
+    char command[1024];
+
+    if (strchr(program, '/') == NULL) {
+        snprintf(command, sizeof(command), "command -v %s >/dev/null 2>&1", program);
+        return system(command) == 0;
+    }
+    if (access(program, X_OK) != 0)
+        return 0;
+    if (strlen(program) > 3 && strcmp(program + strlen(program) - 3, ".js") == 0)
+        return is_runnable("node");
+    return 1;
+}
+
+/**
+ * Tell the kernel to drop the file from the page-cache. This only
+ * works on pages that aren't dirty or mapped by someone else, which
+ * for our test files they won't be.
+ */
+static void
+evict_file(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+        return;
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(fd);
+}
+
+/**
+ * Run the program once, with its output going nowhere, and return the
+ * user time, along with the wall-clock time. Returns -1 if it couldn't
+ * run or failed.
+ */
+static int
+run_once(const struct program *program, const struct option_set *set, const char *filename,
+         const struct config *cfg, double *user, double *wall)
+{
+    char *argv[MAX_ITEMS + 8];
+    struct rusage usage;
+    double start;
+    int status;
+    pid_t pid;
+    size_t i;
+    int argc = 0;
+
+    argv[argc++] = (char *)program->name;
+    if (program->fixed_options == NULL)
+        argv[argc++] = (char *)set->options;
+    for (i=0; i<cfg->copies; i++)
+        argv[argc++] = (char *)filename;
+    argv[argc] = NULL;
+
+    start = now_seconds();
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int fd = open("/dev/null", O_WRONLY);
+        if (fd >= 0) {
+            dup2(fd, 1);
+            dup2(fd, 2);
+            close(fd);
+        }
+        setenv("LC_ALL", set->locale, 1);
+        execvp(program->name, argv);
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        perror("wait4");
+        return -1;
+    }
+    *wall = now_seconds() - start;
+    *user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * Get the git revision, with '-dirty' if there are uncommitted changes,
+ * so that results from a work-in-progress don't overwrite those from
+ * the commit it started from.
+ */
+static void
+get_revision(char *revision, size_t length)
+{
+    FILE *fp = popen("git describe --always --dirty 2>/dev/null", "r");
+
+    snprintf(revision, length, "unknown");
+    if (fp == NULL)
+        return;
+    if (fgets(revision, (int)length, fp) == NULL)
+        snprintf(revision, length, "unknown");
+    revision[strcspn(revision, "\r\n")] = '\0';
+    if (revision[0] == '\0')
+        snprintf(revision, length, "unknown");
+    pclose(fp);
+}
+
+static void
+print_stats(FILE *fp, const char *name, const struct stats *stats)
+{
+    fprintf(fp, "\"%s\":{\"min\":%.4f,\"median\":%.4f,\"p95\":%.4f,\"ci_low\":%.4f,\"ci_high\":%.4f}",
+            name, stats->min, stats->median, stats->p95, stats->ci_low, stats->ci_high);
+}
+
+static void
+print_help(void)
+{
+    printf("wcrun -- compare the speed of 'wc' programs\n");
+    printf("use:\n wcrun [--repeat=N] [--cache=warm|cold] [--program=CMD]... [--file=FILE]... [--options=OPTS]...\n");
+    printf("where:\n");
+    printf(" --repeat=N\n\tTimes to run each program (default 20).\n");
+    printf(" --copies=N\n\tHow many times to name the file on the command-line, so that\n");
+    printf("\tstarting up is a small part of the time (default 10, and 1 when cold).\n");
+    printf(" --cache=warm|cold\n\tWhether the files are in the page-cache (default warm).\n");
+    printf("\tCold runs show wall-clock time, which includes waiting for the disk.\n");
+    printf(" --program=CMD\n\tA program to run (default: all of them).\n");
+    printf(" --file=FILE\n\tA file to count (default: the files made by 'make bench').\n");
+    printf(" --options=OPTS\n\tOptions to run them with (default: -lwm and -lwc).\n");
+    printf(" --locale=NAME\n\tThe locale for options with -m (default C.UTF-8).\n");
+    printf(" --output=DIR\n\tWhere to write REVISION.json (default bench-results).\n");
+}
+
+static struct config
+read_command_line(int argc, char *argv[])
+{
+    struct config cfg;
+    size_t j;
+    int i;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.repeat = 20;
+    cfg.copies = 10;
+    cfg.output_dir = "bench-results";
+    cfg.locale = "C.UTF-8";
+
+    errno = EINVAL;
+
+    for (i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--help") == 0) {
+            print_help();
+            exit(0);
+        } else if (strncmp(argv[i], "--repeat=", 9) == 0) {
+            cfg.repeat = strtoul(argv[i] + 9, NULL, 10);
+            if (cfg.repeat == 0) {
+                perror(argv[i]);
+                exit(1);
+            }
+        } else if (strncmp(argv[i], "--copies=", 9) == 0) {
+            cfg.copies = strtoul(argv[i] + 9, NULL, 10);
+            if (cfg.copies == 0 || cfg.copies > MAX_ITEMS) {
+                perror(argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--cache=warm") == 0) {
+            cfg.is_cold = 0;
+        } else if (strcmp(argv[i], "--cache=cold") == 0) {
+            cfg.is_cold = 1;
+        } else if (strncmp(argv[i], "--program=", 10) == 0 && cfg.program_count < MAX_ITEMS) {
+            cfg.programs[cfg.program_count++].name = argv[i] + 10;
+        } else if (strncmp(argv[i], "--file=", 7) == 0 && cfg.file_count < MAX_ITEMS) {
+            cfg.files[cfg.file_count++] = argv[i] + 7;
+        } else if (strncmp(argv[i], "--options=", 10) == 0 && cfg.option_set_count < MAX_ITEMS) {
+            cfg.option_sets[cfg.option_set_count++].options = argv[i] + 10;
+        } else if (strncmp(argv[i], "--locale=", 9) == 0) {
+            cfg.locale = argv[i] + 9;
+        } else if (strncmp(argv[i], "--output=", 9) == 0) {
+            cfg.output_dir = argv[i] + 9;
+        } else {
+            perror(argv[i]);
+            exit(1);
+        }
+    }
+
+    if (cfg.program_count == 0) {
+        for (j=0; default_programs[j].name; j++)
+            cfg.programs[cfg.program_count++] = default_programs[j];
+    }
+    if (cfg.file_count == 0) {
+        for (j=0; default_files[j]; j++)
+            cfg.files[cfg.file_count++] = default_files[j];
+    }
+    if (cfg.option_set_count == 0) {
+        cfg.option_sets[cfg.option_set_count++].options = "-lwm";
+        cfg.option_sets[cfg.option_set_count++].options = "-lwc";
+    }
+
+    /* The kernel only drops a file from the page-cache between runs, so
+     * any copy after the first would be read from the cache */
+    if (cfg.is_cold)
+        cfg.copies = 1;
+
+    /* Like the old scripts, characters are counted in a UTF-8 locale,
+     * and bytes in the "C" locale */
+    for (j=0; j<cfg.option_set_count; j++)
+        cfg.option_sets[j].locale = strchr(cfg.option_sets[j].options, 'm') ? cfg.locale : "C";
+    return cfg;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct config cfg;
+    char revision[256];
+    char filename[1024];
+    char tmpname[1100];
+    struct utsname name;
+    double *user, *wall;
+    const char *separator = "";
+    FILE *fp;
+    size_t i, j, k;
+    unsigned n;
+
+    cfg = read_command_line(argc, argv);
+
+    user = malloc(cfg.repeat * sizeof(user[0]));
+    wall = malloc(cfg.repeat * sizeof(wall[0]));
+    if (user == NULL || wall == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    get_revision(revision, sizeof(revision));
+    if (mkdir(cfg.output_dir, 0777) != 0 && errno != EEXIST) {
+        perror(cfg.output_dir);
+        return 1;
+    }
+    snprintf(filename, sizeof(filename), "%s/%s.json", cfg.output_dir, revision);
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+    fp = fopen(tmpname, "w");
+    if (fp == NULL) {
+        perror(tmpname);
+        return 1;
+    }
+    if (uname(&name) != 0)
+        memset(&name, 0, sizeof(name));
+
+    /* One line per measurement, in a fixed order, so that 'diff' lines
+     * them up. The time it was run is left out, since that would make
+     * every file differ */
+    fprintf(fp, "{\"revision\":\"%s\",\"host\":\"%s %s %s\",\"cache\":\"%s\",\"repeat\":%u,\"copies\":%u,\"results\":[\n",
+            revision, name.sysname, name.release, name.machine, cfg.is_cold ? "cold" : "warm",
+            cfg.repeat, cfg.copies);
+    printf("%-16s %-6s %-16s %9s %9s %19s (%s time)\n", "program", "opts", "file", "median", "p95", "95% ci",
+           cfg.is_cold ? "wall" : "user");
+
+    for (i=0; i<cfg.program_count; i++) {
+        const struct program *program = &cfg.programs[i];
+
+        if (!is_runnable(program->name)) {
+            fprintf(stderr, "wcrun: %s: skipped, not built or not installed\n", program->name);
+            continue;
+        }
+        for (j=0; j<cfg.option_set_count; j++) {
+            const struct option_set *set = &cfg.option_sets[j];
+
+            if (program->fixed_options && strcmp(program->fixed_options, set->options) != 0)
+                continue;
+
+            for (k=0; k<cfg.file_count; k++) {
+                const char *file = cfg.files[k];
+                struct stats user_stats, wall_stats;
+                const struct stats *shown;
+                int err = 0;
+
+                if (access(file, R_OK) != 0) {
+                    fprintf(stderr, "wcrun: %s: skipped, %s\n", file, strerror(errno));
+                    continue;
+                }
+
+                /* With a warm cache, the first run is thrown away, since
+                 * it's the one that loads the file */
+                if (!cfg.is_cold)
+                    err = run_once(program, set, file, &cfg, &user[0], &wall[0]);
+                for (n=0; n<cfg.repeat && err == 0; n++) {
+                    if (cfg.is_cold)
+                        evict_file(file);
+                    err = run_once(program, set, file, &cfg, &user[n], &wall[n]);
+                }
+                if (err) {
+                    fprintf(stderr, "wcrun: %s %s %s: failed\n", program->name, set->options, file);
+                    continue;
+                }
+
+                user_stats = calculate_stats(user, cfg.repeat);
+                wall_stats = calculate_stats(wall, cfg.repeat);
+
+                shown = cfg.is_cold ? &wall_stats : &user_stats;
+                printf("%-16s %-6s %-16s %9.4f %9.4f %9.4f-%-9.4f\n", program->name, set->options, file,
+                       shown->median, shown->p95, shown->ci_low, shown->ci_high);
+                fflush(stdout);
+
+                fprintf(fp, "%s{\"program\":\"%s\",\"options\":\"%s\",\"locale\":\"%s\",\"file\":\"%s\",",
+                        separator, program->name, set->options, set->locale, file);
+                print_stats(fp, "user", &user_stats);
+                fprintf(fp, ",");
+                print_stats(fp, "wall", &wall_stats);
+                fprintf(fp, "}");
+                separator = ",\n";
+            }
+        }
+    }
+
+    fprintf(fp, "\n]}\n");
+    if (fclose(fp) != 0 || rename(tmpname, filename) != 0) {
+        perror(filename);
+        remove(tmpname);
+        return 1;
+    }
+    fprintf(stderr, "wcrun: wrote %s\n", filename);
+    free(user);
+    free(wall);
+    return 0;
+}
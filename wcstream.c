@@ -1,28 +1,376 @@
 /*
-    Copies <stdin> to <stdout> one byte at a time. This is intended
-    to expose a bug in `wc` whereby it gives different results 
-    depending on how many bytes it reads at a time.
+    Copies <stdin> to <stdout> in fragments. This is intended to expose
+    bugs in 'wc' whereby it gives different results depending on how
+    many bytes it reads at a time, like the one in macOS's 'wc', and to
+    measure how fast a 'wc' is when a pipe gives it short reads.
+
+    How the input is cut up is chosen with '--chunks':
+
+        one         a byte at a time, which is the default, and all that
+                    this program used to do
+        fixed       '--size' bytes at a time
+        random      random sizes from 1 byte to '--max', as many of each
+                    power of two, so mostly short ones
+        adversarial cuts that land inside multibyte characters, with
+                    tiny writes and the occasional burst of up to 1M,
+                    starting with a single byte
+
+    With '--delay', it sleeps between writes, so that the reader gets
+    each fragment on its own, instead of the pipe joining them back
+    together when the reader is slower than the writer. The random
+    choices come from '--seed', so the same seed cuts the same input
+    the same way every time:
+
+        $ ./wctool utf8 --size=16M | ./wcstream --chunks=adversarial --seed=3 | ./wc2 -lwm
 */
-#include <unistd.h>
+#define _GNU_SOURCE
+#include "wcgen.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+    BUF_SIZE = 2 * 1024 * 1024,
+    MAX_BURST = 1024 * 1024,
+    LOOKAHEAD = 64 * 1024
+};
+
+enum {CHUNKS_ONE, CHUNKS_FIXED, CHUNKS_RANDOM, CHUNKS_ADVERSARIAL};
+
+static const char *chunks_names[] = {"one", "fixed", "random", "adversarial", NULL};
+
+struct config {
+    unsigned chunks;
+    size_t size;
+    size_t max;
+    size_t first;
+    unsigned long delay_min;
+    unsigned long delay_max;
+    unsigned seed;
+};
+
+/**
+ * The input, read ahead far enough to see where the next multibyte
+ * character is, or to write a burst in one go.
+ */
+struct input {
+    unsigned char *buf;
+    size_t head;
+    size_t tail;
+    int is_eof;
+};
+
+/**
+ * A random number up to about a billion, from two of the 15-bit numbers
+ * that 'wcgen_rand()' gives
+ */
+static unsigned
+rand30(unsigned *seed)
+{
+    return wcgen_rand(seed) << 15 | wcgen_rand(seed);
+}
+
+/**
+ * A random number from 1 to 'max', picking the power of two first, so
+ * that sizes of every magnitude are as likely as each other.
+ */
+static size_t
+rand_size(unsigned *seed, size_t max)
+{
+    unsigned bits = 0;
+    size_t n;
+
+    while (bits < 30 && ((size_t)1 << (bits + 1)) <= max)
+        bits++;
+    bits = wcgen_rand(seed) % (bits + 1);
+    n = ((size_t)1 << bits) + rand30(seed) % ((size_t)1 << bits);
+    return n > max ? max : n;
+}
+
+/**
+ * Make sure at least 'want' bytes are buffered, unless the input ends
+ * first, returning how many there are.
+ */
+static size_t
+fill(struct input *in, size_t want)
+{
+    if (in->tail - in->head >= want || in->is_eof)
+        return in->tail - in->head;
 
-int main()
+    memmove(in->buf, in->buf + in->head, in->tail - in->head);
+    in->tail -= in->head;
+    in->head = 0;
+
+    while (in->tail - in->head < want && !in->is_eof) {
+        ssize_t count = read(STDIN_FILENO, in->buf + in->tail, BUF_SIZE - in->tail);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0) {
+            perror("<stdin>");
+            exit(1);
+        }
+        if (count == 0)
+            in->is_eof = 1;
+        in->tail += (size_t)count;
+    }
+    return in->tail - in->head;
+}
+
+static void
+write_all(const unsigned char *buf, size_t length)
+{
+    while (length) {
+        ssize_t count = write(STDOUT_FILENO, buf, length);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0) {
+            perror("<stdout>");
+            exit(1);
+        }
+        buf += count;
+        length -= (size_t)count;
+    }
+}
+
+static void
+sleep_between(const struct config *cfg, unsigned *seed)
 {
+    unsigned long usecs = cfg->delay_min;
+    struct timespec ts;
+
+    if (cfg->delay_max > cfg->delay_min)
+        usecs += rand30(seed) % (cfg->delay_max - cfg->delay_min + 1);
+    if (usecs == 0)
+        return;
+    ts.tv_sec = usecs / 1000000;
+    ts.tv_nsec = (long)(usecs % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+/**
+ * How many bytes a UTF-8 sequence is, from its first byte, or zero if
+ * the byte can't start one.
+ */
+static size_t
+utf8_length(unsigned char c)
+{
+    if ((c & 0xE0) == 0xC0)
+        return 2;
+    if ((c & 0xF0) == 0xE0)
+        return 3;
+    if ((c & 0xF8) == 0xF0)
+        return 4;
+    return 0;
+}
+
+/**
+ * The next adversarial cut. Mostly this lands after the first, second,
+ * or third byte of the next multibyte character, so the reader has to
+ * carry a partial character from one read to the next. Otherwise it's
+ * a tiny write, to land inside words, or a burst.
+ */
+static size_t
+next_adversarial(struct input *in, unsigned *seed)
+{
+    unsigned r = wcgen_rand(seed) % 16;
+    size_t available;
+    size_t i;
+
+    if (r == 0)
+        return rand_size(seed, MAX_BURST);
+    if (r >= 12)
+        return 1 + wcgen_rand(seed) % 3;
+
+    available = fill(in, LOOKAHEAD + 4);
+    for (i=0; i<available && i<LOOKAHEAD; i++) {
+        size_t n = utf8_length(in->buf[in->head + i]);
+        if (n)
+            return i + 1 + wcgen_rand(seed) % (n - 1);
+    }
+    return 1 + wcgen_rand(seed) % 7;
+}
+
+static size_t
+next_size(const struct config *cfg, struct input *in, unsigned *seed)
+{
+    switch (cfg->chunks) {
+    case CHUNKS_FIXED:
+        return cfg->size;
+    case CHUNKS_RANDOM:
+        return rand_size(seed, cfg->max);
+    case CHUNKS_ADVERSARIAL:
+        return next_adversarial(in, seed);
+    default:
+        return 1;
+    }
+}
+
+static void
+shape(const struct config *cfg)
+{
+    struct input in;
+    unsigned seed = cfg->seed;
+    int is_first = 1;
+
+    memset(&in, 0, sizeof(in));
+    in.buf = malloc(BUF_SIZE);
+    if (in.buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
     for (;;) {
-        char buf[65536];
         size_t length;
-        size_t i;
+        size_t available;
+
+        if (is_first && cfg->first)
+            length = cfg->first;
+        else
+            length = next_size(cfg, &in, &seed);
+        if (length > MAX_BURST)
+            length = MAX_BURST;
 
-        length = read(STDIN_FILENO, buf, sizeof(buf));
-        if (length <= 0)
+        available = fill(&in, length);
+        if (available == 0)
             break;
-        for (i=0; i<length; i++) {
-            size_t count;
+        if (length > available)
+            length = available;
+
+        if (!is_first)
+            sleep_between(cfg, &seed);
+        write_all(in.buf + in.head, length);
+        in.head += length;
+        is_first = 0;
+    }
+    free(in.buf);
+}
+
+/**
+ * Parses a size like "64K", returning 0 if it isn't one.
+ */
+static size_t
+parse_size(const char *str)
+{
+    char *end;
+    unsigned long long size = strtoull(str, &end, 10);
+
+    switch (toupper(*end)) {
+    case 'M': size *= 1024;
+    /* fall through */
+    case 'K': size *= 1024;
+        end++;
+        break;
+    }
+    if (end == str || *end != '\0')
+        return 0;
+    return (size_t)size;
+}
 
-            count = write(STDOUT_FILENO, buf+i, 1);
-            if (count <= 0)
+/**
+ * Parses a delay in microseconds, either "N" or a range "N-M",
+ * returning nonzero if it isn't one.
+ */
+static int
+parse_delay(const char *str, unsigned long *min, unsigned long *max)
+{
+    char *end;
+
+    *min = strtoul(str, &end, 10);
+    *max = *min;
+    if (end != str && *end == '-') {
+        str = end + 1;
+        *max = strtoul(str, &end, 10);
+    }
+    if (end == str || *end != '\0' || *max < *min)
+        return 1;
+    return 0;
+}
+
+static void
+print_help(void)
+{
+    printf("wcstream -- copy <stdin> to <stdout> in fragments, for testing 'wc'\n");
+    printf("use:\n wcstream [--chunks=MODE] [--size=N] [--max=N] [--first=N] [--delay=USECS] [--seed=N]\n");
+    printf(" --chunks=MODE\n\tHow to cut up the input (default one):\n");
+    printf("\tone         a byte at a time\n");
+    printf("\tfixed       --size bytes at a time\n");
+    printf("\trandom      random sizes from 1 to --max, mostly short\n");
+    printf("\tadversarial cuts inside multibyte characters, tiny writes, and bursts\n");
+    printf(" --size=N\n\tFor 'fixed', the size of each write, with an optional K or M (default 4K).\n");
+    printf(" --max=N\n\tFor 'random', the largest write (default 64K).\n");
+    printf(" --first=N\n\tThe size of the first write (default 1 for 'adversarial').\n");
+    printf("Sizes can be at most 1M, the most that is written at once.\n");
+    printf(" --delay=USECS\n\tMicroseconds to sleep between writes, or a range N-M to pick from.\n");
+    printf(" --seed=N\n\tFor the random choices, the same seed cutting the same way (default 0).\n");
+}
+
+static struct config
+read_command_line(int argc, char *argv[])
+{
+    struct config cfg;
+    int i;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.size = 4096;
+    cfg.max = 65536;
+
+    errno = EINVAL;
+    for (i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            print_help();
+            exit(0);
+        } else if (strncmp(argv[i], "--chunks=", 9) == 0) {
+            size_t j;
+            for (j=0; chunks_names[j]; j++) {
+                if (strcmp(argv[i] + 9, chunks_names[j]) == 0)
+                    break;
+            }
+            if (chunks_names[j] == NULL) {
+                perror(argv[i]);
+                exit(1);
+            }
+            cfg.chunks = (unsigned)j;
+        } else if (strncmp(argv[i], "--size=", 7) == 0
+                || strncmp(argv[i], "--max=", 6) == 0
+                || strncmp(argv[i], "--first=", 8) == 0) {
+            size_t size = parse_size(strchr(argv[i], '=') + 1);
+            if (size == 0 || size > MAX_BURST) {
+                perror(argv[i]);
                 exit(1);
+            }
+            if (argv[i][2] == 's')
+                cfg.size = size;
+            else if (argv[i][2] == 'm')
+                cfg.max = size;
+            else
+                cfg.first = size;
+        } else if (strncmp(argv[i], "--delay=", 8) == 0) {
+            if (parse_delay(argv[i] + 8, &cfg.delay_min, &cfg.delay_max) != 0) {
+                perror(argv[i]);
+                exit(1);
+            }
+        } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+            cfg.seed = strtoul(argv[i] + 7, NULL, 0);
+        } else {
+            perror(argv[i]);
+            exit(1);
         }
     }
+
+    if (cfg.chunks == CHUNKS_ADVERSARIAL && cfg.first == 0)
+        cfg.first = 1;
+    return cfg;
+}
+
+int main(int argc, char *argv[])
+{
+    struct config cfg = read_command_line(argc, argv);
+
+    shape(&cfg);
     return 0;
 }
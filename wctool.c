@@ -1,11 +1,33 @@
 /* Generates random text with spaces to stress 'wc' programs,
- * in particular, to stress branch prediction units */
+ * in particular, to stress branch prediction units.
+ *
+ * The text is generated in blocks of 1 megabyte, each from its own
+ * seed, made from the block number and the '--seed', so that the
+ * blocks can be generated by several threads at once and still come
+ * out the same no matter how many threads there are. Generators that
+ * are in the middle of something at the end of a block, like a run of
+ * NULs, start over in the next one.
+ *
+ * With '--output', it also counts the text while generating it, the
+ * same way 'wc2' does, and writes the counts to a manifest next to it,
+ * so that '--check' can test 'wc2' on files far too big to check with
+ * another 'wc'. */
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
 #include <string.h>
 #include <locale.h>
+#include <wctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "wcgen.h"
 
 enum {FILESIZE=92296537};
+enum {BLOCK_SIZE=1024*1024};
 
 unsigned 
 utf8_to_ucs4(unsigned char *buf, size_t sizeof_buf)
@@ -60,103 +82,912 @@ size_t ucs4_to_utf8(unsigned char *buf, size_t sizeof_buf, unsigned wchar)
 }
 
 
+struct config {
+    const struct wcgen_profile *profile;
+    unsigned long long size;
+    unsigned seed;
+    unsigned thread_count;
+    struct wcgen_params params;
+    const char *output;
+    const char *manifest;
+    const char *locale;
+    const char *check;
+    const char *wc;
+    int is_counting;
+};
+
+/**
+ * The counts for some part of the text, as 'wc2' counts them, both as
+ * bytes (-lwc) and as UTF-8 characters (-lwm). Words are counted as if
+ * the part came after a space, and 'first' and 'last' are whether the
+ * first and last characters are part of a word (or -1 if there are no
+ * characters), so that the counts of neighbouring parts can be added.
+ */
+struct tally {
+    unsigned long long lines;
+    unsigned long long words;
+    unsigned long long bytes;
+    unsigned long long chars;
+    unsigned long long words_m;
+    int first;
+    int last;
+    int first_m;
+    int last_m;
+};
+
+/**
+ * Which bytes and which characters are spaces in the chosen locale,
+ * filled in before any counting starts.
+ */
+static unsigned char byte_is_space[256];
+static unsigned char char_is_space[0x110000 / 8];
+
+static void
+init_spaces(void)
+{
+    unsigned c;
+
+    for (c=0; c<256; c++)
+        byte_is_space[c] = isspace(c) ? 1 : 0;
+    for (c=0; c<0x110000; c++) {
+        int is_space = (c < 0x80) ? byte_is_space[c] : (iswspace(c) != 0);
+        if (is_space)
+            char_is_space[c >> 3] |= (unsigned char)(1 << (c & 7));
+    }
+}
+
+/**
+ * Decodes one UTF-8 character, returning its length, or 0 if it's
+ * illegal, overlong, a surrogate, past U+10FFFF, or cut short.
+ */
+static size_t
+decode_utf8(const unsigned char *p, size_t n, unsigned *wc)
+{
+    unsigned c = p[0];
+    unsigned lo = 0x80;
+    unsigned hi = 0xBF;
+    size_t len;
+    size_t i;
+
+    if (c < 0x80) {
+        *wc = c;
+        return 1;
+    } else if (c >= 0xC2 && c <= 0xDF) {
+        len = 2;
+        *wc = c & 0x1F;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        len = 3;
+        *wc = c & 0x0F;
+        if (c == 0xE0)
+            lo = 0xA0;
+        else if (c == 0xED)
+            hi = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        len = 4;
+        *wc = c & 0x07;
+        if (c == 0xF0)
+            lo = 0x90;
+        else if (c == 0xF4)
+            hi = 0x8F;
+    } else
+        return 0;
+
+    if (n < len)
+        return 0;
+    if (p[1] < lo || p[1] > hi)
+        return 0;
+    for (i=1; i<len; i++) {
+        if ((p[i] & 0xC0) != 0x80)
+            return 0;
+        *wc = *wc << 6 | (p[i] & 0x3F);
+    }
+    return len;
+}
+
+/**
+ * Counts some text. With '-m', illegal bytes are skipped one at a time,
+ * and count as neither a character, nor a space, nor part of a word.
+ */
+static void
+tally_text(struct tally *t, const unsigned char *buf, size_t length)
+{
+    int was_space = 1;
+    size_t i;
+
+    memset(t, 0, sizeof(*t));
+    t->bytes = length;
+    t->first = t->last = t->first_m = t->last_m = -1;
+
+    for (i=0; i<length; i++) {
+        int is_space = byte_is_space[buf[i]];
+        t->lines += (buf[i] == '\n');
+        t->words += (was_space && !is_space);
+        was_space = is_space;
+    }
+    if (length) {
+        t->first = !byte_is_space[buf[0]];
+        t->last = !was_space;
+    }
+
+    was_space = 1;
+    for (i=0; i<length; ) {
+        unsigned wc;
+        size_t len = decode_utf8(buf + i, length - i, &wc);
+        int is_space;
+
+        if (len == 0) {
+            i++;
+            continue;
+        }
+        is_space = (char_is_space[wc >> 3] >> (wc & 7)) & 1;
+        t->chars++;
+        t->words_m += (was_space && !is_space);
+        if (t->first_m < 0)
+            t->first_m = !is_space;
+        t->last_m = !is_space;
+        was_space = is_space;
+        i += len;
+    }
+}
+
+/**
+ * Adds the counts of the part that comes next, where a word that
+ * crosses from one part into the next counts once.
+ */
+static void
+tally_add(struct tally *total, const struct tally *part)
+{
+    total->lines += part->lines;
+    total->words += part->words - (total->last == 1 && part->first == 1);
+    total->bytes += part->bytes;
+    total->chars += part->chars;
+    total->words_m += part->words_m - (total->last_m == 1 && part->first_m == 1);
+    if (part->last >= 0)
+        total->last = part->last;
+    if (part->last_m >= 0)
+        total->last_m = part->last_m;
+}
+
+/**
+ * A buffer for one block, passed from the thread that generates it
+ * to the main thread that writes it.
+ */
+struct slot {
+    enum {SLOT_FREE, SLOT_BUSY, SLOT_READY} status;
+    unsigned long long block;
+    size_t length;
+    unsigned char *buf;
+    size_t head;
+    size_t tail;
+    struct tally tally;
+};
+
+struct pipeline {
+    const struct config *cfg;
+    pthread_mutex_t lock;
+    pthread_cond_t is_free;
+    pthread_cond_t is_ready;
+    struct slot *slots;
+    size_t slot_count;
+    unsigned long long next_block;
+    int is_done;
+};
+
+/**
+ * The seed for a block, mixing the bits of the block number into
+ * the seed the user chose, so that neighbouring blocks aren't related.
+ */
 static unsigned
-r_rand(unsigned *seed)
+block_seed(unsigned seed, unsigned long long block)
+{
+    unsigned long long x = seed ^ (block * 0x9e3779b97f4a7c15ULL);
+
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x = x ^ (x >> 31);
+    return (unsigned)x;
+}
+
+/**
+ * Counts a block, except for the bytes at either end that may belong to
+ * a character that crosses into the next or previous block. Those are
+ * continuation bytes (10xx xxxx), which can't start a character, so the
+ * counted part is from the first byte that isn't one, up to the last.
+ */
+static void
+tally_block(struct slot *slot)
+{
+    size_t head = 0;
+    size_t tail = slot->length;
+
+    while (head < slot->length && (slot->buf[head] & 0xC0) == 0x80)
+        head++;
+    if (head < slot->length) {
+        while ((slot->buf[tail - 1] & 0xC0) == 0x80)
+            tail--;
+        tail--;
+    } else
+        tail = head;
+    slot->head = head;
+    slot->tail = tail;
+    tally_text(&slot->tally, slot->buf + head, tail - head);
+}
+
+/**
+ * The bytes between the counted parts of two blocks, which are counted
+ * together once both blocks are done.
+ */
+struct carry {
+    unsigned char *buf;
+    size_t length;
+    size_t max;
+};
+
+static void
+carry_append(struct carry *carry, const unsigned char *buf, size_t length)
+{
+    if (carry->length + length > carry->max) {
+        carry->max = (carry->length + length) * 2;
+        carry->buf = realloc(carry->buf, carry->max);
+        if (carry->buf == NULL)
+            abort();
+    }
+    memcpy(carry->buf + carry->length, buf, length);
+    carry->length += length;
+}
+
+static void
+carry_flush(struct carry *carry, struct tally *total)
+{
+    struct tally part;
+
+    tally_text(&part, carry->buf, carry->length);
+    tally_add(total, &part);
+    carry->length = 0;
+}
+
+/**
+ * Writes the counts as a line of JSON, with the same names for them as
+ * 'wc2 --format=json', except that the words counted with '-m' are
+ * 'words_m'. The file is named relative to the manifest, or is null
+ * when the text went to <stdout>.
+ */
+static int
+write_manifest(const struct config *cfg, const struct tally *total)
+{
+    char file[1024] = "null";
+    FILE *fp;
+
+    if (cfg->output) {
+        const char *name = strrchr(cfg->output, '/');
+        snprintf(file, sizeof(file), "\"%s\"", name ? name + 1 : cfg->output);
+    }
+    fp = fopen(cfg->manifest, "w");
+    if (fp == NULL) {
+        perror(cfg->manifest);
+        return 1;
+    }
+    fprintf(fp, "{\"file\":%s,\"profile\":\"%s\",\"seed\":%u,"
+                "\"illegal\":%u,\"overlong\":%u,\"locale\":\"%s\","
+                "\"lines\":%llu,\"words\":%llu,\"bytes\":%llu,"
+                "\"chars\":%llu,\"words_m\":%llu}\n",
+                file, cfg->profile->name, cfg->seed,
+                cfg->params.illegal, cfg->params.overlong,
+                setlocale(LC_CTYPE, NULL),
+                total->lines, total->words, total->bytes,
+                total->chars, total->words_m);
+    if (fclose(fp) != 0) {
+        perror(cfg->manifest);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Takes the next block nobody has claimed yet, waits for its slot to be
+ * written out and freed, then fills it.
+ */
+static void *
+worker_thread(void *arg)
 {
-    static const unsigned a = 214013;
-    static const unsigned c = 2531011;
+    struct pipeline *p = (struct pipeline *)arg;
+    const struct config *cfg = p->cfg;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        unsigned long long block = p->next_block++;
+        struct slot *slot = &p->slots[block % p->slot_count];
+        struct wcgen_state state;
+
+        while (!p->is_done && slot->status != SLOT_FREE)
+            pthread_cond_wait(&p->is_free, &p->lock);
+        if (p->is_done)
+            break;
+        slot->status = SLOT_BUSY;
+        slot->block = block;
+        pthread_mutex_unlock(&p->lock);
 
-    *seed = (*seed) * a + c;
-    return (*seed)>>16 & 0x7fff;
+        wcgen_init(&state, block_seed(cfg->seed, block), &cfg->params);
+        slot->length = cfg->profile->generate(slot->buf, BLOCK_SIZE, &state);
+        if (cfg->is_counting)
+            tally_block(slot);
+
+        pthread_mutex_lock(&p->lock);
+        slot->status = SLOT_READY;
+        pthread_cond_broadcast(&p->is_ready);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
 }
 
-void gen_utf8(void)
+/**
+ * Writes all of a buffer, which for pipes and terminals may take more
+ * than one 'write()'.
+ */
+static int
+write_all(int fd, const unsigned char *buf, size_t length)
 {
+    while (length) {
+        ssize_t count = write(fd, buf, length);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += count;
+        length -= (size_t)count;
+    }
+    return 0;
+}
+
+/**
+ * Write the generator's text, exactly 'size' bytes of it, to each of
+ * the file descriptors, counting it as it goes if 'is_counting' is set.
+ */
+static int
+generate(const struct config *cfg, const int *fds, size_t fd_count, const char *name, struct tally *total)
+{
+    struct pipeline p;
+    pthread_t *threads;
+    unsigned long long written = 0;
+    unsigned long long block;
+    struct carry carry;
+    int err = 0;
     size_t i;
-    unsigned seed = 0;
-    static const char *list[] = { 
-        "\xe7\x9a\x84",     /* U+7684 的 */
-        "\xe4\xb8\x80",     /* U+4e00 一 */
-        "\xe6\x98\xaf",     /* U+662f 是 */
-        "\xe6\x96\x87",     /* U+6587 文 */
-        "\xe3\x81\xaa",     /* U+306a な */
-        "\xf0\x9f\x98\x82", /* U+1f602 😂 */
-        "\xe2\x9d\xa4\xef\xb8\x8f", /* U+2764 ❤️ */
-        "\xf0\x9f\x92\xa9", /* U+1f4a9 💩 */
-        "\xe2\x80\x83",     /* U+2003   */
-        "\xe1\xa0\x8e",     /* U+180e ᠎ */
-        "\xe3\x80\x80",     /* U+3000 　 */
-        "\n",               /* U+000a */
-        " ",                /* U+0020   */
-        "\xef\xbb\xbf",     /* U+feff ﻿ */
-        "\xe1\x9a\x80",     /* U+1680   */
-        "\t",               /* U+0009   */
-        0};
-
-        
-    fprintf(stderr, "[+] generating utf8 rabndom file\n");
-    for (i=0; i<FILESIZE; ) {
-        const char *out = list[r_rand(&seed)%16];
-        printf("%s", out);
-        i += strlen(out);
-    }
-}
-
-void gen_allword(void)
+
+    memset(total, 0, sizeof(*total));
+    memset(&carry, 0, sizeof(carry));
+    total->last = total->last_m = -1;
+
+    memset(&p, 0, sizeof(p));
+    p.cfg = cfg;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.is_free, NULL);
+    pthread_cond_init(&p.is_ready, NULL);
+    p.slot_count = cfg->thread_count * 2;
+    p.slots = calloc(p.slot_count, sizeof(p.slots[0]));
+    threads = calloc(cfg->thread_count, sizeof(threads[0]));
+    if (p.slots == NULL || threads == NULL)
+        abort();
+    for (i=0; i<p.slot_count; i++) {
+        p.slots[i].buf = malloc(BLOCK_SIZE + WCGEN_SLACK);
+        if (p.slots[i].buf == NULL)
+            abort();
+    }
+    for (i=0; i<cfg->thread_count; i++)
+        pthread_create(&threads[i], NULL, worker_thread, &p);
+
+    /* Write the blocks in order, as they become ready */
+    for (block=0; written < cfg->size && !err; block++) {
+        struct slot *slot = &p.slots[block % p.slot_count];
+        size_t length;
+
+        pthread_mutex_lock(&p.lock);
+        while (slot->status != SLOT_READY || slot->block != block)
+            pthread_cond_wait(&p.is_ready, &p.lock);
+        pthread_mutex_unlock(&p.lock);
+
+        length = slot->length;
+        if (length > cfg->size - written)
+            length = (size_t)(cfg->size - written);
+        for (i=0; i<fd_count && !err; i++) {
+            if (write_all(fds[i], slot->buf, length) != 0) {
+                perror(name);
+                err = 1;
+            }
+        }
+        written += length;
+
+        if (!cfg->is_counting)
+            ;
+        else if (length < slot->length) {
+            /* The last block, cut short, so its counts are wrong */
+            carry_append(&carry, slot->buf, length);
+        } else {
+            carry_append(&carry, slot->buf, slot->head);
+            if (slot->head < slot->length) {
+                carry_flush(&carry, total);
+                tally_add(total, &slot->tally);
+                carry_append(&carry, slot->buf + slot->tail, slot->length - slot->tail);
+            }
+        }
+
+        pthread_mutex_lock(&p.lock);
+        slot->status = SLOT_FREE;
+        pthread_cond_broadcast(&p.is_free);
+        pthread_mutex_unlock(&p.lock);
+    }
+
+    pthread_mutex_lock(&p.lock);
+    p.is_done = 1;
+    pthread_cond_broadcast(&p.is_free);
+    pthread_mutex_unlock(&p.lock);
+    for (i=0; i<cfg->thread_count; i++)
+        pthread_join(threads[i], NULL);
+
+    for (i=0; i<p.slot_count; i++)
+        free(p.slots[i].buf);
+    free(p.slots);
+    free(threads);
+    pthread_cond_destroy(&p.is_ready);
+    pthread_cond_destroy(&p.is_free);
+    pthread_mutex_destroy(&p.lock);
+
+    if (cfg->is_counting)
+        carry_flush(&carry, total);
+    free(carry.buf);
+    return err;
+}
+
+/**
+ * Parses a size like "100M", with a suffix of K, M, G, or T for powers
+ * of 1024, returning 0 if it isn't a number.
+ */
+static unsigned long long
+parse_size(const char *str)
 {
+    char *end;
+    unsigned long long size = strtoull(str, &end, 10);
+
+    switch (toupper(*end)) {
+    case 'T': size *= 1024;
+    /* fall through */
+    case 'G': size *= 1024;
+    /* fall through */
+    case 'M': size *= 1024;
+    /* fall through */
+    case 'K': size *= 1024;
+        end++;
+        break;
+    }
+    if (end == str || *end != '\0')
+        return 0;
+    return size;
+}
+
+/**
+ * Parses a percentage like "0.5" into parts per million, returning
+ * -1 if it isn't one.
+ */
+static long
+parse_percent(const char *str)
+{
+    char *end;
+    double percent = strtod(str, &end);
+
+    if (end == str || *end != '\0' || percent < 0.0 || percent > 100.0)
+        return -1;
+    return (long)(percent * 10000.0 + 0.5);
+}
+
+/**
+ * Finds the value for a key in the one line of JSON in a manifest,
+ * which is simple enough not to need a real parser.
+ */
+static const char *
+manifest_value(const char *json, const char *key)
+{
+    char pattern[64];
+    const char *p;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    p = strstr(json, pattern);
+    return p ? p + strlen(pattern) : NULL;
+}
+
+static unsigned long long
+manifest_number(const char *json, const char *key)
+{
+    const char *p = manifest_value(json, key);
+    return p ? strtoull(p, NULL, 10) : 0;
+}
+
+static int
+manifest_string(const char *json, const char *key, char *buf, size_t sizeof_buf)
+{
+    const char *p = manifest_value(json, key);
     size_t i;
-    char buf[1024];
-    memset(buf, 'x', sizeof(buf));
-    
-    fprintf(stderr, "[+] generating all-word file\n");
-    for (i=0; i<FILESIZE-1024; i += sizeof(buf)) {
-        fwrite(buf, 1, sizeof(buf), stdout);
+
+    if (p == NULL || *p != '"')
+        return 0;
+    for (i=0, p++; *p && *p != '"' && i + 1 < sizeof_buf; p++)
+        buf[i++] = *p;
+    buf[i] = '\0';
+    return 1;
+}
+
+/**
+ * A 'wc' running with one set of options, with its output read
+ * through a pipe, and its input either a file or another pipe.
+ */
+struct checker {
+    const char *options;
+    pid_t pid;
+    int input;
+    int output;
+};
+
+static int
+checker_start(struct checker *c, const char *wc, const char *filename)
+{
+    int in[2] = {-1, -1};
+    int out[2];
+
+    if (pipe(out) != 0 || (filename == NULL && pipe(in) != 0)) {
+        perror("pipe");
+        return 1;
+    }
+    fcntl(out[0], F_SETFD, FD_CLOEXEC);
+    fcntl(out[1], F_SETFD, FD_CLOEXEC);
+    if (filename == NULL) {
+        fcntl(in[0], F_SETFD, FD_CLOEXEC);
+        fcntl(in[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    c->pid = fork();
+    if (c->pid < 0) {
+        perror("fork");
+        return 1;
     }
-    for (; i<FILESIZE; i++) {
-        putchar('x');
+    if (c->pid == 0) {
+        if (filename == NULL)
+            dup2(in[0], 0);
+        dup2(out[1], 1);
+        execlp(wc, wc, c->options, filename, (char *)NULL);
+        perror(wc);
+        _exit(127);
     }
+    close(out[1]);
+    c->output = out[0];
+    c->input = in[1];
+    if (filename == NULL)
+        close(in[0]);
+    return 0;
+}
+
+/**
+ * Reads the first three numbers 'wc' prints, which with '-lwc' or
+ * '-lwm' are the lines, words, and bytes or characters.
+ */
+static int
+checker_finish(struct checker *c, unsigned long long counts[3])
+{
+    char buf[4096];
+    size_t length = 0;
+    ssize_t count;
+    char *p = buf;
+    int status;
+    int i;
+
+    while ((count = read(c->output, buf + length, sizeof(buf) - 1 - length)) > 0)
+        length += (size_t)count;
+    buf[length] = '\0';
+    close(c->output);
+    if (waitpid(c->pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return 1;
+
+    for (i=0; i<3; i++) {
+        char *end;
+        counts[i] = strtoull(p, &end, 10);
+        if (end == p)
+            return 1;
+        p = end;
+    }
+    return 0;
 }
-void gen_allspace(void)
+
+/**
+ * Runs 'wc2' (or any 'wc') on the text a manifest describes, with the
+ * locale it was counted in, and compares what it prints with the
+ * counts in the manifest. When the text went to <stdout> rather than a
+ * file, it's generated again and piped to 'wc2', which tests reading
+ * from a pipe rather than a file, at whatever size it was.
+ */
+static int
+check_manifest(struct config *cfg)
 {
+    char json[4096];
+    char file[1024];
+    char filename[2048];
+    char profile[64];
+    char locale[256];
+    struct checker checkers[2] = {{"-lwc", 0, -1, -1}, {"-lwm", 0, -1, -1}};
+    unsigned long long expected[2][3];
+    size_t length;
+    int is_file;
+    int err = 0;
     size_t i;
-    char buf[1024];
-    memset(buf, ' ', sizeof(buf));
-    
-    fprintf(stderr, "[+] generating all-space file\n");
-    for (i=0; i<FILESIZE-1024; i += sizeof(buf)) {
-        fwrite(buf, 1, sizeof(buf), stdout);
+    FILE *fp;
+
+    fp = fopen(cfg->check, "r");
+    if (fp == NULL) {
+        perror(cfg->check);
+        return 1;
+    }
+    length = fread(json, 1, sizeof(json) - 1, fp);
+    json[length] = '\0';
+    fclose(fp);
+
+    if (!manifest_string(json, "profile", profile, sizeof(profile))
+            || !manifest_string(json, "locale", locale, sizeof(locale))
+            || (cfg->profile = wcgen_find(profile)) == NULL) {
+        fprintf(stderr, "%s: not a manifest\n", cfg->check);
+        return 1;
     }
-    for (; i<FILESIZE; i++) {
-        putchar(' ');
+    cfg->seed = (unsigned)manifest_number(json, "seed");
+    cfg->size = manifest_number(json, "bytes");
+    cfg->params.illegal = (unsigned)manifest_number(json, "illegal");
+    cfg->params.overlong = (unsigned)manifest_number(json, "overlong");
+    cfg->is_counting = 0;
+    expected[0][0] = expected[1][0] = manifest_number(json, "lines");
+    expected[0][1] = manifest_number(json, "words");
+    expected[0][2] = cfg->size;
+    expected[1][1] = manifest_number(json, "words_m");
+    expected[1][2] = manifest_number(json, "chars");
+
+    /* The file is next to the manifest */
+    is_file = manifest_string(json, "file", file, sizeof(file));
+    if (is_file) {
+        const char *slash = strrchr(cfg->check, '/');
+        if (slash)
+            snprintf(filename, sizeof(filename), "%.*s/%s", (int)(slash - cfg->check), cfg->check, file);
+        else
+            snprintf(filename, sizeof(filename), "%s", file);
+    }
+
+    setenv("LC_ALL", locale, 1);
+    for (i=0; i<2; i++) {
+        if (checker_start(&checkers[i], cfg->wc, is_file ? filename : NULL) != 0)
+            return 1;
+    }
+
+    if (!is_file) {
+        int fds[2];
+        struct tally total;
+
+        signal(SIGPIPE, SIG_IGN);
+        fds[0] = checkers[0].input;
+        fds[1] = checkers[1].input;
+        err = generate(cfg, fds, 2, cfg->wc, &total);
+        close(fds[0]);
+        close(fds[1]);
     }
+
+    for (i=0; i<2; i++) {
+        unsigned long long counts[3];
+
+        if (checker_finish(&checkers[i], counts) != 0) {
+            fprintf(stderr, "%s %s: failed\n", cfg->wc, checkers[i].options);
+            err = 1;
+            continue;
+        }
+        if (memcmp(counts, expected[i], sizeof(counts)) != 0) {
+            printf("FAIL %s %s: %llu %llu %llu, expected %llu %llu %llu\n",
+                    cfg->wc, checkers[i].options, counts[0], counts[1], counts[2],
+                    expected[i][0], expected[i][1], expected[i][2]);
+            err = 1;
+        } else
+            printf("ok   %s %s: %llu %llu %llu\n",
+                    cfg->wc, checkers[i].options, counts[0], counts[1], counts[2]);
+    }
+    return err;
+}
+
+static void
+print_help(void)
+{
+    const struct wcgen_profile *profile;
+    size_t i;
+
+    printf("wctool -- generate large files of synthetic text for testing 'wc'\n");
+    printf("use:\n wctool PROFILE [--size=N] [--seed=N] [--threads=N] [--output=FILE]\n");
+    printf("                 [--illegal=PERCENT] [--overlong=PERCENT] [--manifest=FILE]\n");
+    printf(" wctool --check=MANIFEST [--wc=PROGRAM]\n");
+    printf("where PROFILE is one of these, or --profile=NAME:\n");
+    for (i=0; (profile = wcgen_at(i)) != NULL; i++)
+        printf("\t%-10s %s\n", profile->name, profile->description);
+    printf(" --size=N\n\tBytes to generate, with an optional K, M, G, or T (default %u).\n", FILESIZE);
+    printf(" --seed=N\n\tFor the random numbers, the same seed giving the same text (default 0).\n");
+    printf(" --threads=N\n\tThreads generating the text (default the number of CPUs).\n");
+    printf(" --output=FILE\n\tWrite to a file instead of <stdout>.\n");
+    printf(" --illegal=PERCENT\n\tFor 'broken', how many characters are illegal UTF-8 (default 1).\n");
+    printf(" --overlong=PERCENT\n\tFor 'broken', how many characters are overlong (default 1).\n");
+    printf(" --manifest=FILE\n\tWhere to write the counts (default the output with '.manifest' added).\n");
+    printf(" --locale=NAME\n\tThe locale whose spaces separate words (default from the environment).\n");
+    printf(" --check=FILE\n\tCompare what 'wc2 -lwc' and 'wc2 -lwm' count with this manifest.\n");
+    printf(" --wc=PROGRAM\n\tThe program to check (default ./wc2).\n");
+    printf(" --list\n\tList the profiles.\n");
+    printf("With no arguments, prints the LC_CTYPE from the environment.\n");
 }
 
-void gen_ascii(void)
+/**
+ * The old way of choosing a profile, by the first letter or one of
+ * the original options, from before there were more than four.
+ */
+static const char *
+legacy_profile(const char *arg)
 {
+    static const struct {
+        char letter;
+        const char *option;
+        const char *name;
+    } legacy[] = {
+        {'u', "--utf8", "utf8"},
+        {'w', "--allword", "allword"},
+        {'s', "--allspace", "allspace"},
+        {'a', "--ascii", "ascii"},
+    };
     size_t i;
-    unsigned seed = 0;
 
-    fprintf(stderr, "[+] generating ascii random file\n");
-    for (i=0; i<FILESIZE; i++) {
-        putchar(" x\ty\rz\na"[r_rand(&seed)%8]);
+    for (i=0; i<sizeof(legacy)/sizeof(legacy[0]); i++) {
+        char short_option[3] = "-X";
+        short_option[1] = legacy[i].letter;
+        if (strcmp(arg, legacy[i].option) == 0 || strcmp(arg, short_option) == 0)
+            return legacy[i].name;
+        if (arg[0] != '-' && tolower(arg[0]) == legacy[i].letter)
+            return legacy[i].name;
+    }
+    return NULL;
+}
+
+static struct config
+read_command_line(int argc, char *argv[])
+{
+    struct config cfg;
+    long threads;
+    int i;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.size = FILESIZE;
+    cfg.locale = "";
+    cfg.wc = "./wc2";
+    cfg.params.illegal = 10000;
+    cfg.params.overlong = 10000;
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    cfg.thread_count = threads > 0 ? (unsigned)threads : 1;
+
+    errno = EINVAL;
+
+    for (i=1; i<argc; i++) {
+        const char *name = NULL;
+
+        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            print_help();
+            exit(0);
+        } else if (strcmp(argv[i], "--list") == 0) {
+            const struct wcgen_profile *profile;
+            size_t j;
+            for (j=0; (profile = wcgen_at(j)) != NULL; j++)
+                printf("%-10s %s\n", profile->name, profile->description);
+            exit(0);
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            name = argv[i] + 10;
+        } else if (strncmp(argv[i], "--size=", 7) == 0) {
+            cfg.size = parse_size(argv[i] + 7);
+            if (cfg.size == 0) {
+                perror(argv[i]);
+                exit(1);
+            }
+        } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+            cfg.seed = strtoul(argv[i] + 7, NULL, 0);
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            cfg.thread_count = strtoul(argv[i] + 10, NULL, 0);
+            if (cfg.thread_count == 0 || cfg.thread_count > 1024) {
+                perror(argv[i]);
+                exit(1);
+            }
+        } else if (strncmp(argv[i], "--output=", 9) == 0) {
+            cfg.output = argv[i] + 9;
+        } else if (strncmp(argv[i], "--manifest=", 11) == 0) {
+            cfg.manifest = argv[i] + 11;
+        } else if (strncmp(argv[i], "--locale=", 9) == 0) {
+            cfg.locale = argv[i] + 9;
+        } else if (strncmp(argv[i], "--check=", 8) == 0) {
+            cfg.check = argv[i] + 8;
+        } else if (strncmp(argv[i], "--wc=", 5) == 0) {
+            cfg.wc = argv[i] + 5;
+        } else if (strncmp(argv[i], "--illegal=", 10) == 0
+                || strncmp(argv[i], "--overlong=", 11) == 0) {
+            int is_illegal = argv[i][2] == 'i';
+            long ppm = parse_percent(strchr(argv[i], '=') + 1);
+            if (ppm < 0) {
+                perror(argv[i]);
+                exit(1);
+            }
+            if (is_illegal)
+                cfg.params.illegal = (unsigned)ppm;
+            else
+                cfg.params.overlong = (unsigned)ppm;
+        } else if (argv[i][0] != '-' && wcgen_find(argv[i]) != NULL) {
+            name = argv[i];
+        } else if ((name = legacy_profile(argv[i])) == NULL) {
+            perror(argv[i]);
+            exit(1);
+        }
+
+        if (name) {
+            cfg.profile = wcgen_find(name);
+            if (cfg.profile == NULL) {
+                perror(argv[i]);
+                exit(1);
+            }
+        }
+    }
+
+    if (cfg.params.illegal + cfg.params.overlong > 1000000) {
+        fprintf(stderr, "wctool: --illegal and --overlong add up to more than 100%%\n");
+        exit(1);
+    }
+
+    /* A manifest goes next to the file, unless told otherwise */
+    if (cfg.output && cfg.manifest == NULL) {
+        static char manifest[1024];
+        snprintf(manifest, sizeof(manifest), "%s.manifest", cfg.output);
+        cfg.manifest = manifest;
     }
+    cfg.is_counting = (cfg.manifest != NULL);
+    return cfg;
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc > 1 && (tolower(argv[1][0]) == 'u' || strcmp(argv[1], "-u") == 0 || strcmp(argv[1], "--utf8") == 0))
-        gen_utf8();
-    else if (argc > 1 && (tolower(argv[1][0]) == 'w' || strcmp(argv[1], "-w") == 0 || strcmp(argv[1], "--allword") == 0))
-        gen_allword();
-    else if (argc > 1 && (tolower(argv[1][0]) == 's' || strcmp(argv[1], "-s") == 0 || strcmp(argv[1], "--allspace") == 0))
-        gen_allspace();
-    else if (argc > 1 && (tolower(argv[1][0]) == 'a' || strcmp(argv[1], "-a") == 0 || strcmp(argv[1], "--ascii") == 0))
-        gen_ascii();
-    else {
+    struct config cfg = read_command_line(argc, argv);
+    struct tally total;
+    int fd = 1;
+    int err;
+
+    if (cfg.check)
+        return check_manifest(&cfg);
+
+    if (cfg.profile == NULL) {
         setlocale(LC_CTYPE, "");
         printf("LC_CTYPE=%s\n", setlocale(LC_CTYPE, NULL));
+        return 0;
     }
 
-    return 0;
-}
+    if (cfg.is_counting) {
+        if (setlocale(LC_CTYPE, cfg.locale) == NULL) {
+            fprintf(stderr, "%s: unknown locale\n", cfg.locale);
+            return 1;
+        }
+        init_spaces();
+    }
+
+    if (cfg.output) {
+        fd = open(cfg.output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror(cfg.output);
+            return 1;
+        }
+    }
 
+    fprintf(stderr, "[+] generating %s file\n", cfg.profile->name);
+    err = generate(&cfg, &fd, 1, cfg.output ? cfg.output : "<stdout>", &total);
+    if (cfg.output && close(fd) != 0 && !err) {
+        perror(cfg.output);
+        err = 1;
+    }
+    if (cfg.is_counting && !err)
+        err = write_manifest(&cfg, &total);
+    return err;
+}
@@ -0,0 +1,436 @@
+/*
+    Proves that the state-machine in 'libwc2' counts the same as 'wc'
+    would, for every possible input, in a given locale.
+
+    The reference is a second automaton, built straight from the ranges
+    of code points that UTF-8 can encode and from what 'iswspace()' says
+    about each of them. Its states are the prefix of the character being
+    decoded, exactly, plus whether the last character was a space, so it
+    needs no tables of which bytes may follow which. An illegal byte, or
+    a character cut short, counts as nothing, not even the end of a word,
+    and decoding starts again at the first byte that can't continue it,
+    which is what 'mbrtowc()' does when restarted a byte at a time.
+
+    Both are Mealy machines, whose output for each byte is how much it
+    adds to the lines, words, and characters. A breadth-first search of
+    the product of the two, from their start states, visits every pair
+    of states that any input can reach. If the outputs agree on every
+    transition from every pair, the machines agree on every input, and
+    the first pair where they don't gives the shortest input on which
+    they differ. This covers all 1,112,064 characters from U+0000 to
+    U+10FFFF, plus every illegal sequence, in well under a second per
+    locale, where 'selftest_legal()' in 'other/wc2p.c' tries 2^32 byte
+    strings one 'mbrtowc()' at a time.
+
+        $ ./wcverify $(locale -a)
+
+    checks every locale on the machine, which is 'make verify'. With no
+    arguments it checks the default locale from the environment.
+*/
+#define _GNU_SOURCE
+#include "libwc2.h"
+#include <ctype.h>
+#include <errno.h>
+#include <locale.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wctype.h>
+#ifdef __APPLE__
+#include <xlocale.h>
+#endif
+
+enum {CODE_POINTS = 0x110000};
+
+/**
+ * What one byte adds to the counts
+ */
+struct output {
+    unsigned char lines;
+    unsigned char words;
+    unsigned char chars;
+};
+
+/**
+ * The state-machine under test, as a table of next states and outputs,
+ * found by feeding 'wc2_parse()' one byte from each state.
+ */
+struct dfa {
+    unsigned char next[WC2_STATE_MAX][256];
+    struct output output[WC2_STATE_MAX][256];
+};
+
+/**
+ * A state of the reference: whether the last character was a space, and
+ * the bytes so far of the character being decoded, if any, as the bits
+ * of its code point and how many of how many bytes have been seen.
+ */
+struct ref {
+    unsigned was_space;
+    unsigned need;
+    unsigned have;
+    unsigned long cp;
+};
+
+/**
+ * A pair of states in the product, with the pair and byte it was first
+ * reached from, to rebuild the shortest input that reaches it.
+ */
+struct node {
+    uint64_t key;
+    size_t parent;
+    unsigned char c;
+};
+
+struct search {
+    struct node *nodes;
+    size_t count;
+    size_t max;
+    size_t *slots;      /* hash table of indexes into 'nodes', plus one */
+    size_t slot_count;
+    unsigned char *seen; /* a bit for each code point decoded */
+};
+
+static struct dfa *
+dfa_load(const struct wc2_machine *machine)
+{
+    struct dfa *dfa;
+    unsigned s;
+    unsigned c;
+
+    dfa = malloc(sizeof(*dfa));
+    if (dfa == NULL)
+        return NULL;
+
+    for (s=0; s<WC2_STATE_MAX; s++) {
+        for (c=0; c<256; c++) {
+            unsigned char b = (unsigned char)c;
+            unsigned state = s;
+            struct wc2_results x;
+
+            x = wc2_parse(machine, &b, 1, &state);
+            dfa->next[s][c] = (unsigned char)state;
+            dfa->output[s][c].lines = (unsigned char)x.line_count;
+            dfa->output[s][c].words = (unsigned char)x.word_count;
+            dfa->output[s][c].chars = (unsigned char)x.char_count;
+        }
+    }
+    return dfa;
+}
+
+/**
+ * Whether any character of 'need' bytes can start with the bits in 'cp',
+ * which are the first 'have' bytes. Each length encodes its own range
+ * of code points, any shorter encoding being overlong, and no length
+ * encodes the surrogates or anything past U+10FFFF.
+ */
+static int
+is_prefix(unsigned long cp, unsigned need, unsigned have)
+{
+    static const unsigned long first[5] = {0, 0, 0x80, 0x800, 0x10000};
+    static const unsigned long last[5] = {0, 0x7F, 0x7FF, 0xFFFF, 0x10FFFF};
+    unsigned bits = 6 * (need - have);
+    unsigned long lo = cp << bits;
+    unsigned long hi = lo | ((1UL << bits) - 1);
+
+    if (lo < first[need])
+        lo = first[need];
+    if (hi > last[need])
+        hi = last[need];
+    if (lo > hi)
+        return 0;
+    if (lo >= 0xD800 && hi <= 0xDFFF)
+        return 0;
+    return 1;
+}
+
+static void
+ref_emit(struct ref *ref, unsigned long cp, int is_space, struct output *out)
+{
+    out->chars = 1;
+    out->lines = (cp == '\n');
+    out->words = (ref->was_space && !is_space);
+    ref->was_space = is_space;
+    ref->need = 0;
+    ref->have = 0;
+    ref->cp = 0;
+}
+
+/**
+ * One byte through the reference for '-m', which decodes UTF-8 whatever
+ * the locale, and asks the locale only which characters are spaces.
+ */
+static void
+ref_step_chars(struct ref *ref, unsigned char c, locale_t loc, struct search *search, struct output *out)
+{
+    memset(out, 0, sizeof(*out));
+
+    if (ref->need) {
+        if ((c & 0xC0) == 0x80 && is_prefix(ref->cp << 6 | (c & 0x3F), ref->need, ref->have + 1)) {
+            ref->cp = ref->cp << 6 | (c & 0x3F);
+            ref->have++;
+            if (ref->have == ref->need) {
+                unsigned long cp = ref->cp;
+                search->seen[cp / 8] |= 1 << (cp % 8);
+                ref_emit(ref, cp, iswspace_l((wint_t)cp, loc) != 0, out);
+            }
+            return;
+        }
+
+        /* The character is cut short. A continuation byte is illegal
+         * on its own too, anything else starts the next character. */
+        ref->need = 0;
+        ref->have = 0;
+        ref->cp = 0;
+        if ((c & 0xC0) == 0x80)
+            return;
+    }
+
+    if (c < 0x80) {
+        search->seen[c / 8] |= 1 << (c % 8);
+        ref_emit(ref, c, iswspace_l(c, loc) != 0, out);
+    } else if ((c & 0xE0) == 0xC0 && is_prefix(c & 0x1F, 2, 1)) {
+        ref->need = 2;
+        ref->have = 1;
+        ref->cp = c & 0x1F;
+    } else if ((c & 0xF0) == 0xE0 && is_prefix(c & 0x0F, 3, 1)) {
+        ref->need = 3;
+        ref->have = 1;
+        ref->cp = c & 0x0F;
+    } else if ((c & 0xF8) == 0xF0 && is_prefix(c & 0x07, 4, 1)) {
+        ref->need = 4;
+        ref->have = 1;
+        ref->cp = c & 0x07;
+    }
+}
+
+/**
+ * One byte through the reference for '-c', where every byte is a
+ * character, and a space if 'isspace()' says so.
+ */
+static void
+ref_step_bytes(struct ref *ref, unsigned char c, locale_t loc, struct search *search, struct output *out)
+{
+    (void)search;
+    ref_emit(ref, c, isspace_l(c, loc) != 0, out);
+}
+
+static uint64_t
+make_key(unsigned state, const struct ref *ref)
+{
+    return (uint64_t)state
+        | (uint64_t)ref->was_space << 8
+        | (uint64_t)ref->need << 9
+        | (uint64_t)ref->have << 12
+        | (uint64_t)ref->cp << 15;
+}
+
+static void
+split_key(uint64_t key, unsigned *state, struct ref *ref)
+{
+    *state = key & 0xFF;
+    ref->was_space = (key >> 8) & 1;
+    ref->need = (key >> 9) & 7;
+    ref->have = (key >> 12) & 7;
+    ref->cp = (unsigned long)(key >> 15);
+}
+
+static size_t
+hash_key(uint64_t key, size_t slot_count)
+{
+    key ^= key >> 31;
+    key *= 0x7fb5d329728ea185ULL;
+    key ^= key >> 27;
+    return (size_t)key & (slot_count - 1);
+}
+
+/**
+ * Add a pair of states unless it's already been reached, returning
+ * nonzero if it's new.
+ */
+static int
+search_add(struct search *search, uint64_t key, size_t parent, unsigned char c)
+{
+    size_t i;
+
+    if (search->count * 2 >= search->slot_count) {
+        size_t slot_count = search->slot_count ? search->slot_count * 2 : 65536;
+        size_t *slots = calloc(slot_count, sizeof(*slots));
+        size_t j;
+
+        if (slots == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        for (j=0; j<search->count; j++) {
+            i = hash_key(search->nodes[j].key, slot_count);
+            while (slots[i])
+                i = (i + 1) & (slot_count - 1);
+            slots[i] = j + 1;
+        }
+        free(search->slots);
+        search->slots = slots;
+        search->slot_count = slot_count;
+    }
+
+    i = hash_key(key, search->slot_count);
+    while (search->slots[i]) {
+        if (search->nodes[search->slots[i] - 1].key == key)
+            return 0;
+        i = (i + 1) & (search->slot_count - 1);
+    }
+
+    if (search->count == search->max) {
+        size_t max = search->max ? search->max * 2 : 65536;
+        struct node *nodes = realloc(search->nodes, max * sizeof(*nodes));
+        if (nodes == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        search->nodes = nodes;
+        search->max = max;
+    }
+    search->nodes[search->count].key = key;
+    search->nodes[search->count].parent = parent;
+    search->nodes[search->count].c = c;
+    search->slots[i] = ++search->count;
+    return 1;
+}
+
+/**
+ * Print the input that first reaches a pair of states, followed by one
+ * more byte, with anything that isn't printable ASCII escaped.
+ */
+static void
+print_input(const struct search *search, size_t index, unsigned char last)
+{
+    unsigned char buf[64];
+    size_t length = 0;
+    size_t i;
+
+    buf[length++] = last;
+    while (index && length < sizeof(buf)) {
+        buf[length++] = search->nodes[index].c;
+        index = search->nodes[index].parent;
+    }
+
+    printf("\"");
+    for (i=length; i>0; i--) {
+        unsigned char c = buf[i - 1];
+        if (c >= 0x20 && c < 0x7F && c != '"' && c != '\\')
+            printf("%c", c);
+        else
+            printf("\\x%02x", c);
+    }
+    printf("\"");
+}
+
+/**
+ * Search the product of the state-machine and the reference, returning
+ * zero if they agree on everything.
+ */
+static int
+verify(const char *locale, int is_multibyte)
+{
+    struct wc2_machine *machine;
+    struct search search;
+    struct dfa *dfa;
+    locale_t loc;
+    struct ref start;
+    size_t code_points = 0;
+    size_t i;
+    int result = 0;
+
+    loc = newlocale(LC_CTYPE_MASK, locale, (locale_t)0);
+    machine = wc2_machine_create(is_multibyte, locale);
+    if (loc == (locale_t)0 || machine == NULL) {
+        fprintf(stderr, "wcverify: %s: can't load locale\n", locale);
+        if (loc != (locale_t)0)
+            freelocale(loc);
+        wc2_machine_free(machine);
+        return 1;
+    }
+    dfa = dfa_load(machine);
+    wc2_machine_free(machine);
+
+    memset(&search, 0, sizeof(search));
+    search.seen = calloc(CODE_POINTS / 8, 1);
+    if (dfa == NULL || search.seen == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    memset(&start, 0, sizeof(start));
+    start.was_space = 1;
+    search_add(&search, make_key(0, &start), 0, 0);
+
+    for (i=0; i<search.count && result == 0; i++) {
+        unsigned c;
+
+        for (c=0; c<256; c++) {
+            const struct output *x;
+            struct output expected;
+            unsigned state;
+            struct ref ref;
+
+            split_key(search.nodes[i].key, &state, &ref);
+            x = &dfa->output[state][c];
+            if (is_multibyte)
+                ref_step_chars(&ref, (unsigned char)c, loc, &search, &expected);
+            else
+                ref_step_bytes(&ref, (unsigned char)c, loc, &search, &expected);
+
+            if (x->lines != expected.lines || x->words != expected.words || x->chars != expected.chars) {
+                printf("FAIL %s %s: ", locale, is_multibyte ? "-m" : "-c");
+                print_input(&search, i, (unsigned char)c);
+                printf(" adds %u/%u/%u lines/words/chars at the end, expected %u/%u/%u\n",
+                       x->lines, x->words, x->chars,
+                       expected.lines, expected.words, expected.chars);
+                result = 1;
+                break;
+            }
+            search_add(&search, make_key(dfa->next[state][c], &ref), i, (unsigned char)c);
+        }
+    }
+
+    if (result == 0) {
+        for (i=0; i<CODE_POINTS; i++)
+            code_points += (search.seen[i / 8] >> (i % 8)) & 1;
+        printf("ok   %s %s: %lu pairs of states", locale, is_multibyte ? "-m" : "-c", (unsigned long)search.count);
+        if (is_multibyte)
+            printf(", %lu code points", (unsigned long)code_points);
+        printf("\n");
+    }
+
+    free(search.nodes);
+    free(search.slots);
+    free(search.seen);
+    free(dfa);
+    freelocale(loc);
+    return result;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int failures = 0;
+    int i;
+
+    if (argc < 2) {
+        const char *locale = setlocale(LC_CTYPE, "");
+        locale = locale ? strdup(locale) : "C";
+        failures += verify(locale, 0);
+        failures += verify(locale, 1);
+    }
+    for (i=1; i<argc; i++) {
+        if (argv[i][0] == '-') {
+            fprintf(stderr, "usage: wcverify [LOCALE ...]\n");
+            errno = EINVAL;
+            return 1;
+        }
+        failures += verify(argv[i], 0);
+        failures += verify(argv[i], 1);
+    }
+    return failures != 0;
+}